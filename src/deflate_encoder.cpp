@@ -0,0 +1,632 @@
+#include "deflate_encoder.hpp"
+#include "utils/checksum.hpp"
+#include "utils/thread_pool.hpp"
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <stdexcept>
+#include <utility>
+
+static const size_t WINDOW_SIZE = 32768;
+static const size_t WINDOW_MASK = WINDOW_SIZE - 1;
+static const size_t MAX_DIST = WINDOW_SIZE;
+static const int MIN_MATCH = 3;
+static const int MAX_MATCH = 258;
+static const size_t TOO_FAR = 4096; // Length-3 matches further back cost more
+                                    // than three literals
+static const int HASH_BITS = 15;
+static const size_t NO_POS = static_cast<size_t>(-1);
+static const size_t MAX_SYMBOLS = 16384; // Symbols per block
+
+static const int LITLEN_CODES = 286;
+static const int DIST_CODES = 30;
+static const int CODE_LENGTH_CODES = 19;
+static const int MAX_CODE_BITS = 15;
+static const int MAX_CODE_LENGTH_BITS = 7;
+
+// Base values and extra bits for length codes 257-285 and distance codes
+static const uint16_t LENGTH_BASE[29] = {3,  4,  5,  6,   7,   8,   9,   10,
+                                         11, 13, 15, 17,  19,  23,  27,  31,
+                                         35, 43, 51, 59,  67,  83,  99,  115,
+                                         131, 163, 195, 227, 258};
+static const uint8_t LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                         1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                         4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t DIST_BASE[30] = {
+    1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,   49,   65,   97,
+    129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193,
+    12289, 16385, 24577};
+static const uint8_t DIST_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                       4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                       9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// Order in which code length code lengths are sent
+static const uint8_t CODE_LENGTH_ORDER[19] = {16, 17, 18, 0, 8,  7, 9,
+                                              6,  10, 5,  11, 4, 12, 3,
+                                              13, 2,  14, 1,  15};
+
+// Symbol -> code lookups for lengths (indexed by length - 3) and distances
+// (distance - 1 below 256, otherwise 256 + ((distance - 1) >> 7))
+struct CodeLookup {
+  uint8_t length[256];
+  uint8_t distance[512];
+
+  CodeLookup() {
+    for (int code = 0; code < 29; ++code) {
+      for (int k = 0; k < (1 << LENGTH_EXTRA[code]); ++k) {
+        int len = LENGTH_BASE[code] + k;
+        if (len <= MAX_MATCH)
+          length[len - MIN_MATCH] = static_cast<uint8_t>(code);
+      }
+    }
+    for (int code = 0; code < DIST_CODES; ++code) {
+      for (int k = 0; k < (1 << DIST_EXTRA[code]); ++k) {
+        int d = DIST_BASE[code] + k - 1;
+        distance[d < 256 ? d : 256 + (d >> 7)] = static_cast<uint8_t>(code);
+      }
+    }
+  }
+};
+
+static const CodeLookup CODE_LOOKUP;
+
+static inline int lengthCode(int length) {
+  return CODE_LOOKUP.length[length - MIN_MATCH];
+}
+
+static inline int distanceCode(int dist) {
+  int d = dist - 1;
+  return CODE_LOOKUP.distance[d < 256 ? d : 256 + (d >> 7)];
+}
+
+static inline uint32_t hash3(const uint8_t *p) {
+  uint32_t v = (static_cast<uint32_t>(p[0]) << 16) |
+               (static_cast<uint32_t>(p[1]) << 8) | p[2];
+  return (v * 0x9E3779B1u) >> (32 - HASH_BITS);
+}
+
+// Number of equal leading bytes of a and b, at most maxLen
+static inline int matchLength(const uint8_t *a, const uint8_t *b, int maxLen) {
+  int len = 0;
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) &&                            \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (len + 8 <= maxLen) {
+    uint64_t x, y;
+    std::memcpy(&x, a + len, 8);
+    std::memcpy(&y, b + len, 8);
+    if (x != y)
+      return len + (__builtin_ctzll(x ^ y) >> 3);
+    len += 8;
+  }
+#endif
+  while (len < maxLen && a[len] == b[len])
+    ++len;
+  return len;
+}
+
+DeflateEncoder::DeflateEncoder(int level) : level_(level) {
+  static const LevelConfig LEVELS[10] = {
+      {0, 0, 0, 0, false},         // 0: store only
+      {4, 4, 8, 4, false},         // 1-3: greedy
+      {4, 5, 16, 8, false},        //
+      {4, 6, 32, 32, false},       //
+      {4, 4, 16, 16, true},        // 4-6: lazy
+      {8, 16, 32, 32, true},       //
+      {8, 16, 128, 128, true},     //
+      {8, 32, 128, 256, true},     // 7-9: lazy, long chains
+      {32, 128, 258, 1024, true},  //
+      {32, 258, 258, 4096, true}}; //
+  if (level < 0 || level > 9) {
+    throw std::runtime_error("Invalid compression level");
+  }
+  config_ = LEVELS[level];
+  if (level > 0) {
+    head_.resize(size_t(1) << HASH_BITS);
+    prev_.resize(WINDOW_SIZE);
+    symbols_.reserve(MAX_SYMBOLS + 1);
+  }
+}
+
+void DeflateEncoder::compress(const uint8_t *data, size_t size,
+                              size_t dictSize, Flush flush,
+                              std::vector<uint8_t> &out) {
+  dictSize = std::min(dictSize, WINDOW_SIZE);
+  bool last = flush == FINISH;
+
+  if (level_ == 0) {
+    if (size > 0 || last)
+      writeStored(data, size, last);
+  } else if (size > 0) {
+    compressBlocks(data - dictSize, dictSize, dictSize + size, last);
+  } else if (last) {
+    // Empty final block: fixed Huffman holding only the end-of-block code
+    writer_.writeBits(1, 1);
+    writer_.writeBits(1, 2);
+    writer_.writeBits(0, 7);
+  }
+
+  if (flush == SYNC_FLUSH) {
+    writeStored(nullptr, 0, false);
+  } else if (flush == FINISH) {
+    writer_.alignToByte();
+  }
+  writer_.takeBytes(out);
+}
+
+std::vector<uint8_t> DeflateEncoder::zlibCompress(const uint8_t *data,
+                                                  size_t size, int level,
+                                                  ThreadPool *pool) {
+  std::vector<uint8_t> out;
+  writeZlibHeader(out, level);
+  uint32_t adler;
+
+  if (!pool || pool->size() < 2 || size <= SEGMENT_SIZE) {
+    DeflateEncoder encoder(level);
+    encoder.compress(data, size, 0, FINISH, out);
+    adler = Checksum::adler32(data, size);
+  } else {
+    size_t count = (size + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+    std::vector<std::vector<uint8_t>> parts(count);
+    std::vector<uint32_t> adlers(count);
+    pool->parallelFor(count, [&](size_t i) {
+      size_t start = i * SEGMENT_SIZE;
+      size_t len = std::min(SEGMENT_SIZE, size - start);
+      DeflateEncoder encoder(level);
+      encoder.compress(data + start, len, start,
+                       i + 1 == count ? FINISH : SYNC_FLUSH, parts[i]);
+      adlers[i] = Checksum::adler32(data + start, len);
+    });
+
+    adler = adlers[0];
+    for (size_t i = 0; i < count; ++i) {
+      out.insert(out.end(), parts[i].begin(), parts[i].end());
+      if (i > 0) {
+        size_t len = std::min(SEGMENT_SIZE, size - i * SEGMENT_SIZE);
+        adler = Checksum::adler32Combine(adler, adlers[i], len);
+      }
+    }
+  }
+
+  out.push_back((adler >> 24) & 0xFF);
+  out.push_back((adler >> 16) & 0xFF);
+  out.push_back((adler >> 8) & 0xFF);
+  out.push_back(adler & 0xFF);
+  return out;
+}
+
+void DeflateEncoder::writeZlibHeader(std::vector<uint8_t> &out, int level) {
+  // CMF: deflate with a 32 KiB window. FLG: FLEVEL hint plus FCHECK bits
+  // making the 16-bit header a multiple of 31.
+  const uint32_t cmf = 0x78;
+  uint32_t flevel = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+  uint32_t flg = flevel << 6;
+  flg += 31 - ((cmf << 8 | flg) % 31);
+  out.push_back(static_cast<uint8_t>(cmf));
+  out.push_back(static_cast<uint8_t>(flg));
+}
+
+size_t DeflateEncoder::insertHash(const uint8_t *base, size_t pos) {
+  uint32_t h = hash3(base + pos);
+  size_t previous = head_[h];
+  prev_[pos & WINDOW_MASK] = previous;
+  head_[h] = pos;
+  return previous;
+}
+
+int DeflateEncoder::longestMatch(const uint8_t *base, size_t pos, size_t end,
+                                 size_t cand, int prevLength,
+                                 size_t &matchDist) const {
+  int maxLen = static_cast<int>(std::min<size_t>(MAX_MATCH, end - pos));
+  if (maxLen <= prevLength)
+    return 0;
+  int niceLen = std::min(config_.niceLength, maxLen);
+  int chain = config_.maxChain;
+  if (prevLength >= config_.goodLength)
+    chain >>= 2;
+
+  size_t limit = pos > MAX_DIST ? pos - MAX_DIST : 0;
+  const uint8_t *scan = base + pos;
+  int bestLen = prevLength;
+
+  while (cand != NO_POS && cand >= limit && chain-- > 0) {
+    const uint8_t *match = base + cand;
+    // Cheap rejection: the byte that would extend the best match so far
+    if (match[bestLen] == scan[bestLen] && match[0] == scan[0] &&
+        match[1] == scan[1]) {
+      int len = matchLength(match, scan, maxLen);
+      if (len > bestLen) {
+        bestLen = len;
+        matchDist = pos - cand;
+        if (len >= niceLen)
+          break;
+      }
+    }
+    cand = prev_[cand & WINDOW_MASK];
+  }
+  return bestLen > prevLength ? bestLen : 0;
+}
+
+void DeflateEncoder::compressBlocks(const uint8_t *base, size_t start,
+                                    size_t end, bool last) {
+  // Prime the hash chains with the dictionary
+  std::fill(head_.begin(), head_.end(), NO_POS);
+  for (size_t p = 0; p < start && p + MIN_MATCH <= end; ++p)
+    insertHash(base, p);
+
+  symbols_.clear();
+  size_t blockStart = start;
+  size_t pos = start;
+
+  // Ends the current block once the symbol buffer is full. `covered` is the
+  // input offset up to which the buffered symbols reach.
+  auto maybeFlush = [&](size_t covered) {
+    if (symbols_.size() >= MAX_SYMBOLS && covered < end) {
+      writeBlock(base, blockStart, covered, false);
+      symbols_.clear();
+      blockStart = covered;
+    }
+  };
+
+  if (!config_.lazy) {
+    // Greedy: take the longest match at each position
+    while (pos < end) {
+      size_t cand = pos + MIN_MATCH <= end ? insertHash(base, pos) : NO_POS;
+      size_t dist = 0;
+      int len = 0;
+      if (cand != NO_POS && pos - cand <= MAX_DIST)
+        len = longestMatch(base, pos, end, cand, MIN_MATCH - 1, dist);
+
+      if (len >= MIN_MATCH) {
+        symbols_.push_back(
+            {static_cast<uint16_t>(len), static_cast<uint16_t>(dist)});
+        size_t next = pos + len;
+        // Long matches are skipped over without hashing, for speed
+        if (len <= config_.maxLazy) {
+          for (size_t p = pos + 1; p < next && p + MIN_MATCH <= end; ++p)
+            insertHash(base, p);
+        }
+        pos = next;
+      } else {
+        symbols_.push_back({base[pos], 0});
+        ++pos;
+      }
+      maybeFlush(pos);
+    }
+  } else {
+    // Lazy: a match found at pos - 1 is only taken if pos has no longer one
+    int prevLen = MIN_MATCH - 1;
+    size_t prevDist = 0;
+    bool pending = false; // Byte at pos - 1 is not yet emitted
+
+    while (pos < end) {
+      size_t cand = pos + MIN_MATCH <= end ? insertHash(base, pos) : NO_POS;
+      size_t dist = 0;
+      int len = MIN_MATCH - 1;
+      if (cand != NO_POS && pos - cand <= MAX_DIST &&
+          prevLen < config_.maxLazy) {
+        int found = longestMatch(base, pos, end, cand, prevLen, dist);
+        if (found > 0 && !(found == MIN_MATCH && dist > TOO_FAR))
+          len = found;
+      }
+
+      if (prevLen >= MIN_MATCH && len <= prevLen) {
+        symbols_.push_back(
+            {static_cast<uint16_t>(prevLen), static_cast<uint16_t>(prevDist)});
+        size_t next = pos - 1 + prevLen;
+        for (size_t p = pos + 1; p < next && p + MIN_MATCH <= end; ++p)
+          insertHash(base, p);
+        pos = next;
+        pending = false;
+        prevLen = MIN_MATCH - 1;
+        maybeFlush(pos);
+      } else {
+        if (pending) {
+          symbols_.push_back({base[pos - 1], 0});
+          maybeFlush(pos);
+        }
+        pending = true;
+        prevLen = len;
+        prevDist = dist;
+        ++pos;
+      }
+    }
+    // No match can start at the last byte, so it is always a literal
+    if (pending)
+      symbols_.push_back({base[end - 1], 0});
+  }
+
+  writeBlock(base, blockStart, end, last);
+  symbols_.clear();
+}
+
+void DeflateEncoder::writeBlock(const uint8_t *base, size_t rawStart,
+                                size_t rawEnd, bool last) {
+  struct FixedCodes {
+    uint8_t litLens[288];
+    uint16_t litCodes[288];
+    uint8_t distLens[DIST_CODES];
+    uint16_t distCodes[DIST_CODES];
+  };
+  static const FixedCodes fixed = [] {
+    FixedCodes f;
+    for (int i = 0; i < 288; ++i)
+      f.litLens[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+    std::fill(f.distLens, f.distLens + DIST_CODES, 5);
+    buildCodes(f.litLens, 288, f.litCodes);
+    buildCodes(f.distLens, DIST_CODES, f.distCodes);
+    return f;
+  }();
+
+  // Symbol statistics
+  uint32_t litFreq[LITLEN_CODES] = {};
+  uint32_t distFreq[DIST_CODES] = {};
+  uint64_t extraBits = 0;
+  for (const Symbol &s : symbols_) {
+    if (s.dist == 0) {
+      litFreq[s.litLen]++;
+    } else {
+      int lc = lengthCode(s.litLen);
+      int dc = distanceCode(s.dist);
+      litFreq[257 + lc]++;
+      distFreq[dc]++;
+      extraBits += LENGTH_EXTRA[lc] + DIST_EXTRA[dc];
+    }
+  }
+  litFreq[256] = 1;
+
+  uint8_t litLens[LITLEN_CODES];
+  uint8_t distLens[DIST_CODES];
+  buildCodeLengths(litFreq, LITLEN_CODES, MAX_CODE_BITS, litLens);
+  buildCodeLengths(distFreq, DIST_CODES, MAX_CODE_BITS, distLens);
+
+  int hlit = LITLEN_CODES;
+  while (hlit > 257 && litLens[hlit - 1] == 0)
+    --hlit;
+  int hdist = DIST_CODES;
+  while (hdist > 1 && distLens[hdist - 1] == 0)
+    --hdist;
+
+  // Run-length encode both code length sequences with symbols 16-18
+  struct LengthOp {
+    uint8_t symbol;
+    uint8_t extra;
+  };
+  uint8_t allLens[LITLEN_CODES + DIST_CODES];
+  std::memcpy(allLens, litLens, hlit);
+  std::memcpy(allLens + hlit, distLens, hdist);
+  size_t numLens = hlit + hdist;
+
+  std::vector<LengthOp> ops;
+  ops.reserve(numLens);
+  for (size_t i = 0; i < numLens;) {
+    uint8_t len = allLens[i];
+    size_t run = 1;
+    while (i + run < numLens && allLens[i + run] == len)
+      ++run;
+    i += run;
+
+    if (len == 0) {
+      while (run >= 11) {
+        size_t r = std::min<size_t>(run, 138);
+        ops.push_back({18, static_cast<uint8_t>(r - 11)});
+        run -= r;
+      }
+      if (run >= 3) {
+        ops.push_back({17, static_cast<uint8_t>(run - 3)});
+        run = 0;
+      }
+    } else {
+      ops.push_back({len, 0});
+      --run;
+      while (run >= 3) {
+        size_t r = std::min<size_t>(run, 6);
+        ops.push_back({16, static_cast<uint8_t>(r - 3)});
+        run -= r;
+      }
+    }
+    for (; run > 0; --run)
+      ops.push_back({len, 0});
+  }
+
+  uint32_t clFreq[CODE_LENGTH_CODES] = {};
+  for (const LengthOp &op : ops)
+    clFreq[op.symbol]++;
+  uint8_t clLens[CODE_LENGTH_CODES];
+  buildCodeLengths(clFreq, CODE_LENGTH_CODES, MAX_CODE_LENGTH_BITS, clLens);
+  int hclen = CODE_LENGTH_CODES;
+  while (hclen > 4 && clLens[CODE_LENGTH_ORDER[hclen - 1]] == 0)
+    --hclen;
+
+  // Size of each encoding in bits
+  uint64_t dynamicBits = 3 + 5 + 5 + 4 + 3 * hclen + extraBits;
+  uint64_t fixedBits = 3 + extraBits;
+  for (int i = 0; i < CODE_LENGTH_CODES; ++i)
+    dynamicBits += uint64_t(clFreq[i]) * clLens[i];
+  dynamicBits += clFreq[16] * 2 + clFreq[17] * 3 + clFreq[18] * 7;
+  for (int i = 0; i < LITLEN_CODES; ++i) {
+    dynamicBits += uint64_t(litFreq[i]) * litLens[i];
+    fixedBits += uint64_t(litFreq[i]) * fixed.litLens[i];
+  }
+  for (int i = 0; i < DIST_CODES; ++i) {
+    dynamicBits += uint64_t(distFreq[i]) * distLens[i];
+    fixedBits += uint64_t(distFreq[i]) * fixed.distLens[i];
+  }
+  size_t rawSize = rawEnd - rawStart;
+  size_t storedBlocks = std::max<size_t>(1, (rawSize + 65534) / 65535);
+  uint64_t storedBits = (uint64_t(rawSize) + 5 * storedBlocks) * 8 + 7;
+
+  if (storedBits < dynamicBits && storedBits < fixedBits) {
+    writeStored(base + rawStart, rawSize, last);
+  } else if (fixedBits <= dynamicBits) {
+    writer_.writeBits(last ? 1 : 0, 1);
+    writer_.writeBits(1, 2);
+    writeSymbols(fixed.litLens, fixed.litCodes, fixed.distLens,
+                 fixed.distCodes);
+  } else {
+    uint16_t litCodes[LITLEN_CODES];
+    uint16_t distCodes[DIST_CODES];
+    uint16_t clCodes[CODE_LENGTH_CODES];
+    buildCodes(litLens, LITLEN_CODES, litCodes);
+    buildCodes(distLens, DIST_CODES, distCodes);
+    buildCodes(clLens, CODE_LENGTH_CODES, clCodes);
+
+    writer_.writeBits(last ? 1 : 0, 1);
+    writer_.writeBits(2, 2);
+    writer_.writeBits(hlit - 257, 5);
+    writer_.writeBits(hdist - 1, 5);
+    writer_.writeBits(hclen - 4, 4);
+    for (int i = 0; i < hclen; ++i)
+      writer_.writeBits(clLens[CODE_LENGTH_ORDER[i]], 3);
+    for (const LengthOp &op : ops) {
+      writer_.writeBits(clCodes[op.symbol], clLens[op.symbol]);
+      if (op.symbol == 16)
+        writer_.writeBits(op.extra, 2);
+      else if (op.symbol == 17)
+        writer_.writeBits(op.extra, 3);
+      else if (op.symbol == 18)
+        writer_.writeBits(op.extra, 7);
+    }
+    writeSymbols(litLens, litCodes, distLens, distCodes);
+  }
+}
+
+void DeflateEncoder::writeSymbols(const uint8_t *litLens,
+                                  const uint16_t *litCodes,
+                                  const uint8_t *distLens,
+                                  const uint16_t *distCodes) {
+  for (const Symbol &s : symbols_) {
+    if (s.dist == 0) {
+      writer_.writeBits(litCodes[s.litLen], litLens[s.litLen]);
+      continue;
+    }
+    // Code and extra bits go out in one write: at most 15 + 5 and 15 + 13
+    int lc = lengthCode(s.litLen);
+    int sym = 257 + lc;
+    writer_.writeBits(litCodes[sym] |
+                          (uint32_t(s.litLen - LENGTH_BASE[lc]) << litLens[sym]),
+                      litLens[sym] + LENGTH_EXTRA[lc]);
+    int dc = distanceCode(s.dist);
+    writer_.writeBits(distCodes[dc] |
+                          (uint32_t(s.dist - DIST_BASE[dc]) << distLens[dc]),
+                      distLens[dc] + DIST_EXTRA[dc]);
+  }
+  writer_.writeBits(litCodes[256], litLens[256]);
+}
+
+void DeflateEncoder::writeStored(const uint8_t *data, size_t size, bool last) {
+  // A stored block holds at most 65535 bytes; size 0 writes one empty block
+  do {
+    size_t len = std::min<size_t>(size, 65535);
+    writer_.writeBits(last && len == size ? 1 : 0, 1);
+    writer_.writeBits(0, 2);
+    writer_.alignToByte();
+    writer_.writeBits(static_cast<uint32_t>(len), 16);
+    writer_.writeBits(static_cast<uint32_t>(~len & 0xFFFF), 16);
+    writer_.writeBytes(data, len);
+    data += len;
+    size -= len;
+  } while (size > 0);
+}
+
+void DeflateEncoder::buildCodeLengths(const uint32_t *freqs, int count,
+                                      int maxBits, uint8_t *lengths) {
+  std::fill(lengths, lengths + count, 0);
+
+  std::vector<int> symbols;
+  for (int i = 0; i < count; ++i) {
+    if (freqs[i])
+      symbols.push_back(i);
+  }
+  // Keep every code complete with at least two symbols (an unused distance
+  // tree still needs one code), padding with unused symbols
+  for (int i = 0; symbols.size() < 2 && i < count; ++i) {
+    if (!freqs[i])
+      symbols.push_back(i);
+  }
+  // Least frequent first: they receive the longest codes below
+  std::stable_sort(symbols.begin(), symbols.end(),
+                   [&](int a, int b) { return freqs[a] < freqs[b]; });
+
+  // Huffman tree over the leaves; parents are always created after their
+  // children, so depths can be filled in from the root down
+  size_t n = symbols.size();
+  std::vector<int> parent(2 * n - 1, -1);
+  using Item = std::pair<uint64_t, int>;
+  std::priority_queue<Item, std::vector<Item>, std::greater<Item>> queue;
+  for (size_t i = 0; i < n; ++i)
+    queue.push({freqs[symbols[i]], static_cast<int>(i)});
+  int next = static_cast<int>(n);
+  while (queue.size() > 1) {
+    Item a = queue.top();
+    queue.pop();
+    Item b = queue.top();
+    queue.pop();
+    parent[a.second] = next;
+    parent[b.second] = next;
+    queue.push({a.first + b.first, next++});
+  }
+
+  std::vector<int> depth(2 * n - 1, 0);
+  int numCodes[33] = {};
+  for (int i = next - 2; i >= 0; --i) {
+    depth[i] = depth[parent[i]] + 1;
+    if (i < static_cast<int>(n))
+      numCodes[std::min(depth[i], 32)]++;
+  }
+
+  // Limit to maxBits: fold longer codes into maxBits, then lengthen shorter
+  // codes until the Kraft sum is exactly one again
+  for (int i = maxBits + 1; i <= 32; ++i)
+    numCodes[maxBits] += numCodes[i];
+  uint32_t total = 0;
+  for (int i = maxBits; i > 0; --i)
+    total += static_cast<uint32_t>(numCodes[i]) << (maxBits - i);
+  while (total != (1u << maxBits)) {
+    numCodes[maxBits]--;
+    for (int i = maxBits - 1; i > 0; --i) {
+      if (numCodes[i]) {
+        numCodes[i]--;
+        numCodes[i + 1] += 2;
+        break;
+      }
+    }
+    total--;
+  }
+
+  size_t k = 0;
+  for (int len = maxBits; len > 0; --len) {
+    for (int c = 0; c < numCodes[len]; ++c)
+      lengths[symbols[k++]] = static_cast<uint8_t>(len);
+  }
+}
+
+void DeflateEncoder::buildCodes(const uint8_t *lengths, int count,
+                                uint16_t *codes) {
+  // Canonical codes (RFC 1951, 3.2.2), bit-reversed for LSB-first output
+  int blCount[MAX_CODE_BITS + 1] = {};
+  for (int i = 0; i < count; ++i)
+    blCount[lengths[i]]++;
+  blCount[0] = 0;
+
+  int nextCode[MAX_CODE_BITS + 1] = {};
+  int code = 0;
+  for (int bits = 1; bits <= MAX_CODE_BITS; ++bits) {
+    code = (code + blCount[bits - 1]) << 1;
+    nextCode[bits] = code;
+  }
+
+  for (int i = 0; i < count; ++i) {
+    int len = lengths[i];
+    codes[i] = 0;
+    if (len == 0)
+      continue;
+    uint32_t c = nextCode[len]++;
+    uint32_t reversed = 0;
+    for (int b = 0; b < len; ++b) {
+      reversed = (reversed << 1) | (c & 1);
+      c >>= 1;
+    }
+    codes[i] = static_cast<uint16_t>(reversed);
+  }
+}
@@ -0,0 +1,91 @@
+#ifndef DEFLATE_ENCODER_HPP
+#define DEFLATE_ENCODER_HPP
+
+#include "utils/bit_writer.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class ThreadPool;
+
+// DEFLATE compressor (RFC 1951). LZ77 over hash chains with a 32 KiB window,
+// followed by per-block choice of dynamic Huffman, fixed Huffman or stored
+// encoding, whichever is smallest.
+//
+// Levels follow zlib: 0 stores, 1-3 use greedy matching with short chains,
+// 4-6 lazy matching and 7-9 lazy matching with long chains.
+class DeflateEncoder {
+public:
+  static const int DEFAULT_LEVEL = 6;
+  static constexpr size_t SEGMENT_SIZE = 256 * 1024;
+
+  enum Flush {
+    NO_FLUSH,   // Leave a partial byte pending for the next call
+    SYNC_FLUSH, // End on a byte boundary with an empty stored block
+    FINISH      // Mark the last block final and pad to a byte boundary
+  };
+
+  explicit DeflateEncoder(int level = DEFAULT_LEVEL);
+
+  // Compresses `size` bytes at `data` and appends the completed output
+  // bytes to `out`. The `dictSize` bytes before `data` are input that was
+  // already compressed (by this or another encoder); matches may reach back
+  // into its last 32 KiB, which lets independently compressed segments be
+  // concatenated without losing history.
+  void compress(const uint8_t *data, size_t size, size_t dictSize, Flush flush,
+                std::vector<uint8_t> &out);
+
+  // Complete zlib stream (RFC 1950): header, deflate data and Adler-32.
+  // With a pool, large inputs are cut into SEGMENT_SIZE pieces that are
+  // compressed concurrently, each primed with the 32 KiB before it and
+  // ended with a sync flush so the pieces join into a single stream.
+  static std::vector<uint8_t> zlibCompress(const uint8_t *data, size_t size,
+                                           int level = DEFAULT_LEVEL,
+                                           ThreadPool *pool = nullptr);
+  // The two zlib header bytes for `level`
+  static void writeZlibHeader(std::vector<uint8_t> &out, int level);
+
+private:
+  // Matching parameters per level, as in zlib's configuration table
+  struct LevelConfig {
+    int goodLength; // Shorten the chain search once a match this long exists
+    int maxLazy;    // Lazy: skip the search beyond this; greedy: max insert
+    int niceLength; // Stop searching at a match this long
+    int maxChain;   // Chain entries to visit per search
+    bool lazy;
+  };
+
+  // One LZ77 symbol: a literal byte (dist == 0) or a length/distance pair
+  struct Symbol {
+    uint16_t litLen;
+    uint16_t dist;
+  };
+
+  void compressBlocks(const uint8_t *base, size_t start, size_t end,
+                      bool last);
+  // Adds pos to its hash chain and returns the previous chain head
+  size_t insertHash(const uint8_t *base, size_t pos);
+  int longestMatch(const uint8_t *base, size_t pos, size_t end, size_t cand,
+                   int prevLength, size_t &matchDist) const;
+
+  // Emits the buffered symbols covering base[rawStart, rawEnd) as one block
+  void writeBlock(const uint8_t *base, size_t rawStart, size_t rawEnd,
+                  bool last);
+  void writeSymbols(const uint8_t *litLens, const uint16_t *litCodes,
+                    const uint8_t *distLens, const uint16_t *distCodes);
+  void writeStored(const uint8_t *data, size_t size, bool last);
+
+  static void buildCodeLengths(const uint32_t *freqs, int count, int maxBits,
+                               uint8_t *lengths);
+  static void buildCodes(const uint8_t *lengths, int count, uint16_t *codes);
+
+  int level_;
+  LevelConfig config_;
+  DeflateBitWriter writer_;
+  std::vector<Symbol> symbols_;
+  std::vector<size_t> head_; // Most recent position per hash bucket
+  std::vector<size_t> prev_; // Previous position with the same hash, by
+                             // position modulo the window size
+};
+
+#endif // DEFLATE_ENCODER_HPP
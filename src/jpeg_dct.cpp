@@ -0,0 +1,693 @@
+#include "jpeg_dct.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) &&        \
+    defined(__SSE2__)
+#define JPEG_DCT_X86 1
+#include <immintrin.h>
+#endif
+
+double JpegDct::aanScale(int k) {
+  const double PI = 3.14159265358979323846;
+  return k == 0 ? 1.0 : std::sqrt(2.0) * std::cos(k * PI / 16.0);
+}
+
+// One 8-point AAN pass over elements d[0], d[step], ..., d[7 * step].
+// T is the working type; MUL multiplies by one of the four AAN constants.
+template <typename T, typename Mul>
+static inline void aanForward(T *d, int step, Mul mul) {
+  T tmp0 = d[0 * step] + d[7 * step];
+  T tmp7 = d[0 * step] - d[7 * step];
+  T tmp1 = d[1 * step] + d[6 * step];
+  T tmp6 = d[1 * step] - d[6 * step];
+  T tmp2 = d[2 * step] + d[5 * step];
+  T tmp5 = d[2 * step] - d[5 * step];
+  T tmp3 = d[3 * step] + d[4 * step];
+  T tmp4 = d[3 * step] - d[4 * step];
+
+  // Even part
+  T tmp10 = tmp0 + tmp3;
+  T tmp13 = tmp0 - tmp3;
+  T tmp11 = tmp1 + tmp2;
+  T tmp12 = tmp1 - tmp2;
+
+  d[0 * step] = tmp10 + tmp11;
+  d[4 * step] = tmp10 - tmp11;
+
+  T z1 = mul(tmp12 + tmp13, 0); // c4
+  d[2 * step] = tmp13 + z1;
+  d[6 * step] = tmp13 - z1;
+
+  // Odd part
+  tmp10 = tmp4 + tmp5;
+  tmp11 = tmp5 + tmp6;
+  tmp12 = tmp6 + tmp7;
+
+  T z5 = mul(tmp10 - tmp12, 1); // c6
+  T z2 = mul(tmp10, 2) + z5;    // c2 - c6
+  T z4 = mul(tmp12, 3) + z5;    // c2 + c6
+  T z3 = mul(tmp11, 0);         // c4
+
+  T z11 = tmp7 + z3;
+  T z13 = tmp7 - z3;
+
+  d[5 * step] = z13 + z2;
+  d[3 * step] = z13 - z2;
+  d[1 * step] = z11 + z4;
+  d[7 * step] = z11 - z4;
+}
+
+void JpegDct::forwardFloat(const int16_t *in, float *out) {
+  static const float C[4] = {0.707106781f, 0.382683433f, 0.541196100f,
+                             1.306562965f};
+  auto mul = [](float x, int c) { return x * C[c]; };
+
+  for (int i = 0; i < 64; ++i)
+    out[i] = in[i];
+  for (int row = 0; row < 8; ++row)
+    aanForward(out + row * 8, 1, mul);
+  for (int col = 0; col < 8; ++col)
+    aanForward(out + col, 8, mul);
+}
+
+void JpegDct::forwardInt(const int16_t *in, int32_t *out) {
+  // The AAN constants in 13-bit fixed point
+  const int CONST_BITS = 13;
+  static const int32_t C[4] = {5793, 3135, 4433, 10703};
+  auto mul = [](int32_t x, int c) {
+    return (x * C[c] + (1 << (CONST_BITS - 1))) >> CONST_BITS;
+  };
+
+  for (int i = 0; i < 64; ++i)
+    out[i] = static_cast<int32_t>(in[i]) * (1 << PASS1_BITS);
+  for (int row = 0; row < 8; ++row)
+    aanForward(out + row * 8, 1, mul);
+  for (int col = 0; col < 8; ++col)
+    aanForward(out + col, 8, mul);
+}
+
+// ============================================================================
+// Inverse DCT
+// ============================================================================
+
+void JpegDct::prepareInverse(const uint16_t *quant, InverseTable &table) {
+  for (int i = 0; i < 64; ++i) {
+    table.intMul[i] = static_cast<int16_t>(quant[i]);
+    table.floatMul[i] = static_cast<float>(
+        quant[i] * aanScale(i % 8) * aanScale(i / 8) * 0.125);
+  }
+}
+
+namespace {
+
+using InverseFn = void (*)(const int16_t *coefs,
+                           const JpegDct::InverseTable &table, uint8_t *out,
+                           size_t stride);
+
+// Loeffler constants in 13-bit fixed point
+const int CONST_BITS = 13;
+const int PASS1_BITS = 2;
+const int32_t FIX_0_298631336 = 2446;
+const int32_t FIX_0_390180644 = 3196;
+const int32_t FIX_0_541196100 = 4433;
+const int32_t FIX_0_765366865 = 6270;
+const int32_t FIX_0_899976223 = 7373;
+const int32_t FIX_1_175875602 = 9633;
+const int32_t FIX_1_501321110 = 12299;
+const int32_t FIX_1_847759065 = 15137;
+const int32_t FIX_1_961570560 = 16069;
+const int32_t FIX_2_053119869 = 16819;
+const int32_t FIX_2_562915447 = 20995;
+const int32_t FIX_3_072711026 = 25172;
+
+inline uint8_t clampSample(int v) {
+  return static_cast<uint8_t>(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+inline int32_t descale(int32_t x, int n) {
+  return (x + (1 << (n - 1))) >> n;
+}
+
+// One 8-point Loeffler pass; outputs are scaled by 2^CONST_BITS
+inline void islow1D(const int32_t *in, int32_t *out) {
+  // Even part
+  int32_t z1 = (in[2] + in[6]) * FIX_0_541196100;
+  int32_t tmp2 = z1 - in[6] * FIX_1_847759065;
+  int32_t tmp3 = z1 + in[2] * FIX_0_765366865;
+  int32_t tmp0 = (in[0] + in[4]) * (1 << CONST_BITS);
+  int32_t tmp1 = (in[0] - in[4]) * (1 << CONST_BITS);
+
+  int32_t tmp10 = tmp0 + tmp3;
+  int32_t tmp13 = tmp0 - tmp3;
+  int32_t tmp11 = tmp1 + tmp2;
+  int32_t tmp12 = tmp1 - tmp2;
+
+  // Odd part
+  int32_t t0 = in[7], t1 = in[5], t2 = in[3], t3 = in[1];
+  z1 = t0 + t3;
+  int32_t z2 = t1 + t2;
+  int32_t z3 = t0 + t2;
+  int32_t z4 = t1 + t3;
+  int32_t z5 = (z3 + z4) * FIX_1_175875602;
+
+  t0 *= FIX_0_298631336;
+  t1 *= FIX_2_053119869;
+  t2 *= FIX_3_072711026;
+  t3 *= FIX_1_501321110;
+  z1 *= -FIX_0_899976223;
+  z2 *= -FIX_2_562915447;
+  z3 = z3 * -FIX_1_961570560 + z5;
+  z4 = z4 * -FIX_0_390180644 + z5;
+
+  t0 += z1 + z3;
+  t1 += z2 + z4;
+  t2 += z2 + z3;
+  t3 += z1 + z4;
+
+  out[0] = tmp10 + t3;
+  out[7] = tmp10 - t3;
+  out[1] = tmp11 + t2;
+  out[6] = tmp11 - t2;
+  out[2] = tmp12 + t1;
+  out[5] = tmp12 - t1;
+  out[3] = tmp13 + t0;
+  out[4] = tmp13 - t0;
+}
+
+// SPARSE: only the top-left 4x4 coefficients can be nonzero
+template <bool SPARSE>
+void inverseIntScalar(const int16_t *coefs, const JpegDct::InverseTable &t,
+                      uint8_t *out, size_t stride) {
+  int32_t ws[64];
+  int32_t in[8], res[8];
+
+  // Pass 1: columns, keeping PASS1_BITS of extra precision
+  for (int col = 0; col < 8; ++col) {
+    if (SPARSE && col >= 4) {
+      for (int row = 0; row < 8; ++row)
+        ws[row * 8 + col] = 0;
+      continue;
+    }
+    for (int row = 0; row < 8; ++row) {
+      in[row] = (SPARSE && row >= 4)
+                    ? 0
+                    : coefs[row * 8 + col] * t.intMul[row * 8 + col];
+    }
+    islow1D(in, res);
+    for (int row = 0; row < 8; ++row)
+      ws[row * 8 + col] = descale(res[row], CONST_BITS - PASS1_BITS);
+  }
+
+  // Pass 2: rows, removing the pass 1 scaling and the DCT's factor of 8
+  for (int row = 0; row < 8; ++row) {
+    for (int col = 0; col < 8; ++col)
+      in[col] = (SPARSE && col >= 4) ? 0 : ws[row * 8 + col];
+    islow1D(in, res);
+    for (int col = 0; col < 8; ++col) {
+      out[row * stride + col] =
+          clampSample(descale(res[col], CONST_BITS + PASS1_BITS + 3) + 128);
+    }
+  }
+}
+
+// Reduced transforms for scaled decoding. Output sample x of an N-point
+// pass is the mean of the 8 / N full-size samples it covers, so the result
+// is the full IDCT box-filtered down. Each output has a fixed weight per
+// coefficient, and mirrored outputs share them up to sign: even frequencies
+// are symmetric about the block centre, odd ones antisymmetric.
+template <int N> struct ReducedBasis {
+  // [x][u], x < N / 2: c(u) times the mean of cos((2j + 1) * u * pi / 16)
+  // over the covered samples j, in CONST_BITS fixed point
+  int32_t k[N / 2][8];
+
+  ReducedBasis() {
+    const double pi = 3.14159265358979323846;
+    const int span = 8 / N;
+    for (int x = 0; x < N / 2; ++x) {
+      for (int u = 0; u < 8; ++u) {
+        double sum = 0;
+        for (int j = x * span; j < (x + 1) * span; ++j)
+          sum += std::cos((2 * j + 1) * u * pi / 16);
+        double c = u == 0 ? 1.0 / std::sqrt(2.0) : 1.0;
+        k[x][u] = static_cast<int32_t>(
+            std::lround(c * sum / span * (1 << CONST_BITS)));
+      }
+    }
+  }
+};
+
+// One N-point pass over the first INPUTS coefficients (the rest are zero)
+template <int N, int INPUTS>
+inline void reduced1D(const int32_t *in, const ReducedBasis<N> &basis,
+                      int32_t *out) {
+  for (int x = 0; x < N / 2; ++x) {
+    int32_t even = 0;
+    int32_t odd = 0;
+    for (int u = 0; u < INPUTS; u += 2)
+      even += in[u] * basis.k[x][u];
+    for (int u = 1; u < INPUTS; u += 2)
+      odd += in[u] * basis.k[x][u];
+    out[x] = even + odd;
+    out[N - 1 - x] = even - odd;
+  }
+}
+
+// SPARSE: only the top-left 4x4 coefficients can be nonzero
+template <int N, bool SPARSE>
+void inverseReduced(const int16_t *coefs, const JpegDct::InverseTable &t,
+                    uint8_t *out, size_t stride) {
+  const int INPUTS = SPARSE ? 4 : 8;
+  static const ReducedBasis<N> basis;
+  int32_t ws[N * 8];
+  int32_t in[8], res[N];
+
+  // Pass 1: columns, keeping PASS1_BITS of extra precision
+  for (int col = 0; col < INPUTS; ++col) {
+    for (int row = 0; row < INPUTS; ++row)
+      in[row] = coefs[row * 8 + col] * t.intMul[row * 8 + col];
+    reduced1D<N, INPUTS>(in, basis, res);
+    for (int y = 0; y < N; ++y)
+      ws[y * 8 + col] = descale(res[y], CONST_BITS - PASS1_BITS);
+  }
+
+  // Pass 2: rows, removing the pass 1 scaling and the IDCT's factor of 4
+  for (int y = 0; y < N; ++y) {
+    reduced1D<N, INPUTS>(ws + y * 8, basis, res);
+    for (int x = 0; x < N; ++x) {
+      out[y * stride + x] =
+          clampSample(descale(res[x], CONST_BITS + PASS1_BITS + 2) + 128);
+    }
+  }
+}
+
+// One 8-point AAN inverse pass, written once for any element type with
+// arithmetic operators: float, or (GCC vector extensions) __m128/__m256
+// holding one row per vector so each lane runs its own column.
+template <typename V>
+__attribute__((always_inline)) inline void
+aanInverse1D(V *v, const V &c1414, const V &c1847, const V &c1082,
+             const V &cn2613) {
+  // Even part
+  V tmp10 = v[0] + v[4];
+  V tmp11 = v[0] - v[4];
+  V tmp13 = v[2] + v[6];
+  V tmp12 = (v[2] - v[6]) * c1414 - tmp13;
+
+  V tmp0 = tmp10 + tmp13;
+  V tmp3 = tmp10 - tmp13;
+  V tmp1 = tmp11 + tmp12;
+  V tmp2 = tmp11 - tmp12;
+
+  // Odd part
+  V z13 = v[5] + v[3];
+  V z10 = v[5] - v[3];
+  V z11 = v[1] + v[7];
+  V z12 = v[1] - v[7];
+
+  V tmp7 = z11 + z13;
+  tmp11 = (z11 - z13) * c1414;
+  V z5 = (z10 + z12) * c1847;
+  tmp10 = z12 * c1082 - z5;
+  tmp12 = z10 * cn2613 + z5;
+
+  V tmp6 = tmp12 - tmp7;
+  V tmp5 = tmp11 - tmp6;
+  V tmp4 = tmp10 + tmp5;
+
+  v[0] = tmp0 + tmp7;
+  v[7] = tmp0 - tmp7;
+  v[1] = tmp1 + tmp6;
+  v[6] = tmp1 - tmp6;
+  v[2] = tmp2 + tmp5;
+  v[5] = tmp2 - tmp5;
+  v[4] = tmp3 + tmp4;
+  v[3] = tmp3 - tmp4;
+}
+
+const float C1414 = 1.414213562f;
+const float C1847 = 1.847759065f;
+const float C1082 = 1.082392200f;
+const float CN2613 = -2.613125930f;
+
+template <bool SPARSE>
+void inverseFloatScalar(const int16_t *coefs, const JpegDct::InverseTable &t,
+                        uint8_t *out, size_t stride) {
+  float ws[64];
+  float v[8];
+
+  for (int col = 0; col < 8; ++col) {
+    for (int row = 0; row < 8; ++row) {
+      int i = row * 8 + col;
+      v[row] = (SPARSE && (row >= 4 || col >= 4)) ? 0.0f
+                                                  : coefs[i] * t.floatMul[i];
+    }
+    aanInverse1D(v, C1414, C1847, C1082, CN2613);
+    for (int row = 0; row < 8; ++row)
+      ws[row * 8 + col] = v[row];
+  }
+
+  for (int row = 0; row < 8; ++row) {
+    std::memcpy(v, ws + row * 8, sizeof(v));
+    if (SPARSE)
+      v[4] = v[5] = v[6] = v[7] = 0.0f;
+    aanInverse1D(v, C1414, C1847, C1082, CN2613);
+    for (int col = 0; col < 8; ++col) {
+      // Round to nearest; the offset keeps the truncation away from zero
+      int s = static_cast<int>(v[col] + 128.5f + 256.0f) - 256;
+      out[row * stride + col] = clampSample(s);
+    }
+  }
+}
+
+#ifdef JPEG_DCT_X86
+// ============================================================================
+// x86 kernels. SSE2 is part of the x86-64 baseline; the AVX2 variant is
+// compiled with a target attribute and only called after a CPU check.
+// ============================================================================
+
+inline void transpose8x8(__m128i *r) {
+  __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]);
+  __m128i a1 = _mm_unpackhi_epi16(r[0], r[1]);
+  __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]);
+  __m128i a3 = _mm_unpackhi_epi16(r[2], r[3]);
+  __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]);
+  __m128i a5 = _mm_unpackhi_epi16(r[4], r[5]);
+  __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]);
+  __m128i a7 = _mm_unpackhi_epi16(r[6], r[7]);
+
+  __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+  __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+  __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+  __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+  __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+  __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+  __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+  __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+
+  r[0] = _mm_unpacklo_epi64(b0, b4);
+  r[1] = _mm_unpackhi_epi64(b0, b4);
+  r[2] = _mm_unpacklo_epi64(b1, b5);
+  r[3] = _mm_unpackhi_epi64(b1, b5);
+  r[4] = _mm_unpacklo_epi64(b2, b6);
+  r[5] = _mm_unpackhi_epi64(b2, b6);
+  r[6] = _mm_unpacklo_epi64(b3, b7);
+  r[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+// 32-bit results for lanes 0-3 (lo) and 4-7 (hi) of 16-bit inputs
+struct Wide {
+  __m128i lo, hi;
+};
+
+inline Wide operator+(Wide a, Wide b) {
+  return {_mm_add_epi32(a.lo, b.lo), _mm_add_epi32(a.hi, b.hi)};
+}
+inline Wide operator-(Wide a, Wide b) {
+  return {_mm_sub_epi32(a.lo, b.lo), _mm_sub_epi32(a.hi, b.hi)};
+}
+
+// a * c0 + b * c1 per lane, via pmaddwd on interleaved inputs
+inline Wide madd(__m128i a, __m128i b, int16_t c0, int16_t c1) {
+  const __m128i c = _mm_setr_epi16(c0, c1, c0, c1, c0, c1, c0, c1);
+  return {_mm_madd_epi16(_mm_unpacklo_epi16(a, b), c),
+          _mm_madd_epi16(_mm_unpackhi_epi16(a, b), c)};
+}
+
+// x << CONST_BITS, widened to 32 bits
+inline Wide widenScaled(__m128i x) {
+  const __m128i zero = _mm_setzero_si128();
+  return {_mm_srai_epi32(_mm_unpacklo_epi16(zero, x), 16 - CONST_BITS),
+          _mm_srai_epi32(_mm_unpackhi_epi16(zero, x), 16 - CONST_BITS)};
+}
+
+template <int SHIFT> inline __m128i narrow(Wide x) {
+  const __m128i round = _mm_set1_epi32(1 << (SHIFT - 1));
+  return _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(x.lo, round), SHIFT),
+                         _mm_srai_epi32(_mm_add_epi32(x.hi, round), SHIFT));
+}
+
+// islow1D() on eight columns at once (one row per vector). Products are
+// regrouped so every multiply is a pmaddwd of two inputs; the sums are the
+// same integers the scalar version computes.
+template <int SHIFT> inline void islowSse2(__m128i *v) {
+  // Even part
+  Wide tmp3 = madd(v[2], v[6], FIX_0_541196100 + FIX_0_765366865,
+                   FIX_0_541196100);
+  Wide tmp2 = madd(v[2], v[6], FIX_0_541196100,
+                   FIX_0_541196100 - FIX_1_847759065);
+  Wide tmp0 = widenScaled(_mm_add_epi16(v[0], v[4]));
+  Wide tmp1 = widenScaled(_mm_sub_epi16(v[0], v[4]));
+
+  Wide tmp10 = tmp0 + tmp3;
+  Wide tmp13 = tmp0 - tmp3;
+  Wide tmp11 = tmp1 + tmp2;
+  Wide tmp12 = tmp1 - tmp2;
+
+  // Odd part
+  __m128i z3 = _mm_add_epi16(v[7], v[3]);
+  __m128i z4 = _mm_add_epi16(v[5], v[1]);
+  Wide z3w = madd(z3, z4, FIX_1_175875602 - FIX_1_961570560, FIX_1_175875602);
+  Wide z4w = madd(z3, z4, FIX_1_175875602, FIX_1_175875602 - FIX_0_390180644);
+
+  Wide t0 = madd(v[7], v[1], FIX_0_298631336 - FIX_0_899976223,
+                 -FIX_0_899976223) +
+            z3w;
+  Wide t3 = madd(v[7], v[1], -FIX_0_899976223,
+                 FIX_1_501321110 - FIX_0_899976223) +
+            z4w;
+  Wide t1 = madd(v[5], v[3], FIX_2_053119869 - FIX_2_562915447,
+                 -FIX_2_562915447) +
+            z4w;
+  Wide t2 = madd(v[5], v[3], -FIX_2_562915447,
+                 FIX_3_072711026 - FIX_2_562915447) +
+            z3w;
+
+  v[0] = narrow<SHIFT>(tmp10 + t3);
+  v[7] = narrow<SHIFT>(tmp10 - t3);
+  v[1] = narrow<SHIFT>(tmp11 + t2);
+  v[6] = narrow<SHIFT>(tmp11 - t2);
+  v[2] = narrow<SHIFT>(tmp12 + t1);
+  v[5] = narrow<SHIFT>(tmp12 - t1);
+  v[3] = narrow<SHIFT>(tmp13 + t0);
+  v[4] = narrow<SHIFT>(tmp13 - t0);
+}
+
+template <bool SPARSE>
+void inverseIntSse2(const int16_t *coefs, const JpegDct::InverseTable &t,
+                    uint8_t *out, size_t stride) {
+  __m128i v[8];
+  for (int row = 0; row < 8; ++row) {
+    if (SPARSE && row >= 4) {
+      v[row] = _mm_setzero_si128();
+      continue;
+    }
+    __m128i c =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(coefs + row * 8));
+    __m128i q =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(t.intMul + row * 8));
+    v[row] = _mm_mullo_epi16(c, q);
+  }
+
+  islowSse2<CONST_BITS - PASS1_BITS>(v);
+  transpose8x8(v);
+  if (SPARSE) {
+    // Columns 4-7 were all zero, so these rows of the transpose are too
+    v[4] = v[5] = v[6] = v[7] = _mm_setzero_si128();
+  }
+  islowSse2<CONST_BITS + PASS1_BITS + 3>(v);
+  transpose8x8(v);
+
+  const __m128i bias = _mm_set1_epi16(128);
+  for (int row = 0; row < 8; ++row) {
+    __m128i s = _mm_adds_epi16(v[row], bias);
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(out + row * stride),
+                     _mm_packus_epi16(s, s));
+  }
+}
+
+// Float kernels hold a row in two __m128 halves (columns 0-3, 4-7)
+inline void transposeHalves(__m128 *lo, __m128 *hi) {
+  // [A B; C D] -> [A' C'; B' D'] with each 4x4 quadrant transposed
+  _MM_TRANSPOSE4_PS(lo[0], lo[1], lo[2], lo[3]);
+  _MM_TRANSPOSE4_PS(hi[0], hi[1], hi[2], hi[3]);
+  _MM_TRANSPOSE4_PS(lo[4], lo[5], lo[6], lo[7]);
+  _MM_TRANSPOSE4_PS(hi[4], hi[5], hi[6], hi[7]);
+  for (int i = 0; i < 4; ++i)
+    std::swap(hi[i], lo[i + 4]);
+}
+
+inline void storeRow(uint8_t *out, __m128i lo, __m128i hi) {
+  __m128i s = _mm_packs_epi32(lo, hi);
+  _mm_storel_epi64(reinterpret_cast<__m128i *>(out), _mm_packus_epi16(s, s));
+}
+
+template <bool SPARSE>
+void inverseFloatSse2(const int16_t *coefs, const JpegDct::InverseTable &t,
+                      uint8_t *out, size_t stride) {
+  const __m128 c1414 = _mm_set1_ps(C1414), c1847 = _mm_set1_ps(C1847);
+  const __m128 c1082 = _mm_set1_ps(C1082), cn2613 = _mm_set1_ps(CN2613);
+  const __m128i zero = _mm_setzero_si128();
+  __m128 lo[8], hi[8];
+
+  for (int row = 0; row < 8; ++row) {
+    if (SPARSE && row >= 4) {
+      lo[row] = hi[row] = _mm_setzero_ps();
+      continue;
+    }
+    __m128i c =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(coefs + row * 8));
+    // Sign-extend 16-bit coefficients to 32-bit floats
+    __m128i sign = _mm_cmpgt_epi16(zero, c);
+    lo[row] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(c, sign)),
+                         _mm_loadu_ps(t.floatMul + row * 8));
+    hi[row] = SPARSE ? _mm_setzero_ps()
+                     : _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(c, sign)),
+                                  _mm_loadu_ps(t.floatMul + row * 8 + 4));
+  }
+
+  aanInverse1D(lo, c1414, c1847, c1082, cn2613);
+  if (!SPARSE)
+    aanInverse1D(hi, c1414, c1847, c1082, cn2613);
+  transposeHalves(lo, hi);
+  aanInverse1D(lo, c1414, c1847, c1082, cn2613);
+  aanInverse1D(hi, c1414, c1847, c1082, cn2613);
+  transposeHalves(lo, hi);
+
+  const __m128 bias = _mm_set1_ps(128.0f);
+  for (int row = 0; row < 8; ++row) {
+    storeRow(out + row * stride,
+             _mm_cvtps_epi32(_mm_add_ps(lo[row], bias)),
+             _mm_cvtps_epi32(_mm_add_ps(hi[row], bias)));
+  }
+}
+
+__attribute__((target("avx2"))) inline void transpose8x8(__m256 *r) {
+  __m256 t0 = _mm256_unpacklo_ps(r[0], r[1]);
+  __m256 t1 = _mm256_unpackhi_ps(r[0], r[1]);
+  __m256 t2 = _mm256_unpacklo_ps(r[2], r[3]);
+  __m256 t3 = _mm256_unpackhi_ps(r[2], r[3]);
+  __m256 t4 = _mm256_unpacklo_ps(r[4], r[5]);
+  __m256 t5 = _mm256_unpackhi_ps(r[4], r[5]);
+  __m256 t6 = _mm256_unpacklo_ps(r[6], r[7]);
+  __m256 t7 = _mm256_unpackhi_ps(r[6], r[7]);
+
+  __m256 s0 = _mm256_shuffle_ps(t0, t2, 0x44);
+  __m256 s1 = _mm256_shuffle_ps(t0, t2, 0xEE);
+  __m256 s2 = _mm256_shuffle_ps(t1, t3, 0x44);
+  __m256 s3 = _mm256_shuffle_ps(t1, t3, 0xEE);
+  __m256 s4 = _mm256_shuffle_ps(t4, t6, 0x44);
+  __m256 s5 = _mm256_shuffle_ps(t4, t6, 0xEE);
+  __m256 s6 = _mm256_shuffle_ps(t5, t7, 0x44);
+  __m256 s7 = _mm256_shuffle_ps(t5, t7, 0xEE);
+
+  r[0] = _mm256_permute2f128_ps(s0, s4, 0x20);
+  r[1] = _mm256_permute2f128_ps(s1, s5, 0x20);
+  r[2] = _mm256_permute2f128_ps(s2, s6, 0x20);
+  r[3] = _mm256_permute2f128_ps(s3, s7, 0x20);
+  r[4] = _mm256_permute2f128_ps(s0, s4, 0x31);
+  r[5] = _mm256_permute2f128_ps(s1, s5, 0x31);
+  r[6] = _mm256_permute2f128_ps(s2, s6, 0x31);
+  r[7] = _mm256_permute2f128_ps(s3, s7, 0x31);
+}
+
+template <bool SPARSE>
+__attribute__((target("avx2"))) void
+inverseFloatAvx2(const int16_t *coefs, const JpegDct::InverseTable &t,
+                 uint8_t *out, size_t stride) {
+  const __m256 c1414 = _mm256_set1_ps(C1414), c1847 = _mm256_set1_ps(C1847);
+  const __m256 c1082 = _mm256_set1_ps(C1082),
+               cn2613 = _mm256_set1_ps(CN2613);
+  __m256 v[8];
+
+  for (int row = 0; row < 8; ++row) {
+    if (SPARSE && row >= 4) {
+      v[row] = _mm256_setzero_ps();
+      continue;
+    }
+    __m128i c =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(coefs + row * 8));
+    v[row] = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(c)),
+                           _mm256_loadu_ps(t.floatMul + row * 8));
+  }
+
+  aanInverse1D(v, c1414, c1847, c1082, cn2613);
+  transpose8x8(v);
+  if (SPARSE)
+    v[4] = v[5] = v[6] = v[7] = _mm256_setzero_ps();
+  aanInverse1D(v, c1414, c1847, c1082, cn2613);
+  transpose8x8(v);
+
+  const __m256 bias = _mm256_set1_ps(128.0f);
+  for (int row = 0; row < 8; ++row) {
+    __m256i s = _mm256_cvtps_epi32(_mm256_add_ps(v[row], bias));
+    storeRow(out + row * stride, _mm256_castsi256_si128(s),
+             _mm256_extracti128_si256(s, 1));
+  }
+}
+#endif // JPEG_DCT_X86
+
+// [method][0: full, 1: top-left 4x4 only]
+struct InverseKernels {
+  InverseFn fn[2][2];
+
+  InverseKernels() {
+    fn[JpegDct::INTEGER][0] = inverseIntScalar<false>;
+    fn[JpegDct::INTEGER][1] = inverseIntScalar<true>;
+    fn[JpegDct::FLOAT][0] = inverseFloatScalar<false>;
+    fn[JpegDct::FLOAT][1] = inverseFloatScalar<true>;
+
+#ifdef JPEG_DCT_X86
+    fn[JpegDct::INTEGER][0] = inverseIntSse2<false>;
+    fn[JpegDct::INTEGER][1] = inverseIntSse2<true>;
+    fn[JpegDct::FLOAT][0] = inverseFloatSse2<false>;
+    fn[JpegDct::FLOAT][1] = inverseFloatSse2<true>;
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      fn[JpegDct::FLOAT][0] = inverseFloatAvx2<false>;
+      fn[JpegDct::FLOAT][1] = inverseFloatAvx2<true>;
+    }
+#endif
+  }
+};
+
+} // namespace
+
+void JpegDct::inverse(Method method, const int16_t *coefs,
+                      const InverseTable &table, int lastIndex, uint8_t *out,
+                      size_t stride) {
+  static const InverseKernels kernels;
+
+  if (lastIndex == 0) {
+    // DC only: every sample is the same; matches the full integer transform
+    int dc = coefs[0] * table.intMul[0];
+    uint8_t s = clampSample(((dc + 4) >> 3) + 128);
+    for (int row = 0; row < 8; ++row)
+      std::memset(out + row * stride, s, 8);
+    return;
+  }
+  kernels.fn[method][lastIndex <= 9 ? 1 : 0](coefs, table, out, stride);
+}
+
+void JpegDct::inverseScaled(const int16_t *coefs, const InverseTable &table,
+                            int lastIndex, int size, uint8_t *out,
+                            size_t stride) {
+  if (size == 1 || lastIndex == 0) {
+    int dc = coefs[0] * table.intMul[0];
+    uint8_t s = clampSample(((dc + 4) >> 3) + 128);
+    for (int row = 0; row < size; ++row)
+      std::memset(out + row * stride, s, size);
+  } else if (size == 2) {
+    if (lastIndex <= 9)
+      inverseReduced<2, true>(coefs, table, out, stride);
+    else
+      inverseReduced<2, false>(coefs, table, out, stride);
+  } else {
+    if (lastIndex <= 9)
+      inverseReduced<4, true>(coefs, table, out, stride);
+    else
+      inverseReduced<4, false>(coefs, table, out, stride);
+  }
+}
@@ -0,0 +1,61 @@
+#ifndef JPEG_DCT_HPP
+#define JPEG_DCT_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+// 8x8 DCTs for JPEG. The forward transforms use the Arai-Agui-Nakajima
+// factorization: five multiplies per 8-point pass instead of 64, at the
+// price of outputs that carry a per-coefficient scale factor. The encoder
+// divides that factor out as part of quantization, so it costs nothing.
+//
+// The inverse transforms fold dequantization into the coefficient load:
+// the integer one is the accurate Loeffler factorization (12 multiplies per
+// pass), the float one AAN with its scale factors folded into the
+// multipliers. Kernels are picked once per process (SSE2, AVX2 for float,
+// scalar elsewhere), and sparse blocks take shortcuts.
+class JpegDct {
+public:
+  enum Method { INTEGER, FLOAT };
+
+  // Per-quantization-table multipliers for inverse(), natural order
+  struct InverseTable {
+    int16_t intMul[64]; // Quantizer values
+    float floatMul[64]; // q * aanScale(u) * aanScale(v) / 8
+  };
+
+  // Fixed-point precision of forwardInt(): outputs carry PASS1_BITS extra
+  // fraction bits on top of the AAN scaling
+  static const int PASS1_BITS = 2;
+
+  // Forward DCT of 64 level-shifted samples (-128..127, natural order).
+  // Coefficient (u, v) comes out as 8 * aanScale(u) * aanScale(v) times
+  // the true DCT value; forwardInt() scales by another 2^PASS1_BITS.
+  static void forwardFloat(const int16_t *in, float *out);
+  static void forwardInt(const int16_t *in, int32_t *out);
+
+  // Builds the inverse multipliers from a quantization table in natural
+  // order
+  static void prepareInverse(const uint16_t *quant, InverseTable &table);
+
+  // Dequantizes and inverse transforms one block of quantized coefficients
+  // (natural order) into 8x8 samples at `out`, rows `stride` bytes apart.
+  // `lastIndex` is the zigzag position of the last nonzero coefficient (0
+  // for a DC-only block); blocks ending at position 9 or earlier only have
+  // coefficients in the top-left 4x4 and use a cheaper transform.
+  static void inverse(Method method, const int16_t *coefs,
+                      const InverseTable &table, int lastIndex, uint8_t *out,
+                      size_t stride);
+
+  // Reduced-size inverse for scaled decoding: writes the block box-filtered
+  // down to size x size samples (size 1, 2 or 4) without computing the full
+  // 8x8 first. Integer arithmetic only.
+  static void inverseScaled(const int16_t *coefs, const InverseTable &table,
+                            int lastIndex, int size, uint8_t *out,
+                            size_t stride);
+
+  // AAN scale of frequency k: 1 for k = 0, sqrt(2) * cos(k * pi / 16) else
+  static double aanScale(int k);
+};
+
+#endif // JPEG_DCT_HPP
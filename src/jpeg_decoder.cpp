@@ -1,8 +1,12 @@
 #include "jpeg_decoder.hpp"
-#include <cmath>
+#include "utils/mapped_file.hpp"
+#include "utils/stats.hpp"
+#include "utils/thread_pool.hpp"
+#include <algorithm>
+#include <condition_variable>
 #include <cstring>
-#include <fstream>
 #include <iostream>
+#include <mutex>
 #include <stdexcept>
 
 const uint8_t JpegDecoder::ZIGZAG[64] = {
@@ -11,332 +15,879 @@ const uint8_t JpegDecoder::ZIGZAG[64] = {
     35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
     58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63};
 
-// BitReader for JPEG (MSB first, handles 0xFF00 stuffing)
-struct JpegBitReader {
-  const uint8_t *data;
-  size_t size;
-  size_t pos;
-  uint8_t currentByte;
-  int bitsLeft;
-
-  JpegBitReader(const uint8_t *d, size_t s)
-      : data(d), size(s), pos(0), currentByte(0), bitsLeft(0) {}
-
-  int readBit() {
-    if (bitsLeft == 0) {
-      if (pos >= size)
-        return -1; // End of stream
-      currentByte = data[pos++];
-      if (currentByte == 0xFF) {
-        // Check for byte stuffing
-        if (pos < size) {
-          uint8_t next = data[pos];
-          if (next == 0x00) {
-            pos++; // Skip stuffed byte
-          } else if (next >= 0xD0 && next <= 0xD7) {
-            // RST marker - handled by caller usually, but here we might just
-            // consume it? Actually, RST markers align to byte boundaries. For
-            // now, let's assume we don't hit them inside bit stream or we
-            // handle them. If we see a marker here, it's an issue if we are
-            // expecting bits.
-          }
-        }
-      }
-      bitsLeft = 8;
-    }
-    int bit = (currentByte >> (bitsLeft - 1)) & 1;
-    bitsLeft--;
-    return bit;
+// Sign-extends the `size` extra bits of a coefficient (T.81 F.2.2.1)
+static inline int extendSign(int bits, int size) {
+  return bits < (1 << (size - 1)) ? bits - (1 << size) + 1 : bits;
+}
+
+Image JpegDecoder::decode(const std::string &filepath) {
+  return decode(filepath, Options());
+}
+
+Image JpegDecoder::decode(const std::string &filepath,
+                          const Options &options) {
+  // The entropy-coded segment is decoded straight out of the mapped file
+  MappedFile file(filepath);
+  return decode(file.data(), file.size(), options);
+}
+
+Image JpegDecoder::decode(const uint8_t *data, size_t size) {
+  return decode(data, size, Options());
+}
+
+Image JpegDecoder::decode(const uint8_t *data, size_t size,
+                          const Options &options) {
+  Stats::add(Stats::BYTES_IN, size);
+
+  // Basic validation
+  if (size < 2 || data[0] != 0xFF || data[1] != 0xD8) {
+    throw std::runtime_error("Not a valid JPEG file (missing SOI)");
   }
 
-  int readBits(int n) {
-    int result = 0;
-    for (int i = 0; i < n; ++i) {
-      int bit = readBit();
-      if (bit == -1)
-        return -1;
-      result = (result << 1) | bit;
-    }
-    return result;
+  Frame frame;
+  {
+    Stats::ScopedTimer timer(Stats::PARSE);
+    parseSegments(data, size, 2, frame); // Skip SOI
+    prepareFrame(frame, options);
   }
 
-  // Align to byte boundary (for RST markers)
-  void align() { bitsLeft = 0; }
-};
+  Image img;
+  img.width = frame.outWidth;
+  img.height = frame.outHeight;
+  img.channels = 3;
+  img.data.resize((size_t)img.width * img.height * 3);
 
-Image JpegDecoder::decode(const std::string &filepath) {
-  std::ifstream file(filepath, std::ios::binary | std::ios::ate);
-  if (!file) {
-    throw std::runtime_error("Could not open file: " + filepath);
+  ThreadPool pool(ThreadPool::resolveThreads(options.threads));
+
+  if (frame.multiScan()) {
+    decodeMultiScan(data, size, frame, options, pool, img);
+    return img;
   }
 
-  std::streamsize size = file.tellg();
-  file.seekg(0, std::ios::beg);
+  // Restart intervals are independent: each starts on a byte boundary after
+  // its RSTn marker with the DC predictors reset, so they decode in
+  // parallel. Without them the scan is one interval, and with too few to
+  // keep every thread busy only the entropy decoding stays serial.
+  size_t mcuCount = (size_t)frame.mcusX * frame.mcusY;
+  size_t interval = frame.restartInterval > 0 ? frame.restartInterval : mcuCount;
+  std::vector<size_t> starts = findRestartIntervals(frame, nullptr);
+  size_t intervals = (mcuCount + interval - 1) / interval;
+  if (starts.size() < intervals)
+    throw std::runtime_error("Missing restart marker");
 
-  std::vector<uint8_t> data(size);
-  if (!file.read((char *)data.data(), size)) {
-    throw std::runtime_error("Failed to read file: " + filepath);
+  if (intervals >= static_cast<size_t>(pool.size())) {
+    // A crop skips the intervals without any of its MCUs and ends each of
+    // the others after its last one
+    pool.parallelFor(intervals, [&](size_t i) {
+      size_t first = i * interval;
+      size_t end = std::min(mcuCount, first + interval);
+      while (end > first && !frame.inWindow(end - 1))
+        --end;
+      if (end > first) {
+        decodeMcus(frame, options, frame.scanData + starts[i],
+                   frame.scanDataLen - starts[i], first, end, img);
+      }
+    });
+  } else {
+    decodePipelined(frame, options, starts, pool, img);
   }
 
-  // Basic validation
-  if (data.size() < 2 || data[0] != 0xFF || data[1] != 0xD8) {
+  return img;
+}
+
+JpegDecoder::Stream::Stream(const std::string &filepath,
+                            const Options &options)
+    : file_(filepath), options_(options) {
+  Stats::add(Stats::BYTES_IN, file_.size());
+  Stats::ScopedTimer timer(Stats::PARSE);
+  if (file_.size() < 2 || file_.data()[0] != 0xFF || file_.data()[1] != 0xD8) {
     throw std::runtime_error("Not a valid JPEG file (missing SOI)");
   }
+  parseSegments(file_.data(), file_.size(), 2, frame_);
+  prepareFrame(frame_, options_);
+}
+
+void JpegDecoder::Stream::decodeRows(const RowCallback &onRow) {
+  const size_t mcusX = frame_.mcusX;
+  const int mcuHeight = frame_.maxV * frame_.blockSize;
+  const size_t stride = (size_t)frame_.outWidth * 3;
+  Image strip(frame_.outWidth, mcuHeight, 3); // One MCU row of output
+  std::vector<std::vector<uint8_t>> planes;
+
+  // Hands out the window's rows of the MCU row in the strip
+  auto emitRow = [&](int row) {
+    int top = row * mcuHeight - frame_.cropY;
+    int end = std::min(top + mcuHeight, frame_.outHeight);
+    for (int y = std::max(top, 0); y < end; ++y)
+      onRow(y, &strip.data[(y - top) * stride]);
+  };
+
+  if (frame_.multiScan()) {
+    std::vector<int16_t> coefs =
+        decodeScans(file_.data(), file_.size(), frame_);
+    for (int row = frame_.firstMcuY; row < frame_.endMcuY; ++row) {
+      reconstructRow(frame_, options_, coefs.data(), row,
+                     row * mcuHeight - frame_.cropY, planes, strip);
+      emitRow(row);
+    }
+    return;
+  }
+
+  size_t mcuCount = mcusX * frame_.mcusY;
+  size_t interval =
+      frame_.restartInterval > 0 ? frame_.restartInterval : mcuCount;
+  std::vector<size_t> starts = findRestartIntervals(frame_, nullptr);
+  if (starts.size() < (mcuCount + interval - 1) / interval)
+    throw std::runtime_error("Missing restart marker");
 
-  int width = 0, height = 0;
-  std::vector<QuantTable> quantTables(4);
-  std::vector<HuffmanTable> dcTables(4);
-  std::vector<HuffmanTable> acTables(4);
-  std::vector<Component> components;
-  const uint8_t *scanData = nullptr;
-  size_t scanDataLen = 0;
+  std::vector<int16_t> coefs(mcusX * frame_.blocksPerMcu * 64);
+  std::vector<uint8_t> lastIndex(mcusX * frame_.blocksPerMcu);
 
-  parseSegments(data, quantTables, dcTables, acTables, components, width,
-                height, scanData, scanDataLen);
+  // Start at the restart interval holding the window's first row
+  size_t mcu = ((size_t)frame_.firstMcuY * mcusX / interval) * interval;
+  size_t start = starts[mcu / interval];
+  JpegBitReader reader(frame_.scanData + start, frame_.scanDataLen - start);
+  int prevDC[4] = {0, 0, 0, 0};
 
-  if (!scanData) {
+  for (int row = mcu / mcusX; row < frame_.endMcuY; ++row) {
+    decodeMcuRow(frame_, starts, reader, prevDC, mcu, coefs.data(),
+                 lastIndex.data());
+    if (row < frame_.firstMcuY)
+      continue;
+    for (int x = frame_.firstMcuX; x < frame_.endMcuX; ++x) {
+      reconstructMcu(frame_, options_, &coefs[x * frame_.blocksPerMcu * 64],
+                     &lastIndex[x * frame_.blocksPerMcu], planes, x, row,
+                     row * mcuHeight - frame_.cropY, strip);
+    }
+    emitRow(row);
+  }
+}
+
+void JpegDecoder::prepareFrame(Frame &frame, const Options &options) {
+  if (!frame.scanData) {
     throw std::runtime_error("No SOS marker found");
   }
+  if (frame.components.empty() || frame.width <= 0 || frame.height <= 0) {
+    throw std::runtime_error(
+        "Unsupported JPEG (no baseline or progressive frame header)");
+  }
+  if (frame.components.size() > 4) {
+    throw std::runtime_error("Too many components in JPEG frame");
+  }
 
-  Image img;
-  img.width = width;
-  img.height = height;
-  img.channels = 3;
-  img.data.resize(width * height * 3);
+  // Dequantization multipliers; DQT stores the values in zigzag order
+  for (int t = 0; t < 4; ++t) {
+    uint16_t natural[64];
+    for (int k = 0; k < 64; ++k)
+      natural[ZIGZAG[k]] = frame.quantTables[t].values[k];
+    JpegDct::prepareInverse(natural, frame.inverseTables[t]);
+  }
 
   // MCU calculations
-  int maxH = 0, maxV = 0;
-  for (const auto &c : components) {
-    if (c.hSampFactor > maxH)
-      maxH = c.hSampFactor;
-    if (c.vSampFactor > maxV)
-      maxV = c.vSampFactor;
-  }
-
-  int mcuWidth = maxH * 8;
-  int mcuHeight = maxV * 8;
-  int mcusX = (width + mcuWidth - 1) / mcuWidth;
-  int mcusY = (height + mcuHeight - 1) / mcuHeight;
-
-  JpegBitReader reader(scanData, scanDataLen);
-
-  // Helper to decode one symbol from stream
-  auto decodeSymbol = [](JpegBitReader &reader,
-                         const HuffmanTable &table) -> int {
-    int code = 0;
-    for (int i = 0; i < 16; ++i) {
-      int bit = reader.readBit();
-      if (bit == -1)
-        return -1;
-      code = (code << 1) | bit;
-      if (code <= table.maxCode[i]) {
-        int idx = table.valPtr[i] + (code - table.minCode[i]);
-        return table.huffval[idx];
+  frame.maxH = 0;
+  frame.maxV = 0;
+  for (const auto &c : frame.components) {
+    if (c.hSampFactor < 1 || c.hSampFactor > 4 || c.vSampFactor < 1 ||
+        c.vSampFactor > 4)
+      throw std::runtime_error("Invalid sampling factors");
+    frame.maxH = std::max(frame.maxH, c.hSampFactor);
+    frame.maxV = std::max(frame.maxV, c.vSampFactor);
+  }
+
+  frame.mcuWidth = frame.maxH * 8;
+  frame.mcuHeight = frame.maxV * 8;
+  frame.mcusX = (frame.width + frame.mcuWidth - 1) / frame.mcuWidth;
+  frame.mcusY = (frame.height + frame.mcuHeight - 1) / frame.mcuHeight;
+  frame.blocksPerMcu = 0;
+
+  int scale = options.scale;
+  if (scale != 1 && scale != 2 && scale != 4 && scale != 8)
+    throw std::runtime_error("JPEG decode scale must be 1, 2, 4 or 8");
+  frame.blockSize = 8 / scale;
+
+  // Output window: the crop region clipped to the image, in scaled pixels
+  // (rounded outwards), and the MCUs that cover it
+  int x0 = clamp(options.cropX, 0, frame.width);
+  int y0 = clamp(options.cropY, 0, frame.height);
+  int x1 = options.cropWidth > 0
+               ? clamp(options.cropX + options.cropWidth, x0, frame.width)
+               : frame.width;
+  int y1 = options.cropHeight > 0
+               ? clamp(options.cropY + options.cropHeight, y0, frame.height)
+               : frame.height;
+  if (x0 >= x1 || y0 >= y1)
+    throw std::runtime_error("Crop region lies outside the image");
+  frame.cropX = x0 / scale;
+  frame.cropY = y0 / scale;
+  frame.outWidth = (x1 + scale - 1) / scale - frame.cropX;
+  frame.outHeight = (y1 + scale - 1) / scale - frame.cropY;
+
+  int mcuOutWidth = frame.maxH * frame.blockSize;
+  int mcuOutHeight = frame.maxV * frame.blockSize;
+  frame.firstMcuX = frame.cropX / mcuOutWidth;
+  frame.firstMcuY = frame.cropY / mcuOutHeight;
+  frame.endMcuX =
+      (frame.cropX + frame.outWidth + mcuOutWidth - 1) / mcuOutWidth;
+  frame.endMcuY =
+      (frame.cropY + frame.outHeight + mcuOutHeight - 1) / mcuOutHeight;
+  for (Component &c : frame.components) {
+    c.blockOffset = frame.blocksPerMcu;
+    frame.blocksPerMcu += c.hSampFactor * c.vSampFactor;
+    c.stride = c.hSampFactor * frame.blockSize;
+    c.colIndex.resize(mcuOutWidth);
+    c.rowIndex.resize(mcuOutHeight);
+    for (int x = 0; x < mcuOutWidth; ++x)
+      c.colIndex[x] = (x * c.hSampFactor) / frame.maxH;
+    for (int y = 0; y < mcuOutHeight; ++y)
+      c.rowIndex[y] = ((y * c.vSampFactor) / frame.maxV) * c.stride;
+  }
+}
+
+std::vector<size_t> JpegDecoder::findRestartIntervals(const Frame &frame,
+                                                      size_t *scanLength) {
+  std::vector<size_t> starts(1, 0);
+  if (frame.restartInterval == 0 && !scanLength)
+    return starts;
+
+  // Stuffed 0xFF00 and fill bytes are skipped; the scan ends at the first
+  // marker that is not RSTn
+  const uint8_t *data = frame.scanData;
+  size_t size = frame.scanDataLen;
+  size_t pos = 0;
+  size_t end = size;
+  while (pos + 1 < size) {
+    const void *ff = std::memchr(data + pos, 0xFF, size - pos - 1);
+    if (!ff)
+      break;
+    pos = static_cast<const uint8_t *>(ff) - data;
+    uint8_t marker = data[pos + 1];
+    if (marker == 0x00 || marker == 0xFF) {
+      pos += marker == 0x00 ? 2 : 1;
+    } else if (marker >= 0xD0 && marker <= 0xD7) {
+      pos += 2;
+      starts.push_back(pos);
+    } else {
+      end = pos;
+      break;
+    }
+  }
+  if (scanLength)
+    *scanLength = end;
+  return starts;
+}
+
+void JpegDecoder::decodeMcus(const Frame &frame, const Options &options,
+                             const uint8_t *data, size_t size, size_t firstMcu,
+                             size_t endMcu, Image &img) {
+  JpegBitReader reader(data, size);
+  int prevDC[4] = {0, 0, 0, 0};
+  std::vector<int16_t> coefs(frame.blocksPerMcu * 64);
+  std::vector<uint8_t> lastIndex(frame.blocksPerMcu);
+  std::vector<std::vector<uint8_t>> planes;
+
+  for (size_t mcu = firstMcu; mcu < endMcu; ++mcu) {
+    decodeMcu(frame, reader, prevDC, coefs.data(), lastIndex.data());
+    if (!frame.inWindow(mcu))
+      continue;
+    reconstructMcu(frame, options, coefs.data(), lastIndex.data(), planes,
+                   static_cast<int>(mcu % frame.mcusX),
+                   static_cast<int>(mcu / frame.mcusX), 0, img);
+  }
+}
+
+void JpegDecoder::decodeMcuRow(const Frame &frame,
+                               const std::vector<size_t> &intervalStarts,
+                               JpegBitReader &reader, int *prevDC, size_t &mcu,
+                               int16_t *rowCoefs, uint8_t *rowLast) {
+  const size_t mcusX = frame.mcusX;
+  size_t interval = frame.restartInterval > 0 ? frame.restartInterval
+                                              : mcusX * frame.mcusY;
+  for (size_t x = mcu % mcusX; x < mcusX; ++x, ++mcu) {
+    if (mcu % interval == 0 && mcu > 0) {
+      // Restart: continue after the RSTn marker with fresh predictors
+      size_t start = intervalStarts[mcu / interval];
+      reader =
+          JpegBitReader(frame.scanData + start, frame.scanDataLen - start);
+      std::fill(prevDC, prevDC + 4, 0);
+    }
+    decodeMcu(frame, reader, prevDC, rowCoefs + x * frame.blocksPerMcu * 64,
+              rowLast + x * frame.blocksPerMcu);
+  }
+}
+
+void JpegDecoder::decodePipelined(const Frame &frame, const Options &options,
+                                  const std::vector<size_t> &intervalStarts,
+                                  ThreadPool &pool, Image &img) {
+  const size_t mcusX = frame.mcusX;
+  const size_t rowBlocks = mcusX * frame.blocksPerMcu;
+  const size_t firstRow = frame.firstMcuY;
+  const size_t endRow = frame.endMcuY;
+  size_t interval = frame.restartInterval > 0 ? frame.restartInterval
+                                              : mcusX * frame.mcusY;
+
+  // Ring of MCU-row slots. The entropy decoder fills row r into slot
+  // r % slots once that slot's previous row has been reconstructed; the
+  // other threads claim filled rows in order and reconstruct them. Rows
+  // above the window are decoded into a scratch row and never handed on.
+  const size_t slots = 2 * static_cast<size_t>(pool.size());
+  std::vector<int16_t> coefs((slots + 1) * rowBlocks * 64);
+  std::vector<uint8_t> lastIndex((slots + 1) * rowBlocks);
+  std::vector<bool> slotFree(slots, true);
+  size_t rowsDecoded = firstRow; // Rows available for reconstruction
+  size_t nextRow = firstRow;     // Next row to hand to a reconstruction thread
+  bool aborted = false;          // Set by whichever side fails first
+  std::mutex mutex;
+  std::condition_variable changed;
+
+  auto abort = [&] {
+    std::lock_guard<std::mutex> lock(mutex);
+    aborted = true;
+    changed.notify_all();
+  };
+
+  auto entropyDecode = [&] {
+    // Start at the restart interval holding the window's first row
+    size_t mcu = (firstRow * mcusX / interval) * interval;
+    size_t start = intervalStarts[mcu / interval];
+    JpegBitReader reader(frame.scanData + start, frame.scanDataLen - start);
+    int prevDC[4] = {0, 0, 0, 0};
+
+    for (size_t row = mcu / mcusX; row < endRow; ++row) {
+      size_t slot = slots; // Scratch
+      if (row >= firstRow) {
+        slot = row % slots;
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return slotFree[slot] || aborted; });
+        if (aborted)
+          return;
+        slotFree[slot] = false;
+      }
+
+      decodeMcuRow(frame, intervalStarts, reader, prevDC, mcu,
+                   &coefs[slot * rowBlocks * 64], &lastIndex[slot * rowBlocks]);
+
+      if (slot < slots) {
+        std::lock_guard<std::mutex> lock(mutex);
+        rowsDecoded = row + 1;
+        changed.notify_all();
+      }
+    }
+  };
+
+  auto reconstruct = [&] {
+    std::vector<std::vector<uint8_t>> planes;
+    for (;;) {
+      size_t row;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] {
+          return nextRow < rowsDecoded || nextRow == endRow || aborted;
+        });
+        if (nextRow == endRow || aborted)
+          return;
+        row = nextRow++;
       }
+
+      size_t slot = row % slots;
+      const int16_t *rowCoefs = &coefs[slot * rowBlocks * 64];
+      const uint8_t *rowLast = &lastIndex[slot * rowBlocks];
+      for (int x = frame.firstMcuX; x < frame.endMcuX; ++x) {
+        reconstructMcu(frame, options, rowCoefs + x * frame.blocksPerMcu * 64,
+                       rowLast + x * frame.blocksPerMcu, planes, x,
+                       static_cast<int>(row), 0, img);
+      }
+
+      std::lock_guard<std::mutex> lock(mutex);
+      slotFree[slot] = true;
+      changed.notify_all();
+    }
+  };
+
+  // Task 0 is handed out first, so the entropy decoder always runs
+  pool.parallelFor(pool.size(), [&](size_t task) {
+    try {
+      if (task == 0)
+        entropyDecode();
+      else
+        reconstruct();
+    } catch (...) {
+      abort();
+      throw;
+    }
+  });
+}
+
+void JpegDecoder::decodeMultiScan(const uint8_t *data, size_t size,
+                                  Frame &frame, const Options &options,
+                                  ThreadPool &pool, Image &img) {
+  std::vector<int16_t> coefs = decodeScans(data, size, frame);
+  pool.parallelFor(frame.endMcuY - frame.firstMcuY, [&](size_t i) {
+    std::vector<std::vector<uint8_t>> planes;
+    reconstructRow(frame, options, coefs.data(),
+                   static_cast<int>(frame.firstMcuY + i), 0, planes, img);
+  });
+}
+
+std::vector<int16_t> JpegDecoder::decodeScans(const uint8_t *data, size_t size,
+                                              Frame &frame) {
+  std::vector<int16_t> coefs((size_t)frame.mcusX * frame.endMcuY *
+                             frame.blocksPerMcu * 64);
+
+  // Scans may be separated by new Huffman tables or restart intervals
+  while (frame.scanData) {
+    size_t scanEnd;
+    {
+      Stats::ScopedTimer timer(Stats::ENTROPY_DECODE);
+      scanEnd = (frame.scanData - data) + decodeScan(frame, coefs.data());
     }
-    return -1; // Not found
+    frame.scanData = nullptr;
+    Stats::ScopedTimer timer(Stats::PARSE);
+    parseSegments(data, size, scanEnd, frame);
+  }
+  return coefs;
+}
+
+void JpegDecoder::reconstructRow(const Frame &frame, const Options &options,
+                                 const int16_t *coefs, int mcuY, int imgY,
+                                 std::vector<std::vector<uint8_t>> &planes,
+                                 Image &img) {
+  const size_t blocksPerMcu = frame.blocksPerMcu;
+  std::vector<uint8_t> lastIndex(blocksPerMcu);
+  for (int x = frame.firstMcuX; x < frame.endMcuX; ++x) {
+    const int16_t *mcu =
+        &coefs[((size_t)mcuY * frame.mcusX + x) * blocksPerMcu * 64];
+    for (size_t b = 0; b < blocksPerMcu; ++b) {
+      const int16_t *block = mcu + b * 64;
+      int k = 63;
+      while (k > 0 && block[ZIGZAG[k]] == 0)
+        --k;
+      lastIndex[b] = static_cast<uint8_t>(k);
+    }
+    reconstructMcu(frame, options, mcu, lastIndex.data(), planes, x, mcuY,
+                   imgY, img);
+  }
+}
+
+size_t JpegDecoder::decodeScan(const Frame &frame, int16_t *coefs) {
+  const int ss = frame.spectralStart;
+  const int se = frame.spectralEnd;
+  const int ah = frame.approxHigh;
+  const int al = frame.approxLow;
+  const bool interleaved = frame.scanComponents.size() > 1;
+  if (frame.progressive &&
+      (ss > se || se > 63 || ah > 13 || al > 13 || (ss == 0 && se != 0) ||
+       (ss > 0 && interleaved)))
+    throw std::runtime_error("Invalid progressive scan parameters");
+
+  // An interleaved scan codes whole MCUs. A single-component scan codes
+  // one block at a time, in raster order over just the blocks that cover
+  // the component's part of the image.
+  size_t unitsX = frame.mcusX;
+  size_t unitsY = frame.mcusY;
+  if (!interleaved) {
+    const Component &c = frame.components[frame.scanComponents[0]];
+    size_t width = (frame.width * c.hSampFactor + frame.maxH - 1) / frame.maxH;
+    size_t height =
+        (frame.height * c.vSampFactor + frame.maxV - 1) / frame.maxV;
+    unitsX = (width + 7) / 8;
+    unitsY = (height + 7) / 8;
+  }
+
+  size_t scanLength = 0;
+  std::vector<size_t> starts = findRestartIntervals(frame, &scanLength);
+  size_t units = unitsX * unitsY;
+  size_t interval = frame.restartInterval > 0 ? frame.restartInterval : units;
+  if (starts.size() < (units + interval - 1) / interval)
+    throw std::runtime_error("Missing restart marker");
+
+  JpegBitReader reader(frame.scanData, scanLength);
+  int prevDC[4] = {0, 0, 0, 0};
+  int eobrun = 0;
+  uint64_t symbols = 0;
+
+  // MCU holding a unit's block(s)
+  auto unitMcu = [&](size_t unit) {
+    if (interleaved)
+      return unit;
+    const Component &c = frame.components[frame.scanComponents[0]];
+    return (unit / unitsX / c.vSampFactor) * frame.mcusX +
+           unit % unitsX / c.hSampFactor;
   };
 
-  // Buffers for MCU blocks
-  // We need to store full MCU data to handle upsampling
-  // Structure: components[i].blocks[v][h][64]
-  struct ComponentData {
-    std::vector<std::vector<std::vector<float>>> blocks; // [v][h][64]
+  auto decodeUnitBlock = [&](int comp, int16_t *block) {
+    const Component &c = frame.components[comp];
+    const HuffmanTable &dcTable = frame.dcTables[c.dcTableId];
+    const HuffmanTable &acTable = frame.acTables[c.acTableId];
+    if (!frame.progressive)
+      decodeBlock(reader, dcTable, acTable, prevDC[comp], block, symbols);
+    else if (ss == 0 && ah == 0)
+      decodeDcFirst(reader, dcTable, al, prevDC[comp], block);
+    else if (ss == 0)
+      decodeDcRefine(reader, al, block);
+    else if (ah == 0)
+      decodeAcFirst(reader, acTable, ss, se, al, eobrun, block);
+    else
+      decodeAcRefine(reader, acTable, ss, se, al, eobrun, block);
   };
-  std::vector<ComponentData> mcuData(components.size());
-  for (size_t i = 0; i < components.size(); ++i) {
-    mcuData[i].blocks.resize(components[i].vSampFactor);
-    for (int v = 0; v < components[i].vSampFactor; ++v) {
-      mcuData[i].blocks[v].resize(components[i].hSampFactor);
-      for (int h = 0; h < components[i].hSampFactor; ++h) {
-        mcuData[i].blocks[v][h].resize(64);
+
+  // Units come in raster order, so decoding stops below the window. With
+  // restarts, intervals that hold no window blocks are skipped outright.
+  for (size_t unit = 0; unit < units; ++unit) {
+    if (unitMcu(unit) / frame.mcusX >= (size_t)frame.endMcuY)
+      break;
+
+    if (unit % interval == 0) {
+      if (frame.restartInterval > 0) {
+        size_t end = std::min(units, unit + interval);
+        bool wanted = false;
+        for (size_t u = unit; u < end && !wanted; ++u)
+          wanted = frame.inWindow(unitMcu(u));
+        if (!wanted) {
+          unit = end - 1;
+          continue;
+        }
+      }
+      if (unit > 0) {
+        size_t start = starts[unit / interval];
+        reader = JpegBitReader(frame.scanData + start, scanLength - start);
+        std::fill(prevDC, prevDC + 4, 0);
+        eobrun = 0;
+      }
+    }
+
+    if (interleaved) {
+      int16_t *mcu = coefs + unit * frame.blocksPerMcu * 64;
+      for (int comp : frame.scanComponents) {
+        const Component &c = frame.components[comp];
+        for (int n = 0; n < c.hSampFactor * c.vSampFactor; ++n)
+          decodeUnitBlock(comp, mcu + (c.blockOffset + n) * 64);
       }
+    } else {
+      // Locate the block within its MCU
+      int comp = frame.scanComponents[0];
+      const Component &c = frame.components[comp];
+      size_t bx = unit % unitsX;
+      size_t by = unit / unitsX;
+      size_t mcu = unitMcu(unit);
+      size_t block = c.blockOffset + (by % c.vSampFactor) * c.hSampFactor +
+                     bx % c.hSampFactor;
+      decodeUnitBlock(comp, coefs + (mcu * frame.blocksPerMcu + block) * 64);
     }
   }
+  Stats::add(Stats::SYMBOLS_DECODED, symbols);
+  return scanLength;
+}
 
-  for (int mcuY = 0; mcuY < mcusY; ++mcuY) {
-    for (int mcuX = 0; mcuX < mcusX; ++mcuX) {
-
-      // Decode MCU
-      for (size_t i = 0; i < components.size(); ++i) {
-        Component &c = components[i];
-        HuffmanTable &dcTable = dcTables[c.dcTableId];
-        HuffmanTable &acTable = acTables[c.acTableId];
-        QuantTable &qTable = quantTables[c.quantTableId];
-
-        for (int v = 0; v < c.vSampFactor; ++v) {
-          for (int h = 0; h < c.hSampFactor; ++h) {
-            float *block = mcuData[i].blocks[v][h].data();
-            std::memset(block, 0, 64 * sizeof(float));
-
-            // Decode DC
-            int s = decodeSymbol(reader, dcTable);
-            if (s == -1)
-              throw std::runtime_error("Huffman decode error (DC)");
-            int diff = 0;
-            if (s > 0) {
-              int bits = reader.readBits(s);
-              if (bits == -1)
-                throw std::runtime_error("Stream ended unexpectedly");
-              if (bits < (1 << (s - 1))) {
-                bits += ((-1) << s) + 1;
-              }
-              diff = bits;
-            }
-            c.prevDC += diff;
-            block[0] = (float)c.prevDC * qTable.values[0];
-
-            // Decode AC
-            int k = 1;
-            while (k < 64) {
-              int s = decodeSymbol(reader, acTable);
-              if (s == -1)
-                throw std::runtime_error("Huffman decode error (AC)");
-              int r = s >> 4;
-              int num = s & 0x0F;
-
-              if (s == 0x00) { // EOB
-                break;
-              } else if (s == 0xF0) { // ZRL
-                k += 16;
-              } else {
-                k += r;
-                int bits = reader.readBits(num);
-                if (bits == -1)
-                  throw std::runtime_error("Stream ended unexpectedly");
-                if (bits < (1 << (num - 1))) {
-                  bits += ((-1) << num) + 1;
-                }
-                block[ZIGZAG[k]] = (float)bits * qTable.values[k];
-                k++;
-              }
-            }
-
-            // IDCT
-            idct(block);
+void JpegDecoder::decodeMcu(const Frame &frame, JpegBitReader &reader,
+                            int *prevDC, int16_t *coefs, uint8_t *lastIndex) {
+  Stats::ScopedTimer timer(Stats::ENTROPY_DECODE);
+  uint64_t symbols = 0;
+  int b = 0;
+  for (size_t i = 0; i < frame.components.size(); ++i) {
+    const Component &c = frame.components[i];
+    const HuffmanTable &dcTable = frame.dcTables[c.dcTableId];
+    const HuffmanTable &acTable = frame.acTables[c.acTableId];
+    for (int n = 0; n < c.hSampFactor * c.vSampFactor; ++n, ++b) {
+      lastIndex[b] = static_cast<uint8_t>(decodeBlock(
+          reader, dcTable, acTable, prevDC[i], coefs + b * 64, symbols));
+    }
+  }
+  Stats::add(Stats::SYMBOLS_DECODED, symbols);
+}
+
+void JpegDecoder::reconstructMcu(const Frame &frame, const Options &options,
+                                 const int16_t *coefs,
+                                 const uint8_t *lastIndex,
+                                 std::vector<std::vector<uint8_t>> &planes,
+                                 int mcuX, int mcuY, int imgY, Image &img) {
+  const std::vector<Component> &components = frame.components;
+  if (planes.size() != components.size()) {
+    planes.resize(components.size());
+    for (size_t i = 0; i < components.size(); ++i)
+      planes[i].resize(components[i].stride * components[i].vSampFactor *
+                       frame.blockSize);
+  }
+
+  if (Stats::enabled()) {
+    Stats::add(Stats::BLOCKS, frame.blocksPerMcu);
+    for (int b = 0; b < frame.blocksPerMcu; ++b)
+      Stats::addEob(lastIndex[b]);
+  }
+
+  // Dequantize and inverse transform every block into the component planes
+  const int blockSize = frame.blockSize;
+  {
+    Stats::ScopedTimer timer(Stats::DCT);
+    int b = 0;
+    for (size_t i = 0; i < components.size(); ++i) {
+      const Component &c = components[i];
+      const JpegDct::InverseTable &inverseTable =
+          frame.inverseTables[c.quantTableId];
+      for (int v = 0; v < c.vSampFactor; ++v) {
+        for (int h = 0; h < c.hSampFactor; ++h, ++b) {
+          uint8_t *out = &planes[i][(v * c.stride + h) * blockSize];
+          if (blockSize == 8) {
+            JpegDct::inverse(options.idct, coefs + b * 64, inverseTable,
+                             lastIndex[b], out, c.stride);
+          } else {
+            JpegDct::inverseScaled(coefs + b * 64, inverseTable, lastIndex[b],
+                                   blockSize, out, c.stride);
           }
         }
       }
+    }
+  }
 
-      // Color Conversion and Output
-      // Iterate over pixels in the MCU
-      for (int y = 0; y < mcuHeight; ++y) {
-        int globalY = mcuY * mcuHeight + y;
-        if (globalY >= height)
-          break;
+  // Color conversion and output, upsampling chroma by replication
+  Stats::ScopedTimer timer(Stats::COLOR_CONVERT);
+  // Clip the MCU to the output window
+  int mcuWidth = frame.maxH * blockSize;
+  int mcuHeight = frame.maxV * blockSize;
+  int left = mcuX * mcuWidth - frame.cropX;
+  int top = mcuY * mcuHeight - frame.cropY;
+  int firstCol = std::max(0, -left);
+  int cols = std::min(mcuWidth, frame.outWidth - left);
+  int firstRow = std::max(0, -top);
+  int rows = std::min(mcuHeight, frame.outHeight - top);
+  for (int y = firstRow; y < rows; ++y) {
+    uint8_t *out =
+        &img.data[((size_t)(top + y - imgY) * frame.outWidth + left + firstCol) *
+                  3];
 
-        for (int x = 0; x < mcuWidth; ++x) {
-          int globalX = mcuX * mcuWidth + x;
-          if (globalX >= width)
-            break;
-
-          // Get Y, Cb, Cr values
-          // Handle subsampling by mapping pixel (x,y) in MCU to block
-          // coordinates
-          float Y = 0, Cb = 0, Cr = 0;
-
-          // Y Component (assume ID 1 or index 0)
-          // Assuming components are Y, Cb, Cr in order 0, 1, 2
-          // TODO: Use component IDs to be sure
-
-          auto getComponentValue = [&](int compIdx, int x, int y) {
-            const Component &c = components[compIdx];
-            // Map x, y (0..mcuWidth-1, 0..mcuHeight-1) to block coords
-            // Effective scale factors relative to MCU size
-            // MCU size is maxH*8 x maxV*8
-            // Component size is c.hSamp * 8 x c.vSamp * 8
-
-            // Scale x, y to component grid
-            int cx = (x * c.hSampFactor) / maxH;
-            int cy = (y * c.vSampFactor) / maxV;
-
-            // Find block and offset
-            int bx = cx / 8;
-            int by = cy / 8;
-            int ox = cx % 8;
-            int oy = cy % 8;
-
-            // Clamp block indices just in case
-            if (bx >= c.hSampFactor)
-              bx = c.hSampFactor - 1;
-            if (by >= c.vSampFactor)
-              by = c.vSampFactor - 1;
-
-            return mcuData[compIdx].blocks[by][bx][oy * 8 + ox];
-          };
-
-          if (components.size() >= 1)
-            Y = getComponentValue(0, x, y);
-          if (components.size() >= 3) {
-            Cb = getComponentValue(1, x, y);
-            Cr = getComponentValue(2, x, y);
-          }
+    if (components.size() < 3) {
+      // Grayscale
+      const Component &lum = components[0];
+      const uint8_t *row = &planes[0][lum.rowIndex[y]];
+      for (int x = firstCol; x < cols; ++x, out += 3) {
+        uint8_t l = row[lum.colIndex[x]];
+        out[0] = out[1] = out[2] = l;
+      }
+      continue;
+    }
 
-          // Level shift (JPEG is usually centered around 0, but we added 128 in
-          // encoder? Actually standard JPEG is YCbCr, where Y is [0,255] and
-          // CbCr are centered at 128. The IDCT output is centered around 0 for
-          // AC, but DC is unsigned. Wait, standard JPEG: Y = Y + 128 Cb = Cb +
-          // 128 Cr = Cr + 128 But wait, our IDCT implementation assumes input
-          // was shifted by -128 before DCT? Usually: Pixel -> -128 -> DCT ->
-          // Quant Reverse: Dequant -> IDCT -> +128 -> Pixel
-
-          Y += 128.0f;
-          Cb += 128.0f;
-          Cr += 128.0f;
-
-          uint8_t r, g, b;
-          ycbcrToRgb(Y, Cb, Cr, r, g, b);
-
-          int pixelIdx = (globalY * width + globalX) * 3;
-          img.data[pixelIdx] = r;
-          img.data[pixelIdx + 1] = g;
-          img.data[pixelIdx + 2] = b;
-        }
+    const uint8_t *rowY = &planes[0][components[0].rowIndex[y]];
+    const uint8_t *rowCb = &planes[1][components[1].rowIndex[y]];
+    const uint8_t *rowCr = &planes[2][components[2].rowIndex[y]];
+    for (int x = firstCol; x < cols; ++x, out += 3) {
+      ycbcrToRgb(rowY[components[0].colIndex[x]],
+                 rowCb[components[1].colIndex[x]],
+                 rowCr[components[2].colIndex[x]], out);
+    }
+  }
+}
+
+int JpegDecoder::decodeBlock(JpegBitReader &reader,
+                             const HuffmanTable &dcTable,
+                             const HuffmanTable &acTable, int &prevDC,
+                             int16_t *block, uint64_t &symbols) {
+  std::memset(block, 0, 64 * sizeof(int16_t));
+
+  // Decode DC
+  int s = decodeHuffman(reader, dcTable);
+  ++symbols;
+  if (s < 0 || s > 16)
+    throw std::runtime_error("Huffman decode error (DC)");
+  if (s > 0)
+    prevDC += extendSign(reader.readBits(s), s);
+  block[0] = static_cast<int16_t>(prevDC);
+
+  // Decode AC, remembering where the last coefficient landed so the IDCT
+  // can skip the parts of the block that are zero
+  int lastIndex = 0;
+  int k = 1;
+  while (k < 64) {
+    // Short codes come with their coefficient already decoded
+    const HuffmanTable::FastAc &fast =
+        acTable.fastAc[reader.peek(HuffmanTable::LOOKAHEAD_BITS)];
+    ++symbols;
+    if (fast.length) {
+      reader.consume(fast.length);
+      k += fast.run;
+      if (k > 63)
+        throw std::runtime_error("AC coefficient index out of range");
+      block[ZIGZAG[k]] = fast.value;
+      lastIndex = k++;
+      continue;
+    }
+
+    int s = decodeHuffman(reader, acTable);
+    if (s == -1)
+      throw std::runtime_error("Huffman decode error (AC)");
+    int r = s >> 4;
+    int num = s & 0x0F;
+
+    if (s == 0x00) { // EOB
+      break;
+    } else if (s == 0xF0) { // ZRL
+      k += 16;
+    } else if (num == 0) {
+      throw std::runtime_error("Invalid AC symbol");
+    } else {
+      k += r;
+      if (k > 63)
+        throw std::runtime_error("AC coefficient index out of range");
+      block[ZIGZAG[k]] =
+          static_cast<int16_t>(extendSign(reader.readBits(num), num));
+      lastIndex = k++;
+    }
+  }
+  return lastIndex;
+}
+
+void JpegDecoder::decodeDcFirst(JpegBitReader &reader,
+                                const HuffmanTable &table, int al, int &prevDC,
+                                int16_t *block) {
+  int s = decodeHuffman(reader, table);
+  if (s < 0 || s > 16)
+    throw std::runtime_error("Huffman decode error (DC)");
+  if (s > 0)
+    prevDC += extendSign(reader.readBits(s), s);
+  block[0] = static_cast<int16_t>(prevDC * (1 << al));
+}
+
+void JpegDecoder::decodeDcRefine(JpegBitReader &reader, int al,
+                                 int16_t *block) {
+  if (reader.readBits(1))
+    block[0] = static_cast<int16_t>(block[0] | (1 << al));
+}
+
+void JpegDecoder::decodeAcFirst(JpegBitReader &reader,
+                                const HuffmanTable &table, int ss, int se,
+                                int al, int &eobrun, int16_t *block) {
+  if (eobrun > 0) {
+    --eobrun;
+    return;
+  }
+
+  for (int k = ss; k <= se; ++k) {
+    const HuffmanTable::FastAc &fast =
+        table.fastAc[reader.peek(HuffmanTable::LOOKAHEAD_BITS)];
+    if (fast.length) {
+      reader.consume(fast.length);
+      k += fast.run;
+      if (k > 63)
+        throw std::runtime_error("AC coefficient index out of range");
+      block[ZIGZAG[k]] = static_cast<int16_t>(fast.value * (1 << al));
+      continue;
+    }
+
+    int rs = decodeHuffman(reader, table);
+    if (rs == -1)
+      throw std::runtime_error("Huffman decode error (AC)");
+    int r = rs >> 4;
+    int s = rs & 0x0F;
+    if (s == 0) {
+      if (r < 15) { // EOBn: this block and 2^r + extra - 1 more end here
+        eobrun = (1 << r) - 1 + reader.readBits(r);
+        break;
       }
+      k += 15; // ZRL
+      continue;
     }
+    k += r;
+    if (k > 63)
+      throw std::runtime_error("AC coefficient index out of range");
+    block[ZIGZAG[k]] =
+        static_cast<int16_t>(extendSign(reader.readBits(s), s) * (1 << al));
   }
+}
 
-  return img;
+void JpegDecoder::decodeAcRefine(JpegBitReader &reader,
+                                 const HuffmanTable &table, int ss, int se,
+                                 int al, int &eobrun, int16_t *block) {
+  const int bit = 1 << al;
+
+  // Coefficients that are already nonzero get one correction bit each,
+  // moving them away from zero
+  auto refine = [&](int16_t &coef) {
+    if (reader.readBits(1) && (coef & bit) == 0)
+      coef = static_cast<int16_t>(coef >= 0 ? coef + bit : coef - bit);
+  };
+
+  int k = ss;
+  if (eobrun == 0) {
+    for (; k <= se; ++k) {
+      int rs = decodeHuffman(reader, table);
+      if (rs == -1)
+        throw std::runtime_error("Huffman decode error (AC)");
+      int r = rs >> 4;
+      int s = rs & 0x0F;
+      int value = 0;
+      if (s != 0) {
+        if (s != 1)
+          throw std::runtime_error("Invalid AC refinement symbol");
+        value = reader.readBits(1) ? bit : -bit;
+      } else if (r != 15) {
+        eobrun = (1 << r) + reader.readBits(r);
+        break;
+      }
+
+      // Skip r still-zero coefficients, refining the nonzero ones passed on
+      // the way, and place the new coefficient in the next zero slot
+      for (; k <= se; ++k) {
+        int16_t &coef = block[ZIGZAG[k]];
+        if (coef != 0)
+          refine(coef);
+        else if (--r < 0)
+          break;
+      }
+      if (value != 0 && k <= se)
+        block[ZIGZAG[k]] = static_cast<int16_t>(value);
+    }
+  }
+
+  if (eobrun > 0) {
+    // Inside an end-of-band run only the correction bits remain
+    for (; k <= se; ++k) {
+      int16_t &coef = block[ZIGZAG[k]];
+      if (coef != 0)
+        refine(coef);
+    }
+    --eobrun;
+  }
 }
 
-void JpegDecoder::parseSegments(const std::vector<uint8_t> &data,
-                                std::vector<QuantTable> &quantTables,
-                                std::vector<HuffmanTable> &dcTables,
-                                std::vector<HuffmanTable> &acTables,
-                                std::vector<Component> &components, int &width,
-                                int &height, const uint8_t *&scanData,
-                                size_t &scanDataLen) {
-  size_t pos = 2; // Skip SOI
-  while (pos < data.size()) {
+void JpegDecoder::parseSegments(const uint8_t *data, size_t size, size_t pos,
+                                Frame &frame) {
+  while (pos < size) {
     if (data[pos] != 0xFF) {
       // Should be a marker
       pos++;
       continue;
     }
 
+    if (pos + 1 >= size)
+      break;
     uint8_t marker = data[pos + 1];
     uint16_t length = 0;
     if (marker != 0xD8 && marker != 0xD9 && (marker < 0xD0 || marker > 0xD7)) {
-      if (pos + 3 >= data.size())
+      if (pos + 3 >= size)
         break;
       length = (data[pos + 2] << 8) | data[pos + 3];
+      // Segments are parsed in place, so never look past the mapped file
+      if (pos + 2 + length > size)
+        throw std::runtime_error("JPEG segment extends past end of file");
     }
 
     // Handle markers
-    if (marker == 0xC0) { // SOF0
+    if (marker == 0xC0 || marker == 0xC1 || marker == 0xC2) { // SOF0-2
       // Parse Frame Header
-      height = (data[pos + 5] << 8) | data[pos + 6];
-      width = (data[pos + 7] << 8) | data[pos + 8];
+      if (!frame.components.empty())
+        throw std::runtime_error("Multiple JPEG frame headers");
+      if (data[pos + 4] != 8)
+        throw std::runtime_error("Unsupported JPEG sample precision");
+      frame.progressive = marker == 0xC2;
+      frame.height = (data[pos + 5] << 8) | data[pos + 6];
+      frame.width = (data[pos + 7] << 8) | data[pos + 8];
       int numComponents = data[pos + 9];
       for (int i = 0; i < numComponents; ++i) {
-        Component c;
+        Component c = Component();
         c.id = data[pos + 10 + i * 3];
         uint8_t samp = data[pos + 11 + i * 3];
         c.hSampFactor = samp >> 4;
         c.vSampFactor = samp & 0x0F;
-        c.quantTableId = data[pos + 12 + i * 3];
-        c.prevDC = 0;
-        components.push_back(c);
+        c.quantTableId = data[pos + 12 + i * 3] & 3;
+        frame.components.push_back(c);
       }
     } else if (marker == 0xC4) { // DHT
       // Parse Huffman Tables
@@ -345,8 +896,9 @@ void JpegDecoder::parseSegments(const std::vector<uint8_t> &data,
       while (tPos < endPos) {
         uint8_t info = data[tPos++];
         int tc = info >> 4; // 0=DC, 1=AC
-        int th = info & 0x0F;
-        HuffmanTable *table = (tc == 0) ? &dcTables[th] : &acTables[th];
+        int th = info & 3;
+        HuffmanTable *table =
+            (tc == 0) ? &frame.dcTables[th] : &frame.acTables[th];
 
         table->bits.resize(16);
         int totalSymbols = 0;
@@ -366,30 +918,57 @@ void JpegDecoder::parseSegments(const std::vector<uint8_t> &data,
       size_t endPos = pos + 2 + length;
       while (tPos < endPos) {
         uint8_t info = data[tPos++];
-        int tq = info & 0x0F;
+        int tq = info & 3;
         // precision is info >> 4 (0=8bit, 1=16bit) - assuming 8bit for now
         for (int i = 0; i < 64; ++i) {
-          quantTables[tq].values[i] = data[tPos++];
+          frame.quantTables[tq].values[i] = data[tPos++];
         }
       }
     } else if (marker == 0xDA) { // SOS
                                  // Start of Scan
       // Parse SOS header then break to decode scan data
       int numComponents = data[pos + 4];
+      if (numComponents < 1 || numComponents > 4 ||
+          length < 6 + 2 * numComponents)
+        throw std::runtime_error("Invalid SOS segment");
+      frame.scanComponents.clear();
       for (int i = 0; i < numComponents; ++i) {
         int id = data[pos + 5 + i * 2];
         uint8_t tableInfo = data[pos + 6 + i * 2];
         // Find component and assign tables
-        for (auto &c : components) {
-          if (c.id == id) {
-            c.dcTableId = tableInfo >> 4;
-            c.acTableId = tableInfo & 0x0F;
-          }
+        int index = -1;
+        for (size_t n = 0; n < frame.components.size(); ++n) {
+          if (frame.components[n].id == id)
+            index = static_cast<int>(n);
         }
+        if (index < 0)
+          throw std::runtime_error("SOS references an unknown component");
+        frame.components[index].dcTableId = (tableInfo >> 4) & 3;
+        frame.components[index].acTableId = tableInfo & 3;
+        frame.scanComponents.push_back(index);
+      }
+      size_t params = pos + 5 + numComponents * 2;
+      frame.spectralStart = data[params];
+      frame.spectralEnd = data[params + 1];
+      frame.approxHigh = data[params + 2] >> 4;
+      frame.approxLow = data[params + 2] & 0x0F;
+
+      // Every table the scan reads must have been defined by a DHT; DC
+      // refinement scans read no codes and AC scans no DC codes
+      bool readsDc = !frame.progressive ||
+                     (frame.spectralStart == 0 && frame.approxHigh == 0);
+      bool readsAc = !frame.progressive || frame.spectralStart > 0;
+      for (int index : frame.scanComponents) {
+        const Component &c = frame.components[index];
+        if ((readsDc && frame.dcTables[c.dcTableId].maxCode.empty()) ||
+            (readsAc && frame.acTables[c.acTableId].maxCode.empty()))
+          throw std::runtime_error("SOS selects an undefined Huffman table");
       }
-      scanData = &data[pos + 2 + length];
-      scanDataLen = data.size() - (pos + 2 + length);
+      frame.scanData = &data[pos + 2 + length];
+      frame.scanDataLen = size - (pos + 2 + length);
       return;                    // Done parsing headers
+    } else if (marker == 0xDD) { // DRI
+      frame.restartInterval = (data[pos + 4] << 8) | data[pos + 5];
     } else if (marker == 0xD9) { // EOI
       return;
     }
@@ -399,74 +978,94 @@ void JpegDecoder::parseSegments(const std::vector<uint8_t> &data,
 }
 
 void JpegDecoder::buildHuffmanTable(HuffmanTable &table) {
+  const int LOOKAHEAD_BITS = HuffmanTable::LOOKAHEAD_BITS;
+
   table.minCode.assign(16, 0);
   table.maxCode.assign(16, -1);
   table.valPtr.assign(16, 0);
+  std::memset(table.lookLength, 0, sizeof(table.lookLength));
+  std::memset(table.lookSymbol, 0, sizeof(table.lookSymbol));
+  std::memset(table.fastAc, 0, sizeof(table.fastAc));
 
   int code = 0;
   int idx = 0;
   for (int i = 0; i < 16; ++i) {
+    int length = i + 1;
     if (table.bits[i] == 0) {
       table.maxCode[i] = -1;
     } else {
       table.valPtr[i] = idx;
       table.minCode[i] = code;
       table.maxCode[i] = code + table.bits[i] - 1;
-      idx += table.bits[i];
-      code += table.bits[i];
+    }
+
+    for (int n = 0; n < table.bits[i]; ++n, ++code, ++idx) {
+      if (length > LOOKAHEAD_BITS || idx >= (int)table.huffval.size())
+        continue;
+      if (code >= (1 << length))
+        throw std::runtime_error("Invalid Huffman table");
+
+      // Every lookahead value that starts with this code
+      uint8_t symbol = table.huffval[idx];
+      int run = symbol >> 4;
+      int size = symbol & 0x0F;
+      int shift = LOOKAHEAD_BITS - length;
+      for (int fill = 0; fill < (1 << shift); ++fill) {
+        int look = (code << shift) | fill;
+        table.lookLength[look] = static_cast<uint8_t>(length);
+        table.lookSymbol[look] = symbol;
+
+        // Meaningless for DC tables, which never consult it
+        if (size > 0 && length + size <= LOOKAHEAD_BITS) {
+          int extra = (fill >> (shift - size)) & ((1 << size) - 1);
+          HuffmanTable::FastAc &fast = table.fastAc[look];
+          fast.value = static_cast<int16_t>(extendSign(extra, size));
+          fast.run = static_cast<uint8_t>(run);
+          fast.length = static_cast<uint8_t>(length + size);
+        }
+      }
     }
     code <<= 1;
   }
 }
 
-// Placeholder implementations
-void JpegDecoder::idct(float *block) {
-  // AAN algorithm or similar 8x8 IDCT
-  // For simplicity, we can use a basic separable IDCT or a faster integer
-  // approximation if needed. Here is a standard floating point IDCT
-  // implementation.
-
-  float temp[64];
-
-  // Rows
-  for (int i = 0; i < 8; ++i) {
-    for (int j = 0; j < 8; ++j) {
-      float sum = 0.0f;
-      for (int k = 0; k < 8; ++k) {
-        float cu =
-            (k == 0) ? 0.70710678f : 1.0f; // 1/sqrt(2) for k=0, 1 for k>0
-        sum += cu * block[i * 8 + k] * cos((2 * j + 1) * k * M_PI / 16.0);
-      }
-      temp[i * 8 + j] = sum * 0.5f;
-    }
+int JpegDecoder::decodeHuffman(JpegBitReader &reader,
+                               const HuffmanTable &table) {
+  const int LOOKAHEAD_BITS = HuffmanTable::LOOKAHEAD_BITS;
+
+  uint32_t look = reader.peek(LOOKAHEAD_BITS);
+  int length = table.lookLength[look];
+  if (length > 0) {
+    reader.consume(length);
+    return table.lookSymbol[look];
   }
 
-  // Columns
-  for (int j = 0; j < 8; ++j) {
-    for (int i = 0; i < 8; ++i) {
-      float sum = 0.0f;
-      for (int k = 0; k < 8; ++k) {
-        float cv =
-            (k == 0) ? 0.70710678f : 1.0f; // 1/sqrt(2) for k=0, 1 for k>0
-        sum += cv * temp[k * 8 + j] * cos((2 * i + 1) * k * M_PI / 16.0);
-      }
-      block[i * 8 + j] = sum * 0.5f;
+  // Longer code: walk the canonical ranges
+  uint32_t bits = reader.peek(16);
+  for (int i = LOOKAHEAD_BITS; i < 16; ++i) {
+    int code = static_cast<int>(bits >> (15 - i));
+    if (code <= table.maxCode[i]) {
+      int idx = table.valPtr[i] + (code - table.minCode[i]);
+      if (idx >= (int)table.huffval.size())
+        return -1;
+      reader.consume(i + 1);
+      return table.huffval[idx];
     }
   }
+  return -1; // Not found
 }
 
-void JpegDecoder::ycbcrToRgb(float y, float cb, float cr, uint8_t &r,
-                             uint8_t &g, uint8_t &b) {
-  // JPEG YCbCr to RGB conversion
+void JpegDecoder::ycbcrToRgb(int y, int cb, int cr, uint8_t *rgb) {
   // R = Y + 1.402 * (Cr - 128)
   // G = Y - 0.344136 * (Cb - 128) - 0.714136 * (Cr - 128)
   // B = Y + 1.772 * (Cb - 128)
+  cb -= 128;
+  cr -= 128;
+  int r = y + ((91881 * cr + 32768) >> 16);
+  int g = y + ((-22554 * cb - 46802 * cr + 32768) >> 16);
+  int b = y + ((116130 * cb + 32768) >> 16);
 
-  float r_f = y + 1.402f * (cr - 128.0f);
-  float g_f = y - 0.344136f * (cb - 128.0f) - 0.714136f * (cr - 128.0f);
-  float b_f = y + 1.772f * (cb - 128.0f);
-
-  r = clamp(static_cast<int>(r_f + 0.5f), 0, 255);
-  g = clamp(static_cast<int>(g_f + 0.5f), 0, 255);
-  b = clamp(static_cast<int>(b_f + 0.5f), 0, 255);
+  rgb[0] = static_cast<uint8_t>(clamp(r, 0, 255));
+  rgb[1] = static_cast<uint8_t>(clamp(g, 0, 255));
+  rgb[2] = static_cast<uint8_t>(clamp(b, 0, 255));
 }
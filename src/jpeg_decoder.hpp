@@ -2,22 +2,67 @@
 #define JPEG_DECODER_HPP
 
 #include "image.hpp"
+#include "jpeg_dct.hpp"
+#include "utils/bit_reader.hpp"
+#include "utils/mapped_file.hpp"
 #include <cstdint>
+#include <functional>
 #include <string>
 #include <vector>
 
+class ThreadPool;
+
 class JpegDecoder {
 public:
+  struct Options {
+    JpegDct::Method idct = JpegDct::INTEGER;
+    // Worker threads, 0 for one per core. With enough restart intervals
+    // they are decoded concurrently; otherwise one thread entropy decodes
+    // while the others reconstruct finished MCU rows.
+    int threads = 1;
+    // Output is 1/scale of the full size in each direction (1, 2, 4 or 8),
+    // straight from reduced-size integer IDCTs
+    int scale = 1;
+    // Region to decode, in full-size pixels and clipped to the image; a
+    // zero width or height extends it to the edge. Only MCUs that overlap
+    // it are reconstructed, and the output covers just the region.
+    int cropX = 0;
+    int cropY = 0;
+    int cropWidth = 0;
+    int cropHeight = 0;
+  };
+
   static Image decode(const std::string &filepath);
+  static Image decode(const std::string &filepath, const Options &options);
+  // Decodes a JPEG held in memory
+  static Image decode(const uint8_t *data, size_t size);
+  static Image decode(const uint8_t *data, size_t size,
+                      const Options &options);
 
 private:
   struct HuffmanTable {
+    // Codes up to this length are decoded with one table lookup
+    static const int LOOKAHEAD_BITS = 9;
+
+    // An AC run/value pair whose code and extra bits both fit in the
+    // lookahead; length 0 if the prefix does not start one
+    struct FastAc {
+      int16_t value;
+      uint8_t run;
+      uint8_t length; // Code plus extra bits
+    };
+
     std::vector<uint8_t> bits;
     std::vector<uint8_t> huffval;
-    // Lookup tables for faster decoding
+    // Canonical code ranges per length, for codes longer than the lookahead
     std::vector<int> minCode;
     std::vector<int> maxCode;
     std::vector<int> valPtr;
+    // Indexed by the next LOOKAHEAD_BITS of the stream: length of the code
+    // starting there (0 if longer) and its symbol
+    uint8_t lookLength[1 << LOOKAHEAD_BITS];
+    uint8_t lookSymbol[1 << LOOKAHEAD_BITS];
+    FastAc fastAc[1 << LOOKAHEAD_BITS];
   };
 
   struct QuantTable {
@@ -31,13 +76,77 @@ private:
     int quantTableId;
     int dcTableId;
     int acTableId;
-    int prevDC;
-    std::vector<uint8_t> rawData; // For now, maybe just keep track of blocks
+
+    // Layout of the component's output samples within one MCU (hSamp by
+    // vSamp blocks), and for each MCU pixel the sample it upsamples from
+    int stride;
+    int blockOffset; // Index of the component's first block in an MCU
+    std::vector<int> colIndex; // [maxH * blockSize]
+    std::vector<int> rowIndex; // [maxV * blockSize], multiplied by stride
+  };
+
+  // Everything the headers say about the image, plus derived MCU geometry
+  struct Frame {
+    int width = 0;
+    int height = 0;
+    std::vector<Component> components;
+    QuantTable quantTables[4];
+    HuffmanTable dcTables[4];
+    HuffmanTable acTables[4];
+    bool progressive = false; // SOF2
+    int restartInterval = 0;  // MCUs per restart interval, 0 for none
+
+    // The scan whose entropy-coded data starts at scanData
+    const uint8_t *scanData = nullptr;
+    size_t scanDataLen = 0;
+    std::vector<int> scanComponents; // Indices into components
+    int spectralStart = 0;           // Ss, Se: zigzag band of the scan
+    int spectralEnd = 63;
+    int approxHigh = 0; // Ah, Al: successive approximation bit positions
+    int approxLow = 0;
+
+    // Filled in by prepareFrame()
+    int maxH = 0;
+    int maxV = 0;
+    int mcuWidth = 0;
+    int mcuHeight = 0;
+    int mcusX = 0;
+    int mcusY = 0;
+    int blocksPerMcu = 0;
+    int blockSize = 8; // Output samples per block side, 8 / scale
+    // Output window within the scaled image: outWidth x outHeight pixels
+    // from (cropX, cropY), covered by MCU columns [firstMcuX, endMcuX) and
+    // rows [firstMcuY, endMcuY)
+    int cropX = 0;
+    int cropY = 0;
+    int outWidth = 0;
+    int outHeight = 0;
+    int firstMcuX = 0;
+    int endMcuX = 0;
+    int firstMcuY = 0;
+    int endMcuY = 0;
+    JpegDct::InverseTable inverseTables[4];
+
+    // A single interleaved scan decodes straight to pixels. Anything else
+    // needs the whole image's coefficients; a lone component scan holds one
+    // block per MCU, so that includes subsampled grayscale.
+    bool multiScan() const {
+      return progressive || scanComponents.size() != components.size() ||
+             (components.size() == 1 && blocksPerMcu > 1);
+    }
+
+    bool inWindow(size_t mcu) const {
+      size_t x = mcu % mcusX;
+      size_t y = mcu / mcusX;
+      return x >= (size_t)firstMcuX && x < (size_t)endMcuX &&
+             y >= (size_t)firstMcuY && y < (size_t)endMcuY;
+    }
   };
 
   // JPEG Markers
   static const uint16_t SOI = 0xFFD8;
   static const uint16_t SOF0 = 0xFFC0;
+  static const uint16_t SOF2 = 0xFFC2;
   static const uint16_t DHT = 0xFFC4;
   static const uint16_t DQT = 0xFFDB;
   static const uint16_t SOS = 0xFFDA;
@@ -48,22 +157,93 @@ private:
   // ZigZag order
   static const uint8_t ZIGZAG[64];
 
-  static void parseSegments(const std::vector<uint8_t> &data,
-                            std::vector<QuantTable> &quantTables,
-                            std::vector<HuffmanTable> &dcTables,
-                            std::vector<HuffmanTable> &acTables,
-                            std::vector<Component> &components, int &width,
-                            int &height, const uint8_t *&scanData,
-                            size_t &scanDataLen);
+  // Parses marker segments from `pos` through the next SOS header, leaving
+  // frame.scanData null if EOI or the end of the data comes first
+  static void parseSegments(const uint8_t *data, size_t size, size_t pos,
+                            Frame &frame);
+  // Validates the frame and derives the MCU layout, IDCT tables and output
+  // window for the requested scale and crop
+  static void prepareFrame(Frame &frame, const Options &options);
 
   static void buildHuffmanTable(HuffmanTable &table);
-  static int decodeHuffman(const uint8_t *data, size_t &bitOffset,
-                           const HuffmanTable &table);
+  // Next symbol from the stream, or -1 for an invalid code
+  static int decodeHuffman(JpegBitReader &reader, const HuffmanTable &table);
 
-  // IDCT and Color Conversion
-  static void idct(float *block);
-  static void ycbcrToRgb(float y, float cb, float cr, uint8_t &r, uint8_t &g,
-                         uint8_t &b);
+  // Offset within the scan data of each restart interval's first byte. With
+  // `scanLength` set, also finds where the scan's entropy-coded data ends.
+  static std::vector<size_t> findRestartIntervals(const Frame &frame,
+                                                  size_t *scanLength);
+  // Decodes MCUs [firstMcu, endMcu) from entropy-coded data that starts at
+  // `data` with fresh DC predictors, writing the pixels of those in the
+  // output window into `img`
+  static void decodeMcus(const Frame &frame, const Options &options,
+                         const uint8_t *data, size_t size, size_t firstMcu,
+                         size_t endMcu, Image &img);
+  // Entropy decodes the rest of the MCU row holding `mcu`, which advances to
+  // the start of the next row, into `rowCoefs` and `rowLast` (indexed by
+  // MCU column). Crossing a restart boundary moves `reader` to the next
+  // interval and resets the predictors.
+  static void decodeMcuRow(const Frame &frame,
+                           const std::vector<size_t> &intervalStarts,
+                           JpegBitReader &reader, int *prevDC, size_t &mcu,
+                           int16_t *rowCoefs, uint8_t *rowLast);
+  // Entropy decodes on the calling thread and hands MCU rows to the other
+  // pool threads for reconstruction
+  static void decodePipelined(const Frame &frame, const Options &options,
+                              const std::vector<size_t> &intervalStarts,
+                              ThreadPool &pool, Image &img);
+
+  // Progressive and non-interleaved images: every scan is decoded into a
+  // coefficient buffer (blocksPerMcu blocks per MCU, MCUs in raster order)
+  // for the MCU rows up to the end of the window, whose MCUs are then
+  // reconstructed by row on the pool
+  static void decodeMultiScan(const uint8_t *data, size_t size, Frame &frame,
+                              const Options &options, ThreadPool &pool,
+                              Image &img);
+  // Decodes the scan at frame.scanData and every one after it into a
+  // coefficient buffer of MCU rows [0, endMcuY)
+  static std::vector<int16_t> decodeScans(const uint8_t *data, size_t size,
+                                          Frame &frame);
+  // Reconstructs the window's MCUs in one row of the coefficient buffer
+  static void reconstructRow(const Frame &frame, const Options &options,
+                             const int16_t *coefs, int mcuY, int imgY,
+                             std::vector<std::vector<uint8_t>> &planes,
+                             Image &img);
+  // Decodes the scan at frame.scanData into `coefs` and returns the length
+  // of its entropy-coded data
+  static size_t decodeScan(const Frame &frame, int16_t *coefs);
+
+  // The two halves of decoding an MCU. decodeMcu() fills blocksPerMcu
+  // coefficient blocks and their last zigzag indices in scan order;
+  // reconstructMcu() turns them into pixels, using `planes` (one buffer
+  // per component) as scratch. `img` holds the output rows from `imgY` on.
+  static void decodeMcu(const Frame &frame, JpegBitReader &reader,
+                        int *prevDC, int16_t *coefs, uint8_t *lastIndex);
+  static void reconstructMcu(const Frame &frame, const Options &options,
+                             const int16_t *coefs, const uint8_t *lastIndex,
+                             std::vector<std::vector<uint8_t>> &planes,
+                             int mcuX, int mcuY, int imgY, Image &img);
+  // Decodes one block into natural-order coefficients (zeroed first) and
+  // returns the zigzag index of the last nonzero one. Adds the number of
+  // Huffman symbols read to `symbols`.
+  static int decodeBlock(JpegBitReader &reader, const HuffmanTable &dcTable,
+                         const HuffmanTable &acTable, int &prevDC,
+                         int16_t *block, uint64_t &symbols);
+
+  // Progressive block passes (T.81 G.1.2); `eobrun` counts the remaining
+  // blocks of an end-of-band run, which carries across blocks
+  static void decodeDcFirst(JpegBitReader &reader, const HuffmanTable &table,
+                            int al, int &prevDC, int16_t *block);
+  static void decodeDcRefine(JpegBitReader &reader, int al, int16_t *block);
+  static void decodeAcFirst(JpegBitReader &reader, const HuffmanTable &table,
+                            int ss, int se, int al, int &eobrun,
+                            int16_t *block);
+  static void decodeAcRefine(JpegBitReader &reader, const HuffmanTable &table,
+                             int ss, int se, int al, int &eobrun,
+                             int16_t *block);
+
+  // Color conversion in 16-bit fixed point
+  static void ycbcrToRgb(int y, int cb, int cr, uint8_t *rgb);
 
   // Helper to clamp values
   template <typename T> static T clamp(T val, T min, T max) {
@@ -73,6 +253,32 @@ private:
       return max;
     return val;
   }
+
+public:
+  // Row-by-row decoder with bounded memory: the file is mapped, and pixels
+  // are reconstructed one MCU row at a time into a strip and handed out in
+  // order. Progressive and other multi-scan files still buffer the
+  // coefficients of the whole image. options.threads is ignored.
+  class Stream {
+  public:
+    using RowCallback = std::function<void(int y, const uint8_t *row)>;
+
+    // Opens the file and parses the headers up to the first scan
+    Stream(const std::string &filepath, const Options &options);
+
+    int width() const { return frame_.outWidth; }
+    int height() const { return frame_.outHeight; }
+    int channels() const { return 3; }
+
+    // Decodes all output rows in order. `row` holds width * 3 bytes and is
+    // only valid for the duration of the call.
+    void decodeRows(const RowCallback &onRow);
+
+  private:
+    MappedFile file_;
+    Options options_;
+    Frame frame_;
+  };
 };
 
 #endif // JPEG_DECODER_HPP
@@ -1,8 +1,10 @@
 #include "jpeg_encoder.hpp"
+#include "utils/stats.hpp"
+#include "utils/thread_pool.hpp"
 #include <algorithm>
 #include <cmath>
-#include <fstream>
 #include <iostream>
+#include <stdexcept>
 
 // Standard JPEG Quantization Tables (K.1 and K.2)
 const uint8_t JpegEncoder::QUANT_LUMA[64] = {
@@ -25,12 +27,6 @@ const uint8_t JpegEncoder::ZIGZAG[64] = {
     35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
     58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63};
 
-JpegEncoder::HuffmanTable JpegEncoder::DC_LUMA;
-JpegEncoder::HuffmanTable JpegEncoder::AC_LUMA;
-JpegEncoder::HuffmanTable JpegEncoder::DC_CHROMA;
-JpegEncoder::HuffmanTable JpegEncoder::AC_CHROMA;
-bool JpegEncoder::tablesInitialized = false;
-
 // Standard Huffman Tables (Annex K.3)
 // DC Luminance
 static const uint8_t STD_DC_LUMA_BITS[16] = {0, 1, 5, 1, 1, 1, 1, 1,
@@ -82,133 +78,459 @@ static const uint8_t STD_AC_CHROMA_VAL[162] = {
     0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4,
     0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa};
 
-void JpegEncoder::initTables() {
-  if (tablesInitialized)
-    return;
-
-  auto buildTable = [](HuffmanTable &table, const uint8_t *bits,
-                       const uint8_t *val, int valCount) {
-    table.bits.assign(bits, bits + 16);
-    table.huffval.assign(val, val + valCount);
-
-    // Generate codes
-    table.codes.assign(256, 0);
-    table.codeLengths.assign(256, 0);
-
-    uint32_t code = 0;
-    int k = 0;
-    for (int i = 0; i < 16; ++i) {
-      for (int j = 0; j < table.bits[i]; ++j) {
-        uint8_t symbol = table.huffval[k++];
-        table.codes[symbol] = code;
-        table.codeLengths[symbol] = i + 1;
-        code++;
+const JpegEncoder::StandardTables &JpegEncoder::standardTables() {
+  // Function-local static: initialized exactly once, even when several
+  // encoders start at the same time
+  static const StandardTables tables = [] {
+    StandardTables t;
+    buildTable(t.dcLuma, STD_DC_LUMA_BITS, STD_DC_LUMA_VAL, 12);
+    buildTable(t.acLuma, STD_AC_LUMA_BITS, STD_AC_LUMA_VAL, 162);
+    buildTable(t.dcChroma, STD_DC_CHROMA_BITS, STD_DC_CHROMA_VAL, 12);
+    buildTable(t.acChroma, STD_AC_CHROMA_BITS, STD_AC_CHROMA_VAL, 162);
+    return t;
+  }();
+  return tables;
+}
+
+void JpegEncoder::buildTable(HuffmanTable &table, const uint8_t *bits,
+                             const uint8_t *val, int valCount) {
+  table.bits.assign(bits, bits + 16);
+  table.huffval.assign(val, val + valCount);
+
+  // Generate codes
+  table.codes.assign(256, 0);
+  table.codeLengths.assign(256, 0);
+
+  uint32_t code = 0;
+  int k = 0;
+  for (int i = 0; i < 16; ++i) {
+    for (int j = 0; j < table.bits[i]; ++j) {
+      uint8_t symbol = table.huffval[k++];
+      table.codes[symbol] = code;
+      table.codeLengths[symbol] = i + 1;
+      code++;
+    }
+    code <<= 1;
+  }
+}
+
+void JpegEncoder::buildOptimalTable(const uint32_t *freqs,
+                                    HuffmanTable &table) {
+  // Symbol 256 is a placeholder with the lowest count; it takes the
+  // all-ones code of the longest length, which JPEG reserves
+  uint64_t freq[257];
+  int codeSize[257];
+  int others[257];
+  for (int i = 0; i < 256; ++i)
+    freq[i] = freqs[i];
+  freq[256] = 1;
+  std::fill(codeSize, codeSize + 257, 0);
+  std::fill(others, others + 257, -1);
+
+  // Huffman's procedure (Figure K.1): repeatedly merge the two least
+  // frequent trees, lengthening the codes of every symbol in both
+  for (;;) {
+    int c1 = -1, c2 = -1;
+    uint64_t v1 = UINT64_MAX, v2 = UINT64_MAX;
+    for (int i = 0; i <= 256; ++i) {
+      if (freq[i] == 0)
+        continue;
+      // Ties go to the larger symbol, as in the reference procedure
+      if (freq[i] <= v1) {
+        v2 = v1;
+        c2 = c1;
+        v1 = freq[i];
+        c1 = i;
+      } else if (freq[i] <= v2) {
+        v2 = freq[i];
+        c2 = i;
       }
-      code <<= 1;
     }
-  };
+    if (c2 < 0)
+      break;
+
+    freq[c1] += freq[c2];
+    freq[c2] = 0;
+    ++codeSize[c1];
+    while (others[c1] >= 0) {
+      c1 = others[c1];
+      ++codeSize[c1];
+    }
+    others[c1] = c2;
+    ++codeSize[c2];
+    while (others[c2] >= 0) {
+      c2 = others[c2];
+      ++codeSize[c2];
+    }
+  }
 
-  buildTable(DC_LUMA, STD_DC_LUMA_BITS, STD_DC_LUMA_VAL, 12);
-  buildTable(AC_LUMA, STD_AC_LUMA_BITS, STD_AC_LUMA_VAL, 162);
-  buildTable(DC_CHROMA, STD_DC_CHROMA_BITS, STD_DC_CHROMA_VAL, 12);
-  buildTable(AC_CHROMA, STD_AC_CHROMA_BITS, STD_AC_CHROMA_VAL, 162);
+  // Count codes per length, then limit them to 16 bits (Figure K.3):
+  // move pairs of codes up from each overlong length
+  int bits[33] = {0};
+  for (int i = 0; i <= 256; ++i) {
+    if (codeSize[i] > 32)
+      throw std::runtime_error("Huffman code length overflow");
+    if (codeSize[i])
+      ++bits[codeSize[i]];
+  }
+  for (int i = 32; i > 16; --i) {
+    while (bits[i] > 0) {
+      int j = i - 2;
+      while (bits[j] == 0)
+        --j;
+      bits[i] -= 2;
+      bits[i - 1]++;
+      bits[j + 1] += 2;
+      bits[j]--;
+    }
+  }
+  // Drop the placeholder from the longest length
+  int longest = 16;
+  while (bits[longest] == 0)
+    --longest;
+  bits[longest]--;
+
+  uint8_t dhtBits[16];
+  for (int i = 0; i < 16; ++i)
+    dhtBits[i] = static_cast<uint8_t>(bits[i + 1]);
+
+  // Symbols sorted by their original code length (Figure K.4)
+  uint8_t huffval[256];
+  int count = 0;
+  for (int len = 1; len <= 32; ++len) {
+    for (int i = 0; i < 256; ++i) {
+      if (codeSize[i] == len)
+        huffval[count++] = static_cast<uint8_t>(i);
+    }
+  }
 
-  tablesInitialized = true;
+  buildTable(table, dhtBits, huffval, count);
 }
 
-void JpegEncoder::encode(const Image &img, const std::string &filepath,
-                         int quality) {
-  initTables();
-  BitWriter writer;
+void JpegEncoder::Quantizer::init(const uint8_t *baseTable, int scale) {
+  for (int i = 0; i < 64; ++i) {
+    long temp = (long)baseTable[i] * scale + 50;
+    temp /= 100;
+    if (temp < 1)
+      temp = 1;
+    if (temp > 255)
+      temp = 255;
+    table[i] = (uint8_t)temp;
+
+    // The AAN transform leaves coefficient (u, v) scaled by
+    // 8 * aanScale(u) * aanScale(v); divide that out along with q
+    double divisor = table[i] * 8.0 * JpegDct::aanScale(i % 8) *
+                     JpegDct::aanScale(i / 8);
+    floatScale[i] = static_cast<float>(1.0 / divisor);
+    intScale[i] = static_cast<uint32_t>(
+        std::lround((1 << INT_SHIFT) / (divisor * (1 << JpegDct::PASS1_BITS))));
+  }
+}
 
-  // Quality scaling
+int JpegEncoder::qualityScale(int quality) {
   if (quality < 1)
     quality = 1;
   if (quality > 100)
     quality = 100;
+  return quality < 50 ? 5000 / quality : 200 - 2 * quality;
+}
 
-  int scale;
-  if (quality < 50) {
-    scale = 5000 / quality;
-  } else {
-    scale = 200 - 2 * quality;
-  }
+void JpegEncoder::encode(const Image &img, const std::string &filepath,
+                         int quality) {
+  Options options;
+  options.quality = quality;
+  encode(img, filepath, options);
+}
 
-  auto generateQuantTable = [&](const uint8_t *baseTable, uint8_t *outTable) {
-    for (int i = 0; i < 64; ++i) {
-      long temp = (long)baseTable[i] * scale + 50;
-      temp /= 100;
-      if (temp < 1)
-        temp = 1;
-      if (temp > 255)
-        temp = 255;
-      outTable[i] = (uint8_t)temp;
+void JpegEncoder::encode(const Image &img, const std::string &filepath,
+                         const Options &options) {
+  FileByteWriter file(filepath);
+  encode(img, file, options);
+  file.close();
+}
+
+void JpegEncoder::encode(const Image &img, ByteWriter &out) {
+  encode(img, out, Options());
+}
+
+void JpegEncoder::encode(const Image &img, ByteWriter &out,
+                         const Options &options) {
+  BitWriter writer;
+
+  int scale = qualityScale(options.quality);
+  Quantizer lumaQuant;
+  Quantizer chromaQuant;
+  lumaQuant.init(QUANT_LUMA, scale);
+  chromaQuant.init(QUANT_CHROMA, scale);
+
+  // Luma blocks per MCU; the chroma components always have one
+  int hSamp = options.subsampling == SUBSAMPLING_444 ? 1 : 2;
+  int vSamp = options.subsampling == SUBSAMPLING_420 ? 2 : 1;
+
+  const StandardTables &standard = standardTables();
+  const HuffmanTable *dcTables[2] = {&standard.dcLuma, &standard.dcChroma};
+  const HuffmanTable *acTables[2] = {&standard.acLuma, &standard.acChroma};
+
+  // Interleaved: every luma block of the MCU, then Cb, then Cr
+  int lumaBlocks = hSamp * vSamp;
+  int blocksPerMcu = lumaBlocks + 2;
+  auto componentOf = [&](int block) {
+    return block < lumaBlocks ? 0 : block - lumaBlocks + 1;
+  };
+
+  int mcuWidth = hSamp * 8;
+  int mcuHeight = vSamp * 8;
+  size_t mcusX = (img.width + mcuWidth - 1) / mcuWidth;
+  size_t mcusY = (img.height + mcuHeight - 1) / mcuHeight;
+  size_t mcuCount = mcusX * mcusY;
+
+  // Restart segments are coded independently (DC prediction starts over
+  // in each), which is what lets them be encoded in parallel. Without an
+  // explicit interval, multi-threaded encoding uses one per MCU row.
+  ThreadPool pool(ThreadPool::resolveThreads(options.threads));
+  if (options.restartInterval < 0 || options.restartInterval > 65535)
+    throw std::runtime_error("Invalid restart interval");
+  size_t restartInterval = options.restartInterval;
+  if (restartInterval == 0 && pool.size() > 1 && mcusY > 1)
+    restartInterval = mcusX;
+  size_t segmentMcus = restartInterval > 0 ? restartInterval : mcuCount;
+  size_t segmentCount = (mcuCount + segmentMcus - 1) / segmentMcus;
+
+  // Color conversion, DCT and quantization of one MCU
+  auto transform = [&](size_t mcu, int16_t *coefs) {
+    int x = static_cast<int>(mcu % mcusX) * mcuWidth;
+    int y = static_cast<int>(mcu / mcusX) * mcuHeight;
+    transformMcu(img, x, y, hSamp, vSamp, lumaQuant, chromaQuant, options.dct,
+                 coefs);
+  };
+
+  // Entropy-coded bytes of each segment, padded to a byte boundary
+  std::vector<std::vector<uint8_t>> segments(segmentCount);
+  auto encodeSegment = [&](size_t s, const int16_t *buffered) {
+    BitWriter out;
+    out.enableByteStuffing(true);
+    int prevDC[3] = {0, 0, 0};
+    int16_t coefs[6 * 64];
+    size_t end = std::min(mcuCount, (s + 1) * segmentMcus);
+    for (size_t mcu = s * segmentMcus; mcu < end; ++mcu) {
+      if (buffered) {
+        encodeMcu(out, buffered + mcu * blocksPerMcu * 64, lumaBlocks, prevDC,
+                  dcTables, acTables);
+      } else {
+        transform(mcu, coefs);
+        encodeMcu(out, coefs, lumaBlocks, prevDC, dcTables, acTables);
+      }
     }
+    segments[s] = out.getData();
   };
 
-  uint8_t scaledLuma[64];
-  uint8_t scaledChroma[64];
+  HuffmanTable optimized[4];
+  if (!options.optimizeHuffman) {
+    pool.parallelFor(segmentCount,
+                     [&](size_t s) { encodeSegment(s, nullptr); });
+  } else {
+    // The tables depend on every block, so the quantized coefficients are
+    // kept and symbols counted per segment, then coded in a second pass
+    std::vector<int16_t> buffered(mcuCount * blocksPerMcu * 64);
+    std::vector<uint32_t> freqs(segmentCount * 4 * 256, 0);
+    pool.parallelFor(segmentCount, [&](size_t s) {
+      uint32_t *dcFreqs = &freqs[s * 4 * 256];
+      uint32_t *acFreqs = dcFreqs + 2 * 256;
+      int prevDC[3] = {0, 0, 0};
+      size_t end = std::min(mcuCount, (s + 1) * segmentMcus);
+      for (size_t mcu = s * segmentMcus; mcu < end; ++mcu) {
+        int16_t *coefs = &buffered[mcu * blocksPerMcu * 64];
+        transform(mcu, coefs);
+        Stats::ScopedTimer timer(Stats::ENTROPY_ENCODE);
+        for (int b = 0; b < blocksPerMcu; ++b) {
+          int comp = componentOf(b);
+          int table = comp == 0 ? 0 : 1;
+          countSymbols(coefs + b * 64, prevDC[comp], dcFreqs + table * 256,
+                       acFreqs + table * 256);
+        }
+      }
+    });
+
+    // Per table: DC luma, DC chroma, AC luma, AC chroma
+    uint32_t totals[4][256] = {};
+    for (size_t s = 0; s < segmentCount; ++s) {
+      for (int t = 0; t < 4; ++t) {
+        for (int i = 0; i < 256; ++i)
+          totals[t][i] += freqs[(s * 4 + t) * 256 + i];
+      }
+    }
 
-  generateQuantTable(QUANT_LUMA, scaledLuma);
-  generateQuantTable(QUANT_CHROMA, scaledChroma);
+    for (int t = 0; t < 4; ++t)
+      buildOptimalTable(totals[t], optimized[t]);
+    dcTables[0] = &optimized[0];
+    dcTables[1] = &optimized[1];
+    acTables[0] = &optimized[2];
+    acTables[1] = &optimized[3];
 
-  writeHeaders(writer, img.width, img.height, scaledLuma, scaledChroma);
+    pool.parallelFor(segmentCount,
+                     [&](size_t s) { encodeSegment(s, buffered.data()); });
+  }
 
-  int prevDC_Y = 0;
-  int prevDC_Cb = 0;
-  int prevDC_Cr = 0;
+  writeHeaders(writer, img.width, img.height, hSamp, vSamp,
+               static_cast<int>(restartInterval), lumaQuant.table,
+               chromaQuant.table, dcTables, acTables);
+  for (size_t s = 0; s < segmentCount; ++s) {
+    writer.writeBytes(segments[s].data(), segments[s].size());
+    if (s + 1 < segmentCount)
+      writer.writeMarker(0xD0 + (s & 7)); // RSTn
+  }
 
-  // Process 8x8 blocks
-  // Pad width/height to multiple of 8
-  int paddedWidth = (img.width + 7) & ~7;
-  int paddedHeight = (img.height + 7) & ~7;
+  writeFooter(writer);
 
-  for (int y = 0; y < paddedHeight; y += 8) {
-    for (int x = 0; x < paddedWidth; x += 8) {
+  std::vector<uint8_t> data = writer.getData();
+  out.write(data.data(), data.size());
+}
 
-      // Extract 8x8 block for Y, Cb, Cr
-      float blockY[64], blockCb[64], blockCr[64];
+// ============================================================================
+// Streaming encoder
+// ============================================================================
+
+JpegEncoder::Stream::Stream(ByteWriter &out, int width, int height,
+                            int channels, const Options &options)
+    : out_(out), options_(options), height_(height) {
+  if (options.optimizeHuffman)
+    throw std::runtime_error("Optimized Huffman tables need the whole image");
+  if (options.restartInterval < 0 || options.restartInterval > 65535)
+    throw std::runtime_error("Invalid restart interval");
+
+  int scale = qualityScale(options.quality);
+  lumaQuant_.init(QUANT_LUMA, scale);
+  chromaQuant_.init(QUANT_CHROMA, scale);
+  hSamp_ = options.subsampling == SUBSAMPLING_444 ? 1 : 2;
+  vSamp_ = options.subsampling == SUBSAMPLING_420 ? 2 : 1;
+  mcusX_ = (width + hSamp_ * 8 - 1) / (hSamp_ * 8);
+  filling_ = Image(width, vSamp_ * 8, channels);
+  pending_ = Image(width, vSamp_ * 8, channels);
+
+  const StandardTables &standard = standardTables();
+  const HuffmanTable *dcTables[2] = {&standard.dcLuma, &standard.dcChroma};
+  const HuffmanTable *acTables[2] = {&standard.acLuma, &standard.acChroma};
+  writeHeaders(writer_, width, height, hSamp_, vSamp_,
+               options.restartInterval, lumaQuant_.table, chromaQuant_.table,
+               dcTables, acTables);
+  writer_.takeBytes(bytes_);
+  out_.write(bytes_.data(), bytes_.size());
+  bytes_.clear();
+
+  worker_ = std::thread([this] { run(); });
+}
 
-      for (int by = 0; by < 8; ++by) {
-        for (int bx = 0; bx < 8; ++bx) {
-          int imgX = std::min(x + bx, img.width - 1);
-          int imgY = std::min(y + by, img.height - 1);
+JpegEncoder::Stream::~Stream() {
+  if (worker_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closing_ = true;
+    }
+    changed_.notify_all();
+    worker_.join();
+  }
+}
 
-          int pixelIdx = (imgY * img.width + imgX) * img.channels;
-          // uint8_t r = img.data[pixelIdx];
-          // uint8_t g = img.data[pixelIdx + 1];
-          // uint8_t b = img.data[pixelIdx + 2];
+void JpegEncoder::Stream::writeRow(const uint8_t *row) {
+  if (rowsWritten_ >= height_)
+    throw std::runtime_error("More scanlines than the image height");
+
+  int stripRows = vSamp_ * 8;
+  size_t stride = static_cast<size_t>(filling_.width) * filling_.channels;
+  std::copy(row, row + stride,
+            filling_.data.begin() + (rowsWritten_ % stripRows) * stride);
+  ++rowsWritten_;
+  if (rowsWritten_ % stripRows == 0 || rowsWritten_ == height_)
+    submitStrip();
+}
 
-          float Y, Cb, Cr;
-          rgbToYcbcr(&img.data[pixelIdx], &Y, &Cb, &Cr);
+void JpegEncoder::Stream::finish() {
+  if (rowsWritten_ != height_)
+    throw std::runtime_error("Not all scanlines were written");
 
-          blockY[by * 8 + bx] = Y;
-          blockCb[by * 8 + bx] = Cb;
-          blockCr[by * 8 + bx] = Cr;
-        }
-      }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closing_ = true;
+  }
+  changed_.notify_all();
+  worker_.join();
+  if (error_)
+    std::rethrow_exception(error_);
+
+  writeFooter(writer_);
+  writer_.takeBytes(bytes_);
+  out_.write(bytes_.data(), bytes_.size());
+}
+
+void JpegEncoder::Stream::submitStrip() {
+  // A short last strip; convertMcu() replicates its bottom row
+  int stripRows = vSamp_ * 8;
+  filling_.height = (rowsWritten_ - 1) % stripRows + 1;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  changed_.wait(lock, [this] { return !pendingReady_; });
+  if (error_)
+    std::rethrow_exception(error_);
+  std::swap(filling_, pending_);
+  pendingReady_ = true;
+  lock.unlock();
+  changed_.notify_all();
+}
+
+void JpegEncoder::Stream::run() {
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      changed_.wait(lock, [this] { return pendingReady_ || closing_; });
+      if (!pendingReady_)
+        return;
+    }
+
+    try {
+      encodeStrip();
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      error_ = std::current_exception();
+    }
 
-      // Process Y
-      processBlock(writer, blockY, scaledLuma, prevDC_Y, DC_LUMA, AC_LUMA);
-      // Process Cb
-      processBlock(writer, blockCb, scaledChroma, prevDC_Cb, DC_CHROMA,
-                   AC_CHROMA);
-      // Process Cr
-      processBlock(writer, blockCr, scaledChroma, prevDC_Cr, DC_CHROMA,
-                   AC_CHROMA);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pendingReady_ = false;
     }
+    changed_.notify_all();
+    if (error_)
+      return;
   }
+}
 
-  writeFooter(writer);
+void JpegEncoder::Stream::encodeStrip() {
+  const StandardTables &standard = standardTables();
+  const HuffmanTable *dcTables[2] = {&standard.dcLuma, &standard.dcChroma};
+  const HuffmanTable *acTables[2] = {&standard.acLuma, &standard.acChroma};
+  size_t interval = options_.restartInterval;
+  int16_t coefs[6 * 64];
+
+  for (size_t x = 0; x < mcusX_; ++x, ++mcu_) {
+    if (interval > 0 && mcu_ > 0 && mcu_ % interval == 0) {
+      writer_.writeMarker(0xD0 + ((mcu_ / interval - 1) & 7)); // RSTn
+      std::fill(prevDC_, prevDC_ + 3, 0);
+    }
+    transformMcu(pending_, static_cast<int>(x) * hSamp_ * 8, 0, hSamp_, vSamp_,
+                 lumaQuant_, chromaQuant_, options_.dct, coefs);
+    encodeMcu(writer_, coefs, hSamp_ * vSamp_, prevDC_, dcTables, acTables);
+  }
 
-  std::ofstream outFile(filepath, std::ios::binary);
-  std::vector<uint8_t> data = writer.getData();
-  outFile.write(reinterpret_cast<const char *>(data.data()), data.size());
+  writer_.takeBytes(bytes_);
+  out_.write(bytes_.data(), bytes_.size());
+  bytes_.clear();
 }
 
 void JpegEncoder::writeHeaders(BitWriter &writer, int width, int height,
+                               int hSamp, int vSamp, int restartInterval,
                                const uint8_t *lumaTable,
-                               const uint8_t *chromaTable) {
+                               const uint8_t *chromaTable,
+                               const HuffmanTable *const *dcTables,
+                               const HuffmanTable *const *acTables) {
   // SOI
   writer.writeMarker(0xD8);
 
@@ -247,9 +569,9 @@ void JpegEncoder::writeHeaders(BitWriter &writer, int width, int height,
   writer.writeBits(3, 8); // Components
 
   // Y
-  writer.writeBits(1, 8);    // ID
-  writer.writeBits(0x11, 8); // Sampling factors (1x1)
-  writer.writeBits(0, 8);    // Quant table ID
+  writer.writeBits(1, 8);                     // ID
+  writer.writeBits((hSamp << 4) | vSamp, 8); // Sampling factors
+  writer.writeBits(0, 8);                     // Quant table ID
 
   // Cb
   writer.writeBits(2, 8);    // ID
@@ -263,9 +585,12 @@ void JpegEncoder::writeHeaders(BitWriter &writer, int width, int height,
 
   // DHT (Define Huffman Tables)
   writer.writeMarker(0xC4);
-  // Calculate length: 2 + (1+16+12) + (1+16+162) + (1+16+12) + (1+16+162) = 2 +
-  // 29 + 179 + 29 + 179 = 418
-  writer.writeBits(418, 16);
+  int dhtLength = 2;
+  for (int t = 0; t < 2; ++t) {
+    dhtLength += 17 + static_cast<int>(dcTables[t]->huffval.size());
+    dhtLength += 17 + static_cast<int>(acTables[t]->huffval.size());
+  }
+  writer.writeBits(dhtLength, 16);
 
   auto writeDHT = [&](const HuffmanTable &table, int id, int ac) {
     writer.writeBits((ac << 4) | id, 8);
@@ -275,10 +600,17 @@ void JpegEncoder::writeHeaders(BitWriter &writer, int width, int height,
       writer.writeBits(val, 8);
   };
 
-  writeDHT(DC_LUMA, 0, 0);
-  writeDHT(AC_LUMA, 0, 1);
-  writeDHT(DC_CHROMA, 1, 0);
-  writeDHT(AC_CHROMA, 1, 1);
+  writeDHT(*dcTables[0], 0, 0);
+  writeDHT(*acTables[0], 0, 1);
+  writeDHT(*dcTables[1], 1, 0);
+  writeDHT(*acTables[1], 1, 1);
+
+  // DRI (Define Restart Interval)
+  if (restartInterval > 0) {
+    writer.writeMarker(0xDD);
+    writer.writeBits(4, 16); // Length
+    writer.writeBits(restartInterval, 16);
+  }
 
   // SOS (Start of Scan)
   writer.writeMarker(0xDA);
@@ -306,46 +638,46 @@ void JpegEncoder::writeFooter(BitWriter &writer) {
   writer.writeMarker(0xD9); // EOI
 }
 
-void JpegEncoder::processBlock(BitWriter &writer, const float *blockData,
-                               const uint8_t *quantTable, int &prevDC,
-                               const HuffmanTable &dcTable,
-                               const HuffmanTable &acTable) {
-  float dctBlock[64];
-  std::copy(blockData, blockData + 64, dctBlock);
-
-  fdct(dctBlock);
-  quantize(dctBlock, quantTable);
+// Number of bits needed for |v|: the JPEG magnitude category
+static inline int magnitudeCategory(int v) {
+  unsigned m = static_cast<unsigned>(v < 0 ? -v : v);
+  int size = 0;
+  while (m > 0) {
+    m >>= 1;
+    size++;
+  }
+  return size;
+}
 
-  float zigzagBlock[64];
-  zigzag(dctBlock, zigzagBlock);
+void JpegEncoder::countSymbols(const int16_t *coefs, int &prevDC,
+                               uint32_t *dcFreqs, uint32_t *acFreqs) {
+  dcFreqs[magnitudeCategory(coefs[0] - prevDC)]++;
+  prevDC = coefs[0];
 
-  encodeBlock(writer, zigzagBlock, prevDC, dcTable, acTable);
+  int rle = 0;
+  for (int i = 1; i < 64; ++i) {
+    if (coefs[i] == 0) {
+      rle++;
+      continue;
+    }
+    for (; rle > 15; rle -= 16)
+      acFreqs[0xF0]++; // ZRL
+    acFreqs[(rle << 4) | magnitudeCategory(coefs[i])]++;
+    rle = 0;
+  }
+  if (rle > 0)
+    acFreqs[0x00]++; // EOB
 }
 
-void JpegEncoder::encodeBlock(BitWriter &writer, const float *quantizedBlock,
+void JpegEncoder::encodeBlock(BitWriter &writer, const int16_t *coefs,
                               int &prevDC, const HuffmanTable &dcTable,
                               const HuffmanTable &acTable) {
   // DC Coefficient
-  int dcVal = static_cast<int>(quantizedBlock[0]);
+  int dcVal = coefs[0];
   int diff = dcVal - prevDC;
   prevDC = dcVal;
 
-  int size = 0;
-  int temp = diff;
-  if (temp < 0) {
-    temp = -temp;
-    size = 0;
-    while (temp > 0) {
-      temp >>= 1;
-      size++;
-    }
-  } else {
-    size = 0;
-    while (temp > 0) {
-      temp >>= 1;
-      size++;
-    }
-  }
+  int size = magnitudeCategory(diff);
 
   // Write DC code
   uint32_t code = dcTable.codes[size];
@@ -367,7 +699,7 @@ void JpegEncoder::encodeBlock(BitWriter &writer, const float *quantizedBlock,
   // AC Coefficients
   int rle = 0;
   for (int i = 1; i < 64; ++i) {
-    int val = static_cast<int>(quantizedBlock[i]);
+    int val = coefs[i];
     if (val == 0) {
       rle++;
     } else {
@@ -380,12 +712,7 @@ void JpegEncoder::encodeBlock(BitWriter &writer, const float *quantizedBlock,
         rle -= 16;
       }
 
-      int acSize = 0;
-      int acTemp = std::abs(val);
-      while (acTemp > 0) {
-        acTemp >>= 1;
-        acSize++;
-      }
+      int acSize = magnitudeCategory(val);
 
       int symbol = (rle << 4) | acSize;
       uint32_t acCode = acTable.codes[symbol];
@@ -409,60 +736,113 @@ void JpegEncoder::encodeBlock(BitWriter &writer, const float *quantizedBlock,
   }
 }
 
-void JpegEncoder::rgbToYcbcr(const uint8_t *rgb, float *y, float *cb,
-                             float *cr) {
-  float r = rgb[0];
-  float g = rgb[1];
-  float b = rgb[2];
-
-  // Standard JPEG conversion
-  *y = 0.299f * r + 0.587f * g + 0.114f * b;
-  *cb = -0.1687f * r - 0.3313f * g + 0.5f * b + 128.0f;
-  *cr = 0.5f * r - 0.4187f * g - 0.0813f * b + 128.0f;
-
-  // Level shift Y to [-128, 127] for DCT
-  *y -= 128.0f;
-  *cb -= 128.0f;
-  *cr -= 128.0f;
+void JpegEncoder::encodeMcu(BitWriter &writer, const int16_t *coefs,
+                            int lumaBlocks, int *prevDC,
+                            const HuffmanTable *const *dcTables,
+                            const HuffmanTable *const *acTables) {
+  Stats::ScopedTimer timer(Stats::ENTROPY_ENCODE);
+  Stats::add(Stats::BLOCKS, lumaBlocks + 2);
+  for (int b = 0; b < lumaBlocks + 2; ++b) {
+    int comp = b < lumaBlocks ? 0 : b - lumaBlocks + 1;
+    int table = comp == 0 ? 0 : 1;
+    encodeBlock(writer, coefs + b * 64, prevDC[comp], *dcTables[table],
+                *acTables[table]);
+  }
 }
 
-void JpegEncoder::fdct(float *block) {
-  float temp[64];
-  const float PI = 3.14159265358979323846f;
-
-  for (int u = 0; u < 8; ++u) {
-    for (int v = 0; v < 8; ++v) {
-      float sum = 0.0f;
-      float cu = (u == 0) ? 0.70710678118f : 1.0f; // 1/sqrt(2)
-      float cv = (v == 0) ? 0.70710678118f : 1.0f;
+void JpegEncoder::rgbToYcbcr(const uint8_t *rgb, int16_t &y, int16_t &cb,
+                             int16_t &cr) {
+  // Standard JPEG conversion in 16-bit fixed point, rounded to 8 bits
+  int32_t r = rgb[0];
+  int32_t g = rgb[1];
+  int32_t b = rgb[2];
+  const int32_t HALF = 1 << 15;
+  int32_t Y = (19595 * r + 38470 * g + 7471 * b + HALF) >> 16;
+  int32_t Cb = (-11059 * r - 21709 * g + 32768 * b + HALF - 1) >> 16;
+  int32_t Cr = (32768 * r - 27439 * g - 5329 * b + HALF - 1) >> 16;
+
+  // Level shift Y to [-128, 127] for DCT (Cb/Cr are already centered)
+  y = static_cast<int16_t>(Y - 128);
+  cb = static_cast<int16_t>(Cb);
+  cr = static_cast<int16_t>(Cr);
+}
 
-      for (int x = 0; x < 8; ++x) {
-        for (int y = 0; y < 8; ++y) {
-          sum += block[y * 8 + x] * std::cos((2 * x + 1) * u * PI / 16.0f) *
-                 std::cos((2 * y + 1) * v * PI / 16.0f);
-        }
-      }
-      temp[v * 8 + u] = 0.25f * cu * cv * sum;
+void JpegEncoder::convertMcu(const Image &img, int x, int y, int hSamp,
+                             int vSamp, int16_t (*lumaBlocks)[64],
+                             int16_t *cbBlock, int16_t *crBlock) {
+  // Chroma sums over hSamp x vSamp pixels, averaged at the end
+  int32_t cbSum[64] = {0};
+  int32_t crSum[64] = {0};
+
+  for (int my = 0; my < vSamp * 8; ++my) {
+    int imgY = std::min(y + my, img.height - 1);
+    const uint8_t *row = &img.data[(size_t)imgY * img.width * img.channels];
+    int lumaBlock = (my / 8) * hSamp;
+    int lumaRow = (my % 8) * 8;
+    int chromaRow = (my / vSamp) * 8;
+
+    for (int mx = 0; mx < hSamp * 8; ++mx) {
+      int imgX = std::min(x + mx, img.width - 1);
+      int16_t Y, Cb, Cr;
+      rgbToYcbcr(row + (size_t)imgX * img.channels, Y, Cb, Cr);
+      lumaBlocks[lumaBlock + mx / 8][lumaRow + mx % 8] = Y;
+      cbSum[chromaRow + mx / hSamp] += Cb;
+      crSum[chromaRow + mx / hSamp] += Cr;
     }
   }
 
-  // Copy back
+  // Box filter: hSamp * vSamp is 1, 2 or 4
+  int shift = (hSamp - 1) + (vSamp - 1);
+  int half = (1 << shift) >> 1;
   for (int i = 0; i < 64; ++i) {
-    block[i] = temp[i];
+    cbBlock[i] = static_cast<int16_t>((cbSum[i] + half) >> shift);
+    crBlock[i] = static_cast<int16_t>((crSum[i] + half) >> shift);
   }
 }
 
-void JpegEncoder::quantize(float *block, const uint8_t *quantTable) {
-  for (int i = 0; i < 64; ++i) {
-    // Round to nearest integer
-    block[i] = std::round(block[i] / quantTable[i]);
+void JpegEncoder::forwardDct(const int16_t *samples, const Quantizer &quant,
+                             JpegDct::Method dct, int16_t *coefs) {
+  if (dct == JpegDct::FLOAT) {
+    float block[64];
+    JpegDct::forwardFloat(samples, block);
+    for (int i = 0; i < 64; ++i) {
+      int k = ZIGZAG[i];
+      // Round to nearest; the offset keeps the truncation away from zero
+      float v = block[k] * quant.floatScale[k];
+      coefs[i] = static_cast<int16_t>(static_cast<int>(v + 16384.5f) - 16384);
+    }
+  } else {
+    int32_t block[64];
+    JpegDct::forwardInt(samples, block);
+    const uint64_t half = uint64_t(1) << (Quantizer::INT_SHIFT - 1);
+    for (int i = 0; i < 64; ++i) {
+      int k = ZIGZAG[i];
+      int32_t v = block[k];
+      uint64_t m = static_cast<uint64_t>(v < 0 ? -v : v);
+      int32_t q =
+          static_cast<int32_t>((m * quant.intScale[k] + half) >>
+                               Quantizer::INT_SHIFT);
+      coefs[i] = static_cast<int16_t>(v < 0 ? -q : q);
+    }
   }
 }
 
-void JpegEncoder::zigzag(const float *input, float *output) {
-  for (int i = 0; i < 64; ++i) {
-    output[i] = input[ZIGZAG[i]];
+void JpegEncoder::transformMcu(const Image &img, int x, int y, int hSamp,
+                               int vSamp, const Quantizer &lumaQuant,
+                               const Quantizer &chromaQuant,
+                               JpegDct::Method dct, int16_t *coefs) {
+  int lumaBlocks = hSamp * vSamp;
+  int16_t blocksY[4][64], blockCb[64], blockCr[64];
+  {
+    Stats::ScopedTimer timer(Stats::COLOR_CONVERT);
+    convertMcu(img, x, y, hSamp, vSamp, blocksY, blockCb, blockCr);
   }
+
+  Stats::ScopedTimer timer(Stats::DCT);
+  for (int i = 0; i < lumaBlocks; ++i)
+    forwardDct(blocksY[i], lumaQuant, dct, coefs + i * 64);
+  forwardDct(blockCb, chromaQuant, dct, coefs + lumaBlocks * 64);
+  forwardDct(blockCr, chromaQuant, dct, coefs + (lumaBlocks + 1) * 64);
 }
 
 // Removed writeMarker helper as it's now in BitWriter
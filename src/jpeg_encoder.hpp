@@ -2,17 +2,63 @@
 #define JPEG_ENCODER_HPP
 
 #include "image.hpp"
+#include "jpeg_dct.hpp"
 #include "utils/bit_writer.hpp"
+#include "utils/byte_writer.hpp"
+#include <condition_variable>
 #include <cstdint>
+#include <exception>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 class JpegEncoder {
 public:
+  // Chroma resolution relative to luma
+  enum Subsampling {
+    SUBSAMPLING_444, // Full resolution
+    SUBSAMPLING_422, // Half horizontally
+    SUBSAMPLING_420  // Half in both directions
+  };
+
+  struct Options {
+    int quality = 50;                      // 1-100
+    JpegDct::Method dct = JpegDct::INTEGER; // Forward DCT implementation
+    Subsampling subsampling = SUBSAMPLING_444;
+    // Fit the Huffman tables to the image instead of using the Annex K
+    // ones; costs a second pass over the buffered coefficients
+    bool optimizeHuffman = false;
+    // MCUs per restart interval, 0 for none (up to 65535)
+    int restartInterval = 0;
+    // Restart segments are encoded concurrently; 0 means one per core.
+    // Without a restart interval, more than one thread implies one
+    // interval per MCU row.
+    int threads = 1;
+  };
+
   static void encode(const Image &img, const std::string &filepath,
                      int quality = 50);
+  static void encode(const Image &img, const std::string &filepath,
+                     const Options &options);
+  // Encodes to memory or any other destination
+  static void encode(const Image &img, ByteWriter &out);
+  static void encode(const Image &img, ByteWriter &out,
+                     const Options &options);
 
 private:
+  // A quantization table with the AAN output scaling of the forward DCT
+  // folded into its divisors, so quantizing is one multiply per coefficient
+  struct Quantizer {
+    static const int INT_SHIFT = 20;
+
+    uint8_t table[64];     // Natural order, as written to DQT
+    float floatScale[64];  // 1 / divisor for JpegDct::forwardFloat output
+    uint32_t intScale[64]; // 2^INT_SHIFT / divisor for forwardInt output
+
+    void init(const uint8_t *baseTable, int scale);
+  };
+
   struct HuffmanTable {
     std::vector<uint8_t> bits;    // Count of codes of each length (1-16)
     std::vector<uint8_t> huffval; // Symbols sorted by code length
@@ -23,38 +69,122 @@ private:
     std::vector<uint8_t> codeLengths;
   };
 
-  static void initTables();
+  // The Annex K.3 tables, built on first use; safe to call from any thread
+  struct StandardTables {
+    HuffmanTable dcLuma;
+    HuffmanTable acLuma;
+    HuffmanTable dcChroma;
+    HuffmanTable acChroma;
+  };
+  static const StandardTables &standardTables();
+  // Quantization table scale factor (percent) for a 1-100 quality
+  static int qualityScale(int quality);
+  // Fills in a table from its DHT form and derives the code for each symbol
+  static void buildTable(HuffmanTable &table, const uint8_t *bits,
+                         const uint8_t *val, int valCount);
+  // Optimal table for the symbol counts `freqs` (256 entries), with code
+  // lengths limited to 16 bits as described in Annex K.2
+  static void buildOptimalTable(const uint32_t *freqs, HuffmanTable &table);
+  // Tables are indexed by 0 for luma, 1 for chroma
   static void writeHeaders(BitWriter &writer, int width, int height,
+                           int hSamp, int vSamp, int restartInterval,
                            const uint8_t *lumaTable,
-                           const uint8_t *chromaTable);
+                           const uint8_t *chromaTable,
+                           const HuffmanTable *const *dcTables,
+                           const HuffmanTable *const *acTables);
   static void writeFooter(BitWriter &writer);
-  static void processBlock(BitWriter &writer, const float *blockData,
-                           const uint8_t *quantTable, int &prevDC,
-                           const HuffmanTable &dcTable,
-                           const HuffmanTable &acTable);
 
   // Core math
-  static void rgbToYcbcr(const uint8_t *rgb, float *y, float *cb, float *cr);
-  static void fdct(float *block);
-  static void quantize(float *block, const uint8_t *quantTable);
-  static void zigzag(const float *input, float *output);
+  // Level-shifted (-128..127) Y, Cb and Cr of one pixel
+  static void rgbToYcbcr(const uint8_t *rgb, int16_t &y, int16_t &cb,
+                         int16_t &cr);
+  // Color converts the MCU at (x, y), hSamp x vSamp luma blocks in raster
+  // order, with chroma box-filtered down to one block each. Pixels past the
+  // image edge replicate the last row and column.
+  static void convertMcu(const Image &img, int x, int y, int hSamp, int vSamp,
+                         int16_t (*lumaBlocks)[64], int16_t *cbBlock,
+                         int16_t *crBlock);
+  // DCT and quantization; `coefs` receives the block in zigzag order
+  static void forwardDct(const int16_t *samples, const Quantizer &quant,
+                         JpegDct::Method dct, int16_t *coefs);
+  // convertMcu() followed by forwardDct() on each block: `coefs` receives
+  // the hSamp * vSamp luma blocks, then Cb, then Cr
+  static void transformMcu(const Image &img, int x, int y, int hSamp,
+                           int vSamp, const Quantizer &lumaQuant,
+                           const Quantizer &chromaQuant, JpegDct::Method dct,
+                           int16_t *coefs);
 
   // Entropy coding helpers
-  static void encodeBlock(BitWriter &writer, const float *quantizedBlock,
+  // Counts the symbols encodeBlock() would write for `coefs`
+  static void countSymbols(const int16_t *coefs, int &prevDC, uint32_t *dcFreqs,
+                           uint32_t *acFreqs);
+  static void encodeBlock(BitWriter &writer, const int16_t *coefs,
                           int &prevDC, const HuffmanTable &dcTable,
                           const HuffmanTable &acTable);
+  // Codes an MCU laid out as by transformMcu(); prevDC has one entry per
+  // component and the tables are indexed as for writeHeaders()
+  static void encodeMcu(BitWriter &writer, const int16_t *coefs,
+                        int lumaBlocks, int *prevDC,
+                        const HuffmanTable *const *dcTables,
+                        const HuffmanTable *const *acTables);
 
   // Standard Tables
   static const uint8_t ZIGZAG[64];
   static const uint8_t QUANT_LUMA[64];
   static const uint8_t QUANT_CHROMA[64];
 
-  // We will populate these in initTables or just have them as static members
-  static HuffmanTable DC_LUMA;
-  static HuffmanTable AC_LUMA;
-  static HuffmanTable DC_CHROMA;
-  static HuffmanTable AC_CHROMA;
-  static bool tablesInitialized;
+public:
+  // Incremental encoder with bounded memory. Scanlines are pushed in order,
+  // and each strip of one MCU row (8 or 16 scanlines) is handed to a worker
+  // thread that transforms, codes and writes it while the caller fills the
+  // next one. Only two strips of pixels are resident, whatever the image
+  // size. Optimized Huffman tables need every block before the first can
+  // be written, so options.optimizeHuffman is not supported here, and
+  // options.threads is ignored.
+  class Stream {
+  public:
+    // Writes the headers to `out`, which must outlive the stream
+    Stream(ByteWriter &out, int width, int height, int channels,
+           const Options &options);
+    ~Stream();
+
+    // Adds the next scanline of width * channels bytes
+    void writeRow(const uint8_t *row);
+    // Codes the last strip and writes the end of the JPEG; every scanline
+    // must have been written
+    void finish();
+
+  private:
+    void submitStrip();
+    void run(); // Worker thread
+    void encodeStrip();
+
+    ByteWriter &out_;
+    Options options_;
+    Quantizer lumaQuant_;
+    Quantizer chromaQuant_;
+    int hSamp_;
+    int vSamp_;
+    int height_;
+    int rowsWritten_ = 0;
+    size_t mcusX_;
+
+    // filling_ collects scanlines; pending_ is the strip the worker codes
+    Image filling_;
+    Image pending_;
+    bool pendingReady_ = false;
+    bool closing_ = false;
+    std::exception_ptr error_;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::thread worker_;
+
+    // Worker state
+    BitWriter writer_;
+    std::vector<uint8_t> bytes_;
+    int prevDC_[3] = {0, 0, 0};
+    size_t mcu_ = 0; // MCUs coded so far
+  };
 };
 
 #endif // JPEG_ENCODER_HPP
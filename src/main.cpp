@@ -3,11 +3,19 @@
 #include "jpeg_encoder.hpp"
 #include "png_decoder.hpp"
 #include "png_encoder.hpp"
+#include "utils/stats.hpp"
+#include "utils/thread_pool.hpp"
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstdio>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <set>
 #include <string>
+#include <vector>
 
 bool fileExists(const std::string &filename) {
   std::ifstream f(filename.c_str());
@@ -22,24 +30,313 @@ bool hasExtension(const std::string &filename, const std::string &ext) {
   return fileExt == ext;
 }
 
+// Settings for every stage, as given on the command line
+struct ConvertOptions {
+  JpegEncoder::Options jpeg;
+  JpegDecoder::Options jpegDecode;
+  PngEncoder::Options png;
+};
+
+enum Mode { PNG_TO_JPG, JPG_TO_PNG, UNKNOWN };
+
+Mode conversionMode(const std::string &inputPath,
+                    const std::string &outputPath) {
+  if (hasExtension(inputPath, ".png") &&
+      (hasExtension(outputPath, ".jpg") || hasExtension(outputPath, ".jpeg")))
+    return PNG_TO_JPG;
+  if ((hasExtension(inputPath, ".jpg") || hasExtension(inputPath, ".jpeg")) &&
+      hasExtension(outputPath, ".png"))
+    return JPG_TO_PNG;
+  return UNKNOWN;
+}
+
+void convertStages(const std::string &inputPath, const std::string &outputPath,
+                   Mode mode, const ConvertOptions &options,
+                   std::ostream &log) {
+  const JpegEncoder::Options &jpegOptions = options.jpeg;
+  const JpegDecoder::Options &jpegDecodeOptions = options.jpegDecode;
+  const PngEncoder::Options &pngOptions = options.png;
+
+  if (mode == PNG_TO_JPG && !jpegOptions.optimizeHuffman &&
+      jpegOptions.threads == 1) {
+    // Stream scanlines straight into the encoder, one MCU row at a time,
+    // while a second thread codes the previous row. Optimized tables need
+    // the whole image, and several threads encode restart segments of it
+    // in parallel instead.
+    log << "Decoding PNG " << inputPath << "..." << std::endl;
+    PngDecoder::Stream png(inputPath);
+    log << "  Dimensions: " << png.width() << "x" << png.height() << std::endl;
+    log << "  Channels: " << png.channels() << std::endl;
+
+    log << "Encoding to JPEG " << outputPath << " with quality "
+        << jpegOptions.quality << "..." << std::endl;
+    FileByteWriter out(outputPath);
+    JpegEncoder::Stream jpeg(out, png.width(), png.height(), png.channels(),
+                             jpegOptions);
+    png.decodeRows([&](int, const uint8_t *row) { jpeg.writeRow(row); });
+    jpeg.finish();
+    out.close();
+  } else if (mode == PNG_TO_JPG) {
+    // 1. Decode PNG
+    log << "Decoding PNG " << inputPath << "..." << std::endl;
+    Image img = PngDecoder::decode(inputPath);
+    log << "  Dimensions: " << img.width << "x" << img.height << std::endl;
+    log << "  Channels: " << img.channels << std::endl;
+
+    // 2. Encode JPEG
+    log << "Encoding to JPEG " << outputPath << " with quality "
+        << jpegOptions.quality << "..." << std::endl;
+    JpegEncoder::encode(img, outputPath, jpegOptions);
+  } else if (pngOptions.threads == 1) {
+    // Hand each decoded MCU row straight to the PNG encoder, which filters
+    // and compresses on a second thread
+    log << "Decoding JPEG " << inputPath << "..." << std::endl;
+    JpegDecoder::Stream jpeg(inputPath, jpegDecodeOptions);
+    log << "  Dimensions: " << jpeg.width() << "x" << jpeg.height()
+        << std::endl;
+    log << "  Channels: " << jpeg.channels() << std::endl;
+
+    log << "Encoding to PNG " << outputPath << " with level "
+        << pngOptions.level << "..." << std::endl;
+    FileByteWriter out(outputPath);
+    PngEncoder::Stream png(out, jpeg.width(), jpeg.height(), jpeg.channels(),
+                           pngOptions);
+    jpeg.decodeRows([&](int, const uint8_t *row) { png.writeRow(row); });
+    png.finish();
+    out.close();
+  } else {
+    // 1. Decode JPEG
+    log << "Decoding JPEG " << inputPath << "..." << std::endl;
+    Image img = JpegDecoder::decode(inputPath, jpegDecodeOptions);
+    log << "  Dimensions: " << img.width << "x" << img.height << std::endl;
+    log << "  Channels: " << img.channels << std::endl;
+
+    // 2. Encode PNG
+    log << "Encoding to PNG " << outputPath << " with level "
+        << pngOptions.level << "..." << std::endl;
+    PngEncoder::encode(img, outputPath, pngOptions);
+  }
+}
+
+// Converts one file, reporting progress to `log`. The streaming paths create
+// the output before decoding ends, so a failed conversion removes it.
+void convertFile(const std::string &inputPath, const std::string &outputPath,
+                 Mode mode, const ConvertOptions &options, std::ostream &log) {
+  try {
+    convertStages(inputPath, outputPath, mode, options, log);
+  } catch (...) {
+    std::error_code ec;
+    std::filesystem::remove(outputPath, ec);
+    throw;
+  }
+}
+
+// Converts every image named by `source`, a directory or a text file with
+// one path per line, into `outDir`: PNGs to JPEG and JPEGs to PNG. Files
+// are spread over `threads` threads, each converting one file at a time
+// with the single-threaded streaming pipelines, and handed out largest
+// first so that no big file starts last. Failures are reported per file.
+int runBatch(const std::string &source, const std::string &outDir,
+             ConvertOptions options, int threads) {
+  namespace fs = std::filesystem;
+  struct Job {
+    std::string input;
+    std::string output;
+    Mode mode;
+    uintmax_t size;
+  };
+
+  std::vector<std::string> inputs;
+  std::error_code ec;
+  bool fromDirectory = fs::is_directory(source, ec);
+  if (fromDirectory) {
+    for (const auto &entry : fs::directory_iterator(source, ec)) {
+      if (entry.is_regular_file(ec))
+        inputs.push_back(entry.path().string());
+    }
+  } else {
+    std::ifstream list(source);
+    if (!list) {
+      std::cerr << "Error: Cannot read batch list '" << source << "'."
+                << std::endl;
+      return 1;
+    }
+    std::string line;
+    while (std::getline(list, line)) {
+      if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+      if (!line.empty())
+        inputs.push_back(line);
+    }
+  }
+  if (ec) {
+    std::cerr << "Error: Cannot list '" << source << "': " << ec.message()
+              << std::endl;
+    return 1;
+  }
+
+  fs::create_directories(outDir, ec);
+  if (ec) {
+    std::cerr << "Error: Cannot create output directory '" << outDir
+              << "': " << ec.message() << std::endl;
+    return 1;
+  }
+
+  // Outputs keep the input's name with the other format's extension. None
+  // may replace an input, which another job could still be reading (x.png
+  // and x.jpg converted into their own directory), so paths are compared
+  // in canonical form.
+  std::set<fs::path> sources;
+  for (const std::string &input : inputs)
+    sources.insert(fs::weakly_canonical(input, ec));
+  std::vector<Job> jobs;
+  std::set<fs::path> outputs;
+  size_t failures = 0;
+  for (const std::string &input : inputs) {
+    bool isPng = hasExtension(input, ".png");
+    bool isJpeg = hasExtension(input, ".jpg") || hasExtension(input, ".jpeg");
+    if (!isPng && !isJpeg) {
+      if (!fromDirectory) {
+        std::cerr << "Failed: " << input << ": not a .png or .jpg file"
+                  << std::endl;
+        ++failures;
+      }
+      continue;
+    }
+
+    fs::path output = fs::path(outDir) / fs::path(input).filename();
+    output.replace_extension(isPng ? ".jpg" : ".png");
+    fs::path canonical = fs::weakly_canonical(output, ec);
+    if (sources.count(canonical)) {
+      std::cerr << "Failed: " << input << ": output " << output.string()
+                << " would overwrite an input" << std::endl;
+      ++failures;
+      continue;
+    }
+    if (!outputs.insert(canonical).second) {
+      std::cerr << "Failed: " << input << ": output " << output.string()
+                << " is already written by another input" << std::endl;
+      ++failures;
+      continue;
+    }
+
+    uintmax_t size = fs::file_size(input, ec);
+    jobs.push_back({input, output.string(), isPng ? PNG_TO_JPG : JPG_TO_PNG,
+                    ec ? 0 : size});
+  }
+  std::stable_sort(jobs.begin(), jobs.end(), [](const Job &a, const Job &b) {
+    return a.size > b.size;
+  });
+
+  options.jpeg.threads = 1;
+  options.jpegDecode.threads = 1;
+  options.png.threads = 1;
+  ThreadPool pool(ThreadPool::resolveThreads(threads));
+  std::cout << "Converting " << jobs.size() << " files on " << pool.size()
+            << " threads..." << std::endl;
+
+  std::mutex logMutex;
+  std::atomic<size_t> failed(0);
+  std::atomic<uintmax_t> bytes(0);
+  auto start = std::chrono::high_resolution_clock::now();
+
+  // parallelFor() hands out indices in order from a shared counter, so an
+  // idle thread always takes the largest file left
+  pool.parallelFor(jobs.size(), [&](size_t i) {
+    const Job &job = jobs[i];
+    // Per-file progress is not shown. Each job has its own null stream,
+    // since writing to one sets its state and cannot be shared by threads.
+    std::ostream quiet(nullptr);
+    try {
+      convertFile(job.input, job.output, job.mode, options, quiet);
+      bytes += job.size;
+    } catch (const std::exception &e) {
+      std::lock_guard<std::mutex> lock(logMutex);
+      std::cerr << "Failed: " << job.input << ": " << e.what() << std::endl;
+      ++failed;
+    }
+  });
+
+  auto end = std::chrono::high_resolution_clock::now();
+  double seconds = std::chrono::duration<double>(end - start).count();
+  size_t converted = jobs.size() - failed;
+  failures += failed;
+  std::cout << "Converted " << converted << " of " << converted + failures
+            << " files in " << seconds << " seconds." << std::endl;
+  if (seconds > 0) {
+    std::cout << "Throughput: " << converted / seconds << " images/s, "
+              << bytes / 1e6 / seconds << " MB/s of input" << std::endl;
+  }
+  if (failures > 0) {
+    std::cerr << failures << " file(s) failed." << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Prints what --stats collected, if it was given
+void printStats(const std::string &format) {
+  if (format == "json")
+    Stats::writeJson(std::cout);
+  else if (format == "text")
+    Stats::writeText(std::cout);
+}
+
 int main(int argc, char *argv[]) {
+  const char *flags = " [-q/--quality <1-100>]"
+                      " [--png-level <0-9>] [--png-filter <none|sum|entropy>]"
+                      " [--dct <int|float>] [--subsample <444|422|420>]"
+                      " [--optimize] [--restart <mcus>] [--threads <n>]"
+                      " [--scale <1|2|4|8>] [--crop <x,y,w,h>]"
+                      " [--stats <text|json>]";
   if (argc < 3) {
-    std::cerr << "Usage: " << argv[0]
-              << " <input> <output> [-q/--quality <1-100>]" << std::endl;
+    std::cerr << "Usage: " << argv[0] << " <input> <output>" << flags
+              << std::endl;
+    std::cerr << "       " << argv[0]
+              << " --batch <input-dir|list-file> --out <dir>" << flags
+              << std::endl;
     return 1;
   }
 
-  std::string inputPath = argv[1];
-  std::string outputPath = argv[2];
-  int quality = 50;
+  std::vector<std::string> paths;
+  std::string batchSource;
+  std::string batchOutDir;
+  bool threadsGiven = false;
+  std::string statsFormat;
+  JpegEncoder::Options jpegOptions;
+  JpegDecoder::Options jpegDecodeOptions;
+  PngEncoder::Options pngOptions;
 
-  for (int i = 3; i < argc; ++i) {
+  for (int i = 1; i < argc; ++i) {
     std::string arg = argv[i];
-    if (arg == "-q" || arg == "--quality") {
+    if (arg.empty() || arg[0] != '-') {
+      paths.push_back(arg);
+    } else if (arg == "--batch" || arg == "--out") {
+      if (i + 1 < argc) {
+        (arg == "--batch" ? batchSource : batchOutDir) = argv[++i];
+      } else {
+        std::cerr << "Error: Missing value for " << arg << " flag."
+                  << std::endl;
+        return 1;
+      }
+    } else if (arg == "--stats") {
+      if (i + 1 < argc) {
+        statsFormat = argv[++i];
+        if (statsFormat != "text" && statsFormat != "json") {
+          std::cerr << "Error: Stats format must be text or json."
+                    << std::endl;
+          return 1;
+        }
+        Stats::enable();
+      } else {
+        std::cerr << "Error: Missing value for stats flag." << std::endl;
+        return 1;
+      }
+    } else if (arg == "-q" || arg == "--quality") {
       if (i + 1 < argc) {
         try {
-          quality = std::stoi(argv[++i]);
-          if (quality < 1 || quality > 100) {
+          jpegOptions.quality = std::stoi(argv[++i]);
+          if (jpegOptions.quality < 1 || jpegOptions.quality > 100) {
             std::cerr << "Error: Quality must be between 1 and 100."
                       << std::endl;
             return 1;
@@ -52,28 +349,182 @@ int main(int argc, char *argv[]) {
         std::cerr << "Error: Missing value for quality flag." << std::endl;
         return 1;
       }
+    } else if (arg == "--dct") {
+      if (i + 1 < argc) {
+        std::string dct = argv[++i];
+        if (dct == "int") {
+          jpegOptions.dct = JpegDct::INTEGER;
+        } else if (dct == "float") {
+          jpegOptions.dct = JpegDct::FLOAT;
+        } else {
+          std::cerr << "Error: DCT must be int or float." << std::endl;
+          return 1;
+        }
+        jpegDecodeOptions.idct = jpegOptions.dct;
+      } else {
+        std::cerr << "Error: Missing value for DCT flag." << std::endl;
+        return 1;
+      }
+    } else if (arg == "--restart") {
+      if (i + 1 < argc) {
+        try {
+          jpegOptions.restartInterval = std::stoi(argv[++i]);
+          if (jpegOptions.restartInterval < 0 ||
+              jpegOptions.restartInterval > 65535) {
+            std::cerr << "Error: Restart interval must be between 0 and 65535."
+                      << std::endl;
+            return 1;
+          }
+        } catch (...) {
+          std::cerr << "Error: Invalid restart interval." << std::endl;
+          return 1;
+        }
+      } else {
+        std::cerr << "Error: Missing value for restart flag." << std::endl;
+        return 1;
+      }
+    } else if (arg == "--optimize") {
+      jpegOptions.optimizeHuffman = true;
+    } else if (arg == "--subsample") {
+      if (i + 1 < argc) {
+        std::string mode = argv[++i];
+        if (mode == "444") {
+          jpegOptions.subsampling = JpegEncoder::SUBSAMPLING_444;
+        } else if (mode == "422") {
+          jpegOptions.subsampling = JpegEncoder::SUBSAMPLING_422;
+        } else if (mode == "420") {
+          jpegOptions.subsampling = JpegEncoder::SUBSAMPLING_420;
+        } else {
+          std::cerr << "Error: Subsampling must be 444, 422 or 420."
+                    << std::endl;
+          return 1;
+        }
+      } else {
+        std::cerr << "Error: Missing value for subsampling flag." << std::endl;
+        return 1;
+      }
+    } else if (arg == "--png-level") {
+      if (i + 1 < argc) {
+        try {
+          pngOptions.level = std::stoi(argv[++i]);
+          if (pngOptions.level < 0 || pngOptions.level > 9) {
+            std::cerr << "Error: PNG level must be between 0 and 9."
+                      << std::endl;
+            return 1;
+          }
+        } catch (...) {
+          std::cerr << "Error: Invalid PNG level value." << std::endl;
+          return 1;
+        }
+      } else {
+        std::cerr << "Error: Missing value for PNG level flag." << std::endl;
+        return 1;
+      }
+    } else if (arg == "--png-filter") {
+      if (i + 1 < argc) {
+        std::string filter = argv[++i];
+        if (filter == "none") {
+          pngOptions.filter = PngEncoder::FILTER_NONE;
+        } else if (filter == "sum") {
+          pngOptions.filter = PngEncoder::FILTER_MIN_SUM;
+        } else if (filter == "entropy") {
+          pngOptions.filter = PngEncoder::FILTER_ENTROPY;
+        } else {
+          std::cerr << "Error: PNG filter must be none, sum or entropy."
+                    << std::endl;
+          return 1;
+        }
+      } else {
+        std::cerr << "Error: Missing value for PNG filter flag." << std::endl;
+        return 1;
+      }
+    } else if (arg == "--scale") {
+      if (i + 1 < argc) {
+        std::string scale = argv[++i];
+        if (scale == "1" || scale == "2" || scale == "4" || scale == "8") {
+          jpegDecodeOptions.scale = std::stoi(scale);
+        } else {
+          std::cerr << "Error: Scale must be 1, 2, 4 or 8." << std::endl;
+          return 1;
+        }
+      } else {
+        std::cerr << "Error: Missing value for scale flag." << std::endl;
+        return 1;
+      }
+    } else if (arg == "--crop") {
+      if (i + 1 < argc) {
+        int x, y, w, h;
+        char extra;
+        if (std::sscanf(argv[++i], "%d,%d,%d,%d%c", &x, &y, &w, &h, &extra) !=
+                4 ||
+            x < 0 || y < 0 || w <= 0 || h <= 0) {
+          std::cerr << "Error: Crop must be x,y,width,height with a positive "
+                       "width and height."
+                    << std::endl;
+          return 1;
+        }
+        jpegDecodeOptions.cropX = x;
+        jpegDecodeOptions.cropY = y;
+        jpegDecodeOptions.cropWidth = w;
+        jpegDecodeOptions.cropHeight = h;
+      } else {
+        std::cerr << "Error: Missing value for crop flag." << std::endl;
+        return 1;
+      }
+    } else if (arg == "--threads") {
+      if (i + 1 < argc) {
+        try {
+          pngOptions.threads = std::stoi(argv[++i]);
+          threadsGiven = true;
+          jpegOptions.threads = pngOptions.threads;
+          jpegDecodeOptions.threads = pngOptions.threads;
+          if (pngOptions.threads < 0) {
+            std::cerr << "Error: Thread count must be 0 (all cores) or more."
+                      << std::endl;
+            return 1;
+          }
+        } catch (...) {
+          std::cerr << "Error: Invalid thread count." << std::endl;
+          return 1;
+        }
+      } else {
+        std::cerr << "Error: Missing value for threads flag." << std::endl;
+        return 1;
+      }
     } else {
       std::cerr << "Warning: Unknown argument '" << arg << "'" << std::endl;
     }
   }
 
+  ConvertOptions convertOptions{jpegOptions, jpegDecodeOptions, pngOptions};
+  if (!batchSource.empty() || !batchOutDir.empty()) {
+    if (batchSource.empty() || batchOutDir.empty() || !paths.empty()) {
+      std::cerr << "Error: Batch mode takes --batch <input-dir|list-file> "
+                   "and --out <dir> instead of input and output files."
+                << std::endl;
+      return 1;
+    }
+    // One file per core unless told otherwise
+    int status = runBatch(batchSource, batchOutDir, convertOptions,
+                          threadsGiven ? pngOptions.threads : 0);
+    printStats(statsFormat);
+    return status;
+  }
+  if (paths.size() != 2) {
+    std::cerr << "Error: Expected an input and an output file." << std::endl;
+    return 1;
+  }
+  std::string inputPath = paths[0];
+  std::string outputPath = paths[1];
+
   if (!fileExists(inputPath)) {
     std::cerr << "Error: Input file '" << inputPath << "' does not exist."
               << std::endl;
     return 1;
   }
 
-  enum Mode { PNG_TO_JPG, JPG_TO_PNG, UNKNOWN };
-  Mode mode = UNKNOWN;
-
-  if (hasExtension(inputPath, ".png") &&
-      (hasExtension(outputPath, ".jpg") || hasExtension(outputPath, ".jpeg"))) {
-    mode = PNG_TO_JPG;
-  } else if ((hasExtension(inputPath, ".jpg") ||
-              hasExtension(inputPath, ".jpeg")) &&
-             hasExtension(outputPath, ".png")) {
-    mode = JPG_TO_PNG;
-  } else {
+  Mode mode = conversionMode(inputPath, outputPath);
+  if (mode == UNKNOWN) {
     std::cerr << "Error: Could not determine conversion mode from extensions."
               << std::endl;
     std::cerr << "Supported conversions: .png -> .jpg, .jpg -> .png"
@@ -85,36 +536,14 @@ int main(int argc, char *argv[]) {
     std::cout << "Processing..." << std::endl;
     auto start = std::chrono::high_resolution_clock::now();
 
-    if (mode == PNG_TO_JPG) {
-      // 1. Decode PNG
-      std::cout << "Decoding PNG " << inputPath << "..." << std::endl;
-      Image img = PngDecoder::decode(inputPath);
-      std::cout << "  Dimensions: " << img.width << "x" << img.height
-                << std::endl;
-      std::cout << "  Channels: " << img.channels << std::endl;
-
-      // 2. Encode JPEG
-      std::cout << "Encoding to JPEG " << outputPath << " with quality "
-                << quality << "..." << std::endl;
-      JpegEncoder::encode(img, outputPath, quality);
-    } else {
-      // 1. Decode JPEG
-      std::cout << "Decoding JPEG " << inputPath << "..." << std::endl;
-      Image img = JpegDecoder::decode(inputPath);
-      std::cout << "  Dimensions: " << img.width << "x" << img.height
-                << std::endl;
-      std::cout << "  Channels: " << img.channels << std::endl;
-
-      // 2. Encode PNG
-      std::cout << "Encoding to PNG " << outputPath << "..." << std::endl;
-      PngEncoder::encode(img, outputPath);
-    }
+    convertFile(inputPath, outputPath, mode, convertOptions, std::cout);
 
     auto end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> elapsed = end - start;
 
     std::cout << "Success! Conversion took " << elapsed.count() << " seconds."
               << std::endl;
+    printStats(statsFormat);
 
   } catch (const std::exception &e) {
     std::cerr << "Error: " << e.what() << std::endl;
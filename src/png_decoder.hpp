@@ -2,59 +2,153 @@
 #define PNG_DECODER_HPP
 
 #include "image.hpp"
+#include "utils/mapped_file.hpp"
 #include <cstdint>
+#include <functional>
 #include <string>
 #include <vector>
 
 class PngDecoder {
 public:
   static Image decode(const std::string &filepath);
+  // Decodes a PNG held in memory
+  static Image decode(const uint8_t *data, size_t size);
+
+  // Incremental decoder with bounded memory. IDAT chunks are consumed only
+  // when the inflater needs more input, and every scanline is handed to the
+  // callback as soon as it is unfiltered. Apart from the mapped input file,
+  // only the 32 KiB inflate window and two rows are resident, whatever the
+  // image size.
+  class Stream {
+  public:
+    using RowCallback = std::function<void(int y, const uint8_t *row)>;
+
+    // Opens the file and parses chunks up to the first IDAT
+    explicit Stream(const std::string &filepath);
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+    int channels() const { return channels_; }
+
+    // Decodes all scanlines in order. `row` holds width * channels bytes and
+    // is only valid for the duration of the call.
+    void decodeRows(const RowCallback &onRow);
+
+  private:
+    bool nextInput(const uint8_t *&data, size_t &size);
+
+    MappedFile file_;
+    size_t pos_ = 0; // Offset of the next unread chunk
+    int width_ = 0;
+    int height_ = 0;
+    int channels_ = 0;
+  };
 
 private:
+  // A chunk whose payload is referenced in place in the input file
   struct Chunk {
     uint32_t length;
     std::string type;
-    std::vector<uint8_t> data;
+    const uint8_t *data;
     uint32_t crc;
   };
 
+  struct ByteSpan {
+    const uint8_t *data;
+    size_t size;
+  };
+
   static uint32_t readBigEndian(const uint8_t *buffer);
-  static void parseIHDR(const std::vector<uint8_t> &data, int &width,
-                        int &height, uint8_t &bitDepth, uint8_t &colorType,
+  static void checkSignature(const uint8_t *data, size_t size);
+  // Reads the chunk at `pos` of the `size` bytes at `data` and advances past
+  // it; false at end of data
+  static bool readChunk(const uint8_t *data, size_t size, size_t &pos,
+                        Chunk &chunk);
+  static void parseIHDR(const Chunk &chunk, int &width, int &height,
+                        uint8_t &bitDepth, uint8_t &colorType,
                         uint8_t &compressionMethod, uint8_t &filterMethod,
                         uint8_t &interlaceMethod);
 
-  // DEFLATE / Zlib helpers
+  // DEFLATE / Zlib helpers. The zlib stream may be split across several
+  // spans (one per IDAT chunk). `expectedSize` pre-sizes the output buffer
+  // (height * (stride + 1) for PNG image data); 0 means unknown.
+  static std::vector<uint8_t> inflate(const std::vector<ByteSpan> &input,
+                                      size_t expectedSize = 0);
   static std::vector<uint8_t>
-  inflate(const std::vector<uint8_t> &compressedData);
+  inflate(const std::vector<uint8_t> &compressedData, size_t expectedSize = 0);
 
-  struct HuffmanCode {
-    int symbol;
-    int length;
+  // Packed lookup-table entry. A primary table indexed by the next
+  // `rootBits` stream bits resolves every code up to that length in a single
+  // probe; longer codes go through a link entry into a second-level subtable.
+  struct HuffmanEntry {
+    uint16_t value; // Literal/symbol, length/distance base, or subtable offset
+    uint8_t kind;   // One of the Kind values below
+    uint8_t bits;   // Low nibble: code length (or subtable index bits for
+                    // links); high nibble: extra bits following the code
   };
 
   struct HuffmanTree {
-    std::vector<int> counts;  // Count of codes of each length
-    std::vector<int> symbols; // Symbols sorted by length
+    enum Kind : uint8_t {
+      INVALID = 0, // No code maps here (incomplete code)
+      SYMBOL,      // Plain symbol (literal byte, code length symbol)
+      BASE,        // Length/distance base value, `extraBits()` bits follow
+      END_OF_BLOCK,
+      LINK // Points to a subtable of 2^codeLength() entries
+    };
+    enum Alphabet { CODE_LENGTHS, LITERAL_LENGTH, DISTANCE };
+
+    static constexpr int ROOT_BITS = 10;
 
-    void build(const std::vector<int> &codeLengths);
-    int decode(class BitReader &reader) const;
+    std::vector<HuffmanEntry> table; // Primary table followed by subtables
+    int rootBits = 0;
+
+    void build(const std::vector<int> &codeLengths,
+               Alphabet alphabet = CODE_LENGTHS);
+    HuffmanEntry decode(class BitReader &reader) const;
+
+    static int codeLength(const HuffmanEntry &e) { return e.bits & 0x0F; }
+    static int extraBits(const HuffmanEntry &e) { return e.bits >> 4; }
+  };
+
+  // Inflate output: `data` is pre-sized with COPY_SLACK spare bytes past
+  // the last one that can be written, and `pos` is the write cursor.
+  // With a `sink` set the buffer is a sliding window instead: finished
+  // bytes are handed to the sink and only the last WINDOW_SIZE are kept
+  // for back-references.
+  struct InflateOutput {
+    static constexpr size_t COPY_SLACK = 8;
+    static constexpr size_t MAX_EXPANSION = 1032; // DEFLATE's worst ratio
+    static constexpr size_t WINDOW_SIZE = 32768;
+    static constexpr size_t MAX_RESERVE = 32768; // Largest single reserve()
+
+    std::vector<uint8_t> data;
+    size_t pos = 0;
+
+    std::function<void(const uint8_t *, size_t)> sink;
+    size_t flushed = 0; // Bytes before this offset went to the sink
+
+    void reserve(size_t n); // Make room for n more bytes plus the slack
+    void flush();
   };
 
+  static void inflateZlib(class BitReader &reader, InflateOutput &out);
+
   static void decodeHuffmanBlock(class BitReader &reader,
-                                 std::vector<uint8_t> &out);
+                                 const HuffmanTree &litLenTree,
+                                 const HuffmanTree &distTree,
+                                 InflateOutput &out);
   static void decodeFixedHuffmanBlock(class BitReader &reader,
-                                      std::vector<uint8_t> &out);
+                                      InflateOutput &out);
   static void decodeDynamicHuffmanBlock(class BitReader &reader,
-                                        std::vector<uint8_t> &out);
+                                        InflateOutput &out);
   static void decodeUncompressedBlock(class BitReader &reader,
-                                      std::vector<uint8_t> &out);
+                                      InflateOutput &out);
 
   // Filtering helpers
-  static std::vector<uint8_t>
-  unfilterScanlines(const std::vector<uint8_t> &data, int width, int height,
-                    int bytesPerPixel);
-  static uint8_t paethPredictor(uint8_t a, uint8_t b, uint8_t c);
+  // Reverses the filters on the inflated data in place; on return `data`
+  // holds height * width * bytesPerPixel bytes of pixels.
+  static void unfilterScanlines(std::vector<uint8_t> &data, int width,
+                                int height, int bytesPerPixel);
 };
 
 #endif // PNG_DECODER_HPP
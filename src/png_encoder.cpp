@@ -1,55 +1,71 @@
 #include "png_encoder.hpp"
+#include "deflate_encoder.hpp"
+#include "png_filter.hpp"
 #include "utils/checksum.hpp"
+#include "utils/stats.hpp"
+#include "utils/thread_pool.hpp"
+#include <algorithm>
+#include <cmath>
 #include <cstring>
-#include <fstream>
 #include <iostream>
 #include <stdexcept>
 #include <vector>
 
 // Big-endian writing helper
-static void writeU32(std::ofstream &file, uint32_t val) {
+static void writeU32(ByteWriter &out, uint32_t val) {
   uint8_t bytes[4];
   bytes[0] = (val >> 24) & 0xFF;
   bytes[1] = (val >> 16) & 0xFF;
   bytes[2] = (val >> 8) & 0xFF;
   bytes[3] = val & 0xFF;
-  file.write((char *)bytes, 4);
+  out.write(bytes, 4);
 }
 
 void PngEncoder::encode(const Image &img, const std::string &filepath) {
-  std::ofstream file(filepath, std::ios::binary);
-  if (!file) {
-    throw std::runtime_error("Could not open file for writing: " + filepath);
-  }
+  encode(img, filepath, Options());
+}
+
+void PngEncoder::encode(const Image &img, const std::string &filepath,
+                        const Options &options) {
+  FileByteWriter file(filepath);
+  encode(img, file, options);
+  file.close();
+}
 
+void PngEncoder::encode(const Image &img, ByteWriter &out) {
+  encode(img, out, Options());
+}
+
+void PngEncoder::encode(const Image &img, ByteWriter &out,
+                        const Options &options) {
   // PNG Signature
   const uint8_t signature[] = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
-  file.write((char *)signature, 8);
+  out.write(signature, 8);
 
-  writeIHDR(file, img.width, img.height, img.channels);
-  writeIDAT(file, img);
-  writeIEND(file);
+  writeIHDR(out, img.width, img.height, img.channels);
+  writeIDAT(out, img, options);
+  writeIEND(out);
 }
 
-void PngEncoder::writeChunk(std::ofstream &file, const char *type,
-                            const std::vector<uint8_t> &data) {
-  writeU32(file, (uint32_t)data.size());
+void PngEncoder::writeChunk(ByteWriter &out, const char *type,
+                            const uint8_t *data, size_t size) {
+  writeU32(out, (uint32_t)size);
 
   // Calculate CRC over Type + Data
   std::vector<uint8_t> crcData;
-  crcData.resize(4 + data.size());
+  crcData.resize(4 + size);
   std::memcpy(crcData.data(), type, 4);
-  if (!data.empty()) {
-    std::memcpy(crcData.data() + 4, data.data(), data.size());
+  if (size > 0) {
+    std::memcpy(crcData.data() + 4, data, size);
   }
 
-  file.write((char *)crcData.data(), crcData.size());
+  out.write(crcData.data(), crcData.size());
 
   uint32_t crc = Checksum::crc32(crcData.data(), crcData.size());
-  writeU32(file, crc);
+  writeU32(out, crc);
 }
 
-void PngEncoder::writeIHDR(std::ofstream &file, int width, int height,
+void PngEncoder::writeIHDR(ByteWriter &out, int width, int height,
                            int channels) {
   std::vector<uint8_t> data(13);
 
@@ -80,77 +96,248 @@ void PngEncoder::writeIHDR(std::ofstream &file, int width, int height,
   // Interlace method (1 byte) - 0 (No interlace)
   data[12] = 0;
 
-  writeChunk(file, "IHDR", data);
+  writeChunk(out, "IHDR", data.data(), data.size());
 }
 
-void PngEncoder::writeIDAT(std::ofstream &file, const Image &img) {
-  // We are writing uncompressed DEFLATE blocks.
-  // Each block can hold up to 65535 bytes.
-  // Format of uncompressed block:
-  // 1 byte header: BFINAL (1 bit) + BTYPE (2 bits) + Reserved (5 bits)
-  //                BTYPE=00 for no compression.
-  // 2 bytes LEN (little endian)
-  // 2 bytes NLEN (one's complement of LEN, little endian)
-  // LEN bytes of data
+// Shannon entropy of the bytes of a filtered row, in bits
+static double entropyBits(const uint8_t *data, size_t size) {
+  // Four interleaved histograms avoid stalls on runs of equal bytes
+  uint32_t counts[4][256] = {};
+  size_t i = 0;
+  for (; i + 4 <= size; i += 4) {
+    counts[0][data[i]]++;
+    counts[1][data[i + 1]]++;
+    counts[2][data[i + 2]]++;
+    counts[3][data[i + 3]]++;
+  }
+  for (; i < size; ++i)
+    counts[0][data[i]]++;
+
+  double bits = size > 0 ? size * std::log2(static_cast<double>(size)) : 0.0;
+  for (int v = 0; v < 256; ++v) {
+    uint32_t c = counts[0][v] + counts[1][v] + counts[2][v] + counts[3][v];
+    if (c > 1)
+      bits -= c * std::log2(static_cast<double>(c));
+  }
+  return bits;
+}
+
+std::vector<uint8_t> PngEncoder::filterScanlines(const Image &img,
+                                                 FilterHeuristic heuristic,
+                                                 ThreadPool &pool) {
+  Stats::ScopedTimer timer(Stats::FILTER);
+  size_t rowSize = static_cast<size_t>(img.width) * img.channels;
+  std::vector<uint8_t> rawData(img.height * (rowSize + 1));
+  std::vector<uint8_t> zeroRow(rowSize, 0);
+
+  // Rows only depend on the unfiltered row above, so bands of rows can be
+  // filtered independently
+  const int bandRows = 64;
+  size_t bands = (img.height + bandRows - 1) / bandRows;
+  pool.parallelFor(bands, [&](size_t band) {
+    std::vector<uint8_t> candidates(heuristic == FILTER_NONE ? 0
+                                                             : 5 * rowSize);
+    int yEnd = std::min<int>(img.height, (band + 1) * bandRows);
+    for (int y = band * bandRows; y < yEnd; ++y) {
+      const uint8_t *row = &img.data[y * rowSize];
+      const uint8_t *prev = y > 0 ? row - rowSize : zeroRow.data();
+      filterScanline(row, prev, rowSize, img.channels, heuristic,
+                     candidates.data(), &rawData[y * (rowSize + 1)]);
+    }
+  });
+  return rawData;
+}
 
-  // First, we need to prepare the scanline data with filter byte (0 = None)
-  std::vector<uint8_t> rawData;
-  int rowSize = img.width * img.channels;
-  rawData.reserve(img.height * (rowSize + 1));
+void PngEncoder::filterScanline(const uint8_t *row, const uint8_t *prev,
+                                size_t rowSize, int channels,
+                                FilterHeuristic heuristic,
+                                uint8_t *candidates, uint8_t *out) {
+  if (heuristic == FILTER_NONE) {
+    out[0] = PngFilter::NONE;
+    std::memcpy(out + 1, row, rowSize);
+    return;
+  }
 
-  for (int y = 0; y < img.height; ++y) {
-    rawData.push_back(0); // Filter type 0 (None)
-    const uint8_t *row = &img.data[y * rowSize];
-    rawData.insert(rawData.end(), row, row + rowSize);
+  // Try all five filters; ties go to the lower filter type
+  int best = 0;
+  double bestCost = 0;
+  for (int type = PngFilter::NONE; type <= PngFilter::PAETH; ++type) {
+    uint8_t *candidate = &candidates[type * rowSize];
+    double cost = static_cast<double>(
+        PngFilter::filterRow(type, candidate, row, prev, rowSize, channels));
+    if (heuristic == FILTER_ENTROPY)
+      cost = entropyBits(candidate, rowSize);
+    if (type == 0 || cost < bestCost) {
+      best = type;
+      bestCost = cost;
+    }
   }
+  out[0] = static_cast<uint8_t>(best);
+  std::memcpy(out + 1, &candidates[best * rowSize], rowSize);
+}
 
-  // Now wrap this in Zlib stream structure
-  // Zlib Header: 0x78 0x01 (Default compression, no dictionary)
+void PngEncoder::writeIDAT(ByteWriter &out, const Image &img,
+                           const Options &options) {
+  ThreadPool pool(ThreadPool::resolveThreads(options.threads));
+  std::vector<uint8_t> rawData = filterScanlines(img, options.filter, pool);
+
+  // Zlib stream: header, DEFLATE data, Adler-32 of the raw data
   std::vector<uint8_t> zlibData;
-  zlibData.push_back(0x78);
-  zlibData.push_back(0x01);
+  {
+    Stats::ScopedTimer timer(Stats::DEFLATE);
+    zlibData = DeflateEncoder::zlibCompress(rawData.data(), rawData.size(),
+                                            options.level, &pool);
+  }
 
-  size_t pos = 0;
-  while (pos < rawData.size()) {
-    size_t chunkLen = rawData.size() - pos;
-    bool isFinal = false;
-    if (chunkLen > 65535) {
-      chunkLen = 65535;
-    } else {
-      isFinal = true;
+  writeChunk(out, "IDAT", zlibData.data(), zlibData.size());
+}
+
+void PngEncoder::writeIEND(ByteWriter &out) {
+  writeChunk(out, "IEND", nullptr, 0);
+}
+
+// ============================================================================
+// Streaming encoder
+// ============================================================================
+
+PngEncoder::Stream::Stream(ByteWriter &out, int width, int height,
+                           int channels, const Options &options)
+    : out_(out), filter_(options.filter),
+      channels_(channels), stride_(static_cast<size_t>(width) * channels),
+      height_(height), deflate_(options.level) {
+  stripRows_ = static_cast<int>(std::max<size_t>(1, STRIP_BYTES / stride_));
+  filling_.resize(stripRows_ * stride_);
+  pending_.resize(stripRows_ * stride_);
+  prevRow_.assign(stride_, 0);
+  candidates_.resize(filter_ == FILTER_NONE ? 0 : 5 * stride_);
+
+  const uint8_t signature[] = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
+  out_.write(signature, 8);
+  writeIHDR(out_, width, height, channels);
+  DeflateEncoder::writeZlibHeader(zlib_, options.level);
+
+  worker_ = std::thread([this] { run(); });
+}
+
+PngEncoder::Stream::~Stream() {
+  if (worker_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closing_ = true;
     }
+    changed_.notify_all();
+    worker_.join();
+  }
+}
+
+void PngEncoder::Stream::writeRow(const uint8_t *row) {
+  if (rowsWritten_ >= height_)
+    throw std::runtime_error("More scanlines than the image height");
+
+  std::memcpy(&filling_[(rowsWritten_ % stripRows_) * stride_], row, stride_);
+  ++rowsWritten_;
+  if (rowsWritten_ % stripRows_ == 0 || rowsWritten_ == height_)
+    submitStrip();
+}
+
+void PngEncoder::Stream::finish() {
+  if (rowsWritten_ != height_)
+    throw std::runtime_error("Not all scanlines were written");
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closing_ = true;
+  }
+  changed_.notify_all();
+  worker_.join();
+  if (error_)
+    std::rethrow_exception(error_);
+
+  compress(DeflateEncoder::FINISH);
+  for (int shift = 24; shift >= 0; shift -= 8)
+    zlib_.push_back((adler_ >> shift) & 0xFF);
+  writeIdat(true);
+  writeIEND(out_);
+}
 
-    // Deflate Block Header
-    // BFINAL=1 if final, 0 otherwise. BTYPE=00
-    uint8_t header = isFinal ? 0x01 : 0x00;
-    zlibData.push_back(header);
+void PngEncoder::Stream::submitStrip() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  changed_.wait(lock, [this] { return !pendingReady_; });
+  if (error_)
+    std::rethrow_exception(error_);
+  std::swap(filling_, pending_);
+  pendingRows_ = (rowsWritten_ - 1) % stripRows_ + 1;
+  pendingReady_ = true;
+  lock.unlock();
+  changed_.notify_all();
+}
 
-    // LEN (Little Endian)
-    zlibData.push_back(chunkLen & 0xFF);
-    zlibData.push_back((chunkLen >> 8) & 0xFF);
+void PngEncoder::Stream::run() {
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      changed_.wait(lock, [this] { return pendingReady_ || closing_; });
+      if (!pendingReady_)
+        return;
+    }
 
-    // NLEN (Little Endian)
-    uint16_t nlen = ~((uint16_t)chunkLen);
-    zlibData.push_back(nlen & 0xFF);
-    zlibData.push_back((nlen >> 8) & 0xFF);
+    try {
+      encodeStrip();
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      error_ = std::current_exception();
+    }
 
-    // Data
-    zlibData.insert(zlibData.end(), rawData.begin() + pos,
-                    rawData.begin() + pos + chunkLen);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pendingReady_ = false;
+    }
+    changed_.notify_all();
+    if (error_)
+      return;
+  }
+}
 
-    pos += chunkLen;
+void PngEncoder::Stream::encodeStrip() {
+  {
+    Stats::ScopedTimer timer(Stats::FILTER);
+    size_t filtered = input_.size();
+    input_.resize(filtered + pendingRows_ * (stride_ + 1));
+    for (int y = 0; y < pendingRows_; ++y) {
+      const uint8_t *row = &pending_[y * stride_];
+      filterScanline(row, prevRow_.data(), stride_, channels_, filter_,
+                     candidates_.data(),
+                     &input_[filtered + y * (stride_ + 1)]);
+      std::memcpy(prevRow_.data(), row, stride_);
+    }
+  }
+
+  if (input_.size() - history_ >= DeflateEncoder::SEGMENT_SIZE) {
+    compress(DeflateEncoder::NO_FLUSH);
+    writeIdat(false);
   }
+}
 
-  // Adler32 Checksum of raw data (not zlib wrapped)
-  uint32_t adler = Checksum::adler32(rawData.data(), rawData.size());
-  zlibData.push_back((adler >> 24) & 0xFF);
-  zlibData.push_back((adler >> 16) & 0xFF);
-  zlibData.push_back((adler >> 8) & 0xFF);
-  zlibData.push_back(adler & 0xFF);
+void PngEncoder::Stream::compress(DeflateEncoder::Flush flush) {
+  Stats::ScopedTimer timer(Stats::DEFLATE);
+  const uint8_t *data = input_.data() + history_;
+  size_t size = input_.size() - history_;
+  deflate_.compress(data, size, history_, flush, zlib_);
+  adler_ = Checksum::adler32(data, size, adler_);
 
-  writeChunk(file, "IDAT", zlibData);
+  // Keep the last 32 KiB as the dictionary for the next piece
+  size_t keep = std::min<size_t>(input_.size(), 32768);
+  input_.erase(input_.begin(), input_.end() - keep);
+  history_ = keep;
 }
 
-void PngEncoder::writeIEND(std::ofstream &file) {
-  writeChunk(file, "IEND", {});
+void PngEncoder::Stream::writeIdat(bool all) {
+  size_t pos = 0;
+  while (zlib_.size() - pos >= IDAT_SIZE ||
+         (all && pos < zlib_.size())) {
+    size_t size = std::min(IDAT_SIZE, zlib_.size() - pos);
+    writeChunk(out_, "IDAT", &zlib_[pos], size);
+    pos += size;
+  }
+  zlib_.erase(zlib_.begin(), zlib_.begin() + pos);
 }
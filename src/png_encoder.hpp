@@ -1,23 +1,124 @@
 #ifndef PNG_ENCODER_HPP
 #define PNG_ENCODER_HPP
 
+#include "deflate_encoder.hpp"
 #include "image.hpp"
+#include "utils/byte_writer.hpp"
+#include <condition_variable>
 #include <cstdint>
+#include <exception>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
+class ThreadPool;
+
 class PngEncoder {
 public:
-  // Encodes the image to a PNG file (uncompressed)
+  // How the filter type of each scanline is chosen
+  enum FilterHeuristic {
+    FILTER_NONE,    // Always filter type 0
+    FILTER_MIN_SUM, // Smallest sum of absolute residuals
+    FILTER_ENTROPY  // Lowest byte entropy of the residuals
+  };
+
+  struct Options {
+    int level = 6; // DEFLATE level, 0 (store) to 9 (smallest)
+    FilterHeuristic filter = FILTER_MIN_SUM;
+    int threads = 1; // Filter and compress on this many threads; 0 = all
+  };
+
+  // Encodes the image to a PNG file
   static void encode(const Image &img, const std::string &filepath);
+  static void encode(const Image &img, const std::string &filepath,
+                     const Options &options);
+  // Encodes to memory or any other destination
+  static void encode(const Image &img, ByteWriter &out);
+  static void encode(const Image &img, ByteWriter &out,
+                     const Options &options);
+
+  // Incremental encoder with bounded memory. Scanlines are pushed in order
+  // and collected into strips of about STRIP_BYTES; a worker thread filters
+  // each strip while the caller fills the next, compresses the filtered
+  // data in SEGMENT_SIZE pieces that each see the 32 KiB before them, and
+  // writes IDAT chunks of IDAT_SIZE bytes as they fill up. options.threads
+  // is ignored.
+  class Stream {
+  public:
+    // Writes the signature and IHDR to `out`, which must outlive the stream
+    Stream(ByteWriter &out, int width, int height, int channels,
+           const Options &options);
+    ~Stream();
+
+    // Adds the next scanline of width * channels bytes
+    void writeRow(const uint8_t *row);
+    // Compresses the last strip and writes the rest of the PNG; every
+    // scanline must have been written
+    void finish();
+
+  private:
+    void submitStrip();
+    void run(); // Worker thread
+    void encodeStrip();
+    // Compresses the filtered data after the history in input_
+    void compress(DeflateEncoder::Flush flush);
+    // Writes whole IDAT chunks from zlib_, and with `all` the remainder
+    void writeIdat(bool all);
+
+    ByteWriter &out_;
+    FilterHeuristic filter_;
+    int channels_;
+    size_t stride_;
+    int height_;
+    int stripRows_;
+    int rowsWritten_ = 0;
+
+    // filling_ collects scanlines; pending_ is the strip the worker filters
+    std::vector<uint8_t> filling_;
+    std::vector<uint8_t> pending_;
+    int pendingRows_ = 0;
+    bool pendingReady_ = false;
+    bool closing_ = false;
+    std::exception_ptr error_;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::thread worker_;
+
+    // Worker state
+    DeflateEncoder deflate_;
+    std::vector<uint8_t> prevRow_;
+    std::vector<uint8_t> candidates_;
+    std::vector<uint8_t> input_; // Up to 32 KiB of compressed history, then
+                                 // filtered data not yet compressed
+    size_t history_ = 0;
+    uint32_t adler_ = 1;
+    std::vector<uint8_t> zlib_; // Compressed bytes not yet in an IDAT
+  };
 
 private:
-  static void writeChunk(std::ofstream &file, const char *type,
-                         const std::vector<uint8_t> &data);
-  static void writeIHDR(std::ofstream &file, int width, int height,
+  static constexpr size_t STRIP_BYTES = 64 * 1024;
+  static constexpr size_t IDAT_SIZE = 64 * 1024;
+
+  static void writeChunk(ByteWriter &out, const char *type,
+                         const uint8_t *data, size_t size);
+  static void writeIHDR(ByteWriter &out, int width, int height,
                         int channels);
-  static void writeIDAT(std::ofstream &file, const Image &img);
-  static void writeIEND(std::ofstream &file);
+  static void writeIDAT(ByteWriter &out, const Image &img,
+                        const Options &options);
+
+  // Filters every scanline and prefixes it with its filter type byte
+  static std::vector<uint8_t> filterScanlines(const Image &img,
+                                              FilterHeuristic heuristic,
+                                              ThreadPool &pool);
+  // Filters one scanline into `out` (filter type byte, then rowSize bytes)
+  // with the filter the heuristic picks. `candidates` is scratch space for
+  // 5 * rowSize bytes, unused with FILTER_NONE.
+  static void filterScanline(const uint8_t *row, const uint8_t *prev,
+                             size_t rowSize, int channels,
+                             FilterHeuristic heuristic, uint8_t *candidates,
+                             uint8_t *out);
+  static void writeIEND(ByteWriter &out);
 };
 
 #endif // PNG_ENCODER_HPP
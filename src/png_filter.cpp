@@ -0,0 +1,440 @@
+#include "png_filter.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) &&        \
+    defined(__SSE2__)
+#define PNG_FILTER_X86 1
+#include <immintrin.h>
+#endif
+
+uint8_t PngFilter::paethPredictor(uint8_t a, uint8_t b, uint8_t c) {
+  int p = (int)a + (int)b - (int)c;
+  int pa = std::abs(p - (int)a);
+  int pb = std::abs(p - (int)b);
+  int pc = std::abs(p - (int)c);
+
+  if (pa <= pb && pa <= pc)
+    return a;
+  if (pb <= pc)
+    return b;
+  return c;
+}
+
+namespace {
+
+// All kernels share one signature; `bpp` is only read by the generic ones.
+// Every kernel walks the row forwards and reads a byte of `src` before the
+// matching byte of `dst` is written, which is what makes dst <= src safe.
+using UnfilterFn = void (*)(uint8_t *dst, const uint8_t *src,
+                            const uint8_t *prev, size_t stride, int bpp);
+
+// ============================================================================
+// Scalar kernels (BPP = 0 reads the pixel size at runtime)
+// ============================================================================
+
+void unfilterNone(uint8_t *dst, const uint8_t *src, const uint8_t *, size_t stride,
+                  int) {
+  if (dst != src)
+    std::memmove(dst, src, stride);
+}
+
+template <int BPP>
+void unfilterSubScalar(uint8_t *dst, const uint8_t *src, const uint8_t *,
+                       size_t stride, int bpp) {
+  const size_t n = BPP ? BPP : bpp;
+  for (size_t i = 0; i < n && i < stride; ++i)
+    dst[i] = src[i];
+  for (size_t i = n; i < stride; ++i)
+    dst[i] = src[i] + dst[i - n];
+}
+
+void unfilterUpScalar(uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+                      size_t stride, int) {
+  for (size_t i = 0; i < stride; ++i)
+    dst[i] = src[i] + prev[i];
+}
+
+template <int BPP>
+void unfilterAverageScalar(uint8_t *dst, const uint8_t *src,
+                           const uint8_t *prev, size_t stride, int bpp) {
+  const size_t n = BPP ? BPP : bpp;
+  for (size_t i = 0; i < n && i < stride; ++i)
+    dst[i] = src[i] + (prev[i] >> 1);
+  for (size_t i = n; i < stride; ++i)
+    dst[i] = src[i] + ((dst[i - n] + prev[i]) >> 1);
+}
+
+template <int BPP>
+void unfilterPaethScalar(uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+                         size_t stride, int bpp) {
+  const size_t n = BPP ? BPP : bpp;
+  // With a = c = 0 the predictor always picks b
+  for (size_t i = 0; i < n && i < stride; ++i)
+    dst[i] = src[i] + prev[i];
+  for (size_t i = n; i < stride; ++i)
+    dst[i] = src[i] + PngFilter::paethPredictor(dst[i - n], prev[i],
+                                                prev[i - n]);
+}
+
+#ifdef PNG_FILTER_X86
+// ============================================================================
+// x86 kernels. SSE2 is part of the x86-64 baseline; SSSE3 and AVX2 variants
+// are compiled with target attributes and only called after a CPU check.
+// ============================================================================
+
+template <int BPP> inline __m128i loadPixel(const uint8_t *p) {
+  uint32_t v = 0;
+  std::memcpy(&v, p, BPP);
+  return _mm_cvtsi32_si128(static_cast<int>(v));
+}
+
+template <int BPP> inline void storePixel(uint8_t *p, __m128i v) {
+  uint32_t out = static_cast<uint32_t>(_mm_cvtsi128_si32(v));
+  std::memcpy(p, &out, BPP);
+}
+
+void unfilterUpSse2(uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+                    size_t stride, int) {
+  size_t i = 0;
+  for (; i + 16 <= stride; i += 16) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(prev + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_add_epi8(x, b));
+  }
+  for (; i < stride; ++i)
+    dst[i] = src[i] + prev[i];
+}
+
+__attribute__((target("avx2"))) void
+unfilterUpAvx2(uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+               size_t stride, int) {
+  size_t i = 0;
+  for (; i + 32 <= stride; i += 32) {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(prev + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i),
+                        _mm256_add_epi8(x, b));
+  }
+  for (; i < stride; ++i)
+    dst[i] = src[i] + prev[i];
+}
+
+// Sub on 4-byte pixels: a log-step prefix sum over the four pixels of a
+// 16-byte vector, plus the last reconstructed pixel broadcast to all lanes.
+void unfilterSub4Sse2(uint8_t *dst, const uint8_t *src, const uint8_t *,
+                      size_t stride, int) {
+  __m128i a = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= stride; i += 16) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+    x = _mm_add_epi8(x, a);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), x);
+    a = _mm_shuffle_epi32(x, 0xFF);
+  }
+  for (; i < stride; i += 4) {
+    a = _mm_add_epi8(a, loadPixel<4>(src + i));
+    storePixel<4>(dst + i, a);
+  }
+}
+
+// Sub on 3-byte pixels: four pixels (12 bytes) per step. Only 12 bytes are
+// stored so an in-place caller never sees input it has not read yet.
+__attribute__((target("ssse3"))) void
+unfilterSub3Ssse3(uint8_t *dst, const uint8_t *src, const uint8_t *,
+                  size_t stride, int) {
+  const __m128i lastPixel =
+      _mm_setr_epi8(9, 10, 11, 9, 10, 11, 9, 10, 11, 9, 10, 11, -1, -1, -1, -1);
+  __m128i a = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= stride; i += 12) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 3));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 6));
+    x = _mm_add_epi8(x, a);
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(dst + i), x);
+    storePixel<4>(dst + i + 8, _mm_srli_si128(x, 8));
+    a = _mm_shuffle_epi8(x, lastPixel);
+  }
+  // `a` holds the last pixel in its low three bytes
+  for (; i < stride; i += 3) {
+    a = _mm_add_epi8(a, loadPixel<3>(src + i));
+    storePixel<3>(dst + i, a);
+  }
+}
+
+void unfilterSub3Sse2(uint8_t *dst, const uint8_t *src, const uint8_t *,
+                      size_t stride, int) {
+  __m128i a = _mm_setzero_si128();
+  for (size_t i = 0; i < stride; i += 3) {
+    a = _mm_add_epi8(a, loadPixel<3>(src + i));
+    storePixel<3>(dst + i, a);
+  }
+}
+
+// Average: one pixel per step. _mm_avg_epu8 rounds up, so subtract the
+// carry bit ((a ^ b) & 1) to get the floor PNG requires.
+template <int BPP>
+void unfilterAverageSse2(uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+                         size_t stride, int) {
+  const __m128i one = _mm_set1_epi8(1);
+  __m128i a = _mm_setzero_si128();
+  for (size_t i = 0; i < stride; i += BPP) {
+    __m128i b = loadPixel<BPP>(prev + i);
+    __m128i avg = _mm_avg_epu8(a, b);
+    avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), one));
+    a = _mm_add_epi8(avg, loadPixel<BPP>(src + i));
+    storePixel<BPP>(dst + i, a);
+  }
+}
+
+inline __m128i abs16(__m128i x) {
+  return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+inline __m128i select(__m128i mask, __m128i a, __m128i b) {
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// Paeth: one pixel per step in 16-bit lanes. With p = a + b - c the three
+// distances reduce to |b - c|, |a - c| and |a + b - 2c|.
+template <int BPP>
+void unfilterPaethSse2(uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+                       size_t stride, int) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, c = zero;
+  for (size_t i = 0; i < stride; i += BPP) {
+    __m128i b = _mm_unpacklo_epi8(loadPixel<BPP>(prev + i), zero);
+    __m128i x = _mm_unpacklo_epi8(loadPixel<BPP>(src + i), zero);
+
+    __m128i pa = _mm_sub_epi16(b, c);
+    __m128i pb = _mm_sub_epi16(a, c);
+    __m128i pc = _mm_add_epi16(pa, pb);
+    pa = abs16(pa);
+    pb = abs16(pb);
+    pc = abs16(pc);
+
+    __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    __m128i nearest =
+        select(_mm_cmpeq_epi16(smallest, pa), a,
+               select(_mm_cmpeq_epi16(smallest, pb), b, c));
+
+    // Byte-wise add wraps modulo 256 and leaves the high bytes zero
+    a = _mm_add_epi8(nearest, x);
+    storePixel<BPP>(dst + i, _mm_packus_epi16(a, a));
+    c = b;
+  }
+}
+#endif // PNG_FILTER_X86
+
+// [filter type][0: any pixel size, 1: 3 bytes, 2: 4 bytes]
+struct UnfilterKernels {
+  UnfilterFn fn[5][3];
+
+  UnfilterKernels() {
+    for (auto &row : fn)
+      row[0] = row[1] = row[2] = unfilterNone;
+    set(PngFilter::SUB, unfilterSubScalar<0>, unfilterSubScalar<3>,
+        unfilterSubScalar<4>);
+    set(PngFilter::UP, unfilterUpScalar, unfilterUpScalar, unfilterUpScalar);
+    set(PngFilter::AVERAGE, unfilterAverageScalar<0>,
+        unfilterAverageScalar<3>, unfilterAverageScalar<4>);
+    set(PngFilter::PAETH, unfilterPaethScalar<0>, unfilterPaethScalar<3>,
+        unfilterPaethScalar<4>);
+
+#ifdef PNG_FILTER_X86
+    set(PngFilter::SUB, unfilterSubScalar<0>, unfilterSub3Sse2,
+        unfilterSub4Sse2);
+    set(PngFilter::UP, unfilterUpSse2, unfilterUpSse2, unfilterUpSse2);
+    set(PngFilter::AVERAGE, unfilterAverageScalar<0>,
+        unfilterAverageSse2<3>, unfilterAverageSse2<4>);
+    set(PngFilter::PAETH, unfilterPaethScalar<0>, unfilterPaethSse2<3>,
+        unfilterPaethSse2<4>);
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+      fn[PngFilter::SUB][1] = unfilterSub3Ssse3;
+    if (__builtin_cpu_supports("avx2"))
+      set(PngFilter::UP, unfilterUpAvx2, unfilterUpAvx2, unfilterUpAvx2);
+#endif
+  }
+
+  void set(int type, UnfilterFn any, UnfilterFn bpp3, UnfilterFn bpp4) {
+    fn[type][0] = any;
+    fn[type][1] = bpp3;
+    fn[type][2] = bpp4;
+  }
+};
+
+// ============================================================================
+// Forward filters. Each returns the row's filter cost (see filterRow). The
+// first pixel has no left neighbour and is handled by the scalar prologue.
+// ============================================================================
+
+using FilterFn = uint64_t (*)(uint8_t *dst, const uint8_t *src,
+                              const uint8_t *prev, size_t stride, int bpp);
+
+inline uint32_t signedMagnitude(uint8_t r) { return r < 128 ? r : 256 - r; }
+
+template <int TYPE>
+inline uint8_t residual(const uint8_t *src, const uint8_t *prev, size_t i,
+                        size_t n) {
+  uint8_t a = i >= n ? src[i - n] : 0;
+  uint8_t c = i >= n ? prev[i - n] : 0;
+  switch (TYPE) {
+  case PngFilter::SUB:
+    return src[i] - a;
+  case PngFilter::UP:
+    return src[i] - prev[i];
+  case PngFilter::AVERAGE:
+    return src[i] - ((a + prev[i]) >> 1);
+  case PngFilter::PAETH:
+    return src[i] - PngFilter::paethPredictor(a, prev[i], c);
+  default:
+    return src[i];
+  }
+}
+
+template <int TYPE>
+uint64_t filterScalar(uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+                      size_t stride, int bpp) {
+  uint64_t cost = 0;
+  for (size_t i = 0; i < stride; ++i) {
+    dst[i] = residual<TYPE>(src, prev, i, bpp);
+    cost += signedMagnitude(dst[i]);
+  }
+  return cost;
+}
+
+#ifdef PNG_FILTER_X86
+// |r| for bytes read as signed: min(r, -r) as unsigned
+inline __m128i signedMagnitude(__m128i r) {
+  return _mm_min_epu8(r, _mm_sub_epi8(_mm_setzero_si128(), r));
+}
+
+inline uint64_t horizontalSum(__m128i sums) {
+  uint64_t lanes[2];
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), sums);
+  return lanes[0] + lanes[1];
+}
+
+// Paeth prediction for 8 pixels bytes widened to 16-bit lanes
+inline __m128i paethPredict16(__m128i a, __m128i b, __m128i c) {
+  __m128i pa = _mm_sub_epi16(b, c);
+  __m128i pb = _mm_sub_epi16(a, c);
+  __m128i pc = _mm_add_epi16(pa, pb);
+  pa = abs16(pa);
+  pb = abs16(pb);
+  pc = abs16(pc);
+  __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+  return select(_mm_cmpeq_epi16(smallest, pa), a,
+                select(_mm_cmpeq_epi16(smallest, pb), b, c));
+}
+
+template <int TYPE>
+uint64_t filterSse2(uint8_t *dst, const uint8_t *src, const uint8_t *prev,
+                    size_t stride, int bpp) {
+  const __m128i zero = _mm_setzero_si128();
+  const size_t n = TYPE == PngFilter::NONE || TYPE == PngFilter::UP
+                       ? 0
+                       : std::min<size_t>(bpp, stride);
+  uint64_t cost = 0;
+  for (size_t i = 0; i < n; ++i) {
+    dst[i] = residual<TYPE>(src, prev, i, bpp);
+    cost += signedMagnitude(dst[i]);
+  }
+
+  __m128i sums = zero;
+  size_t i = n;
+  for (; i + 16 <= stride; i += 16) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    __m128i r;
+    if (TYPE == PngFilter::NONE) {
+      r = x;
+    } else if (TYPE == PngFilter::UP) {
+      __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(prev + i));
+      r = _mm_sub_epi8(x, b);
+    } else {
+      __m128i a =
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i - bpp));
+      __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(prev + i));
+      if (TYPE == PngFilter::SUB) {
+        r = _mm_sub_epi8(x, a);
+      } else if (TYPE == PngFilter::AVERAGE) {
+        __m128i avg = _mm_avg_epu8(a, b);
+        avg = _mm_sub_epi8(
+            avg, _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+        r = _mm_sub_epi8(x, avg);
+      } else {
+        __m128i c =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(prev + i - bpp));
+        __m128i lo = paethPredict16(_mm_unpacklo_epi8(a, zero),
+                                    _mm_unpacklo_epi8(b, zero),
+                                    _mm_unpacklo_epi8(c, zero));
+        __m128i hi = paethPredict16(_mm_unpackhi_epi8(a, zero),
+                                    _mm_unpackhi_epi8(b, zero),
+                                    _mm_unpackhi_epi8(c, zero));
+        r = _mm_sub_epi8(x, _mm_packus_epi16(lo, hi));
+      }
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), r);
+    sums = _mm_add_epi64(sums, _mm_sad_epu8(signedMagnitude(r), zero));
+  }
+  cost += horizontalSum(sums);
+
+  for (; i < stride; ++i) {
+    dst[i] = residual<TYPE>(src, prev, i, bpp);
+    cost += signedMagnitude(dst[i]);
+  }
+  return cost;
+}
+#endif // PNG_FILTER_X86
+
+struct FilterKernels {
+  FilterFn fn[5];
+
+  FilterKernels() {
+#ifdef PNG_FILTER_X86
+    fn[PngFilter::NONE] = filterSse2<PngFilter::NONE>;
+    fn[PngFilter::SUB] = filterSse2<PngFilter::SUB>;
+    fn[PngFilter::UP] = filterSse2<PngFilter::UP>;
+    fn[PngFilter::AVERAGE] = filterSse2<PngFilter::AVERAGE>;
+    fn[PngFilter::PAETH] = filterSse2<PngFilter::PAETH>;
+#else
+    fn[PngFilter::NONE] = filterScalar<PngFilter::NONE>;
+    fn[PngFilter::SUB] = filterScalar<PngFilter::SUB>;
+    fn[PngFilter::UP] = filterScalar<PngFilter::UP>;
+    fn[PngFilter::AVERAGE] = filterScalar<PngFilter::AVERAGE>;
+    fn[PngFilter::PAETH] = filterScalar<PngFilter::PAETH>;
+#endif
+  }
+};
+
+} // namespace
+
+void PngFilter::unfilterRow(uint8_t filterType, uint8_t *dst,
+                            const uint8_t *src, const uint8_t *prev,
+                            size_t stride, int bytesPerPixel) {
+  static const UnfilterKernels kernels;
+
+  if (filterType > PAETH)
+    throw std::runtime_error("Invalid filter type");
+
+  int variant = bytesPerPixel == 3 ? 1 : (bytesPerPixel == 4 ? 2 : 0);
+  kernels.fn[filterType][variant](dst, src, prev, stride, bytesPerPixel);
+}
+
+uint64_t PngFilter::filterRow(uint8_t filterType, uint8_t *dst,
+                              const uint8_t *src, const uint8_t *prev,
+                              size_t stride, int bytesPerPixel) {
+  static const FilterKernels kernels;
+
+  if (filterType > PAETH)
+    throw std::runtime_error("Invalid filter type");
+
+  return kernels.fn[filterType](dst, src, prev, stride, bytesPerPixel);
+}
@@ -0,0 +1,35 @@
+#ifndef PNG_FILTER_HPP
+#define PNG_FILTER_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+// PNG scanline filters (RFC 2083, section 6). Unfilter kernels are
+// specialized for 3- and 4-byte pixels and picked once per process:
+// SSE2/SSSE3/AVX2 where the CPU supports them, portable scalar code
+// everywhere else. Forward filters have no serial dependency and run 16
+// bytes at a time for any pixel size.
+class PngFilter {
+public:
+  enum Type : uint8_t { NONE = 0, SUB = 1, UP = 2, AVERAGE = 3, PAETH = 4 };
+
+  // Reverse `filterType` on one scanline of `stride` bytes. `prev` is the
+  // previous reconstructed row (all zeros for the first row) and must not
+  // overlap the current one. `dst` may alias `src` or lie before it in the
+  // same buffer, so callers can unfilter and compact rows in place.
+  static void unfilterRow(uint8_t filterType, uint8_t *dst, const uint8_t *src,
+                          const uint8_t *prev, size_t stride,
+                          int bytesPerPixel);
+
+  // Apply `filterType` to one scanline of raw pixels. `prev` is the previous
+  // raw row (all zeros for the first row); `dst` must not overlap either
+  // input. Returns the sum of the filtered bytes taken as signed magnitudes,
+  // the usual minimum-sum-of-absolute-differences cost for choosing filters.
+  static uint64_t filterRow(uint8_t filterType, uint8_t *dst,
+                            const uint8_t *src, const uint8_t *prev,
+                            size_t stride, int bytesPerPixel);
+
+  static uint8_t paethPredictor(uint8_t a, uint8_t b, uint8_t c);
+};
+
+#endif // PNG_FILTER_HPP
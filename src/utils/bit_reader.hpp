@@ -1,70 +1,218 @@
 #ifndef BIT_READER_HPP
 #define BIT_READER_HPP
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <functional>
 #include <stdexcept>
 #include <vector>
 
+// LSB-first bit reader for DEFLATE. Bits are held in a 64-bit accumulator
+// that is refilled a whole word at a time, so peek/consume/readBits are a
+// shift and a mask in the common case. Near the end of the buffer the
+// refill falls back to loading single bytes.
 class BitReader {
 public:
+  // Supplies the next buffer once the current one is used up; returns false
+  // at the end of the stream. Lets one reader run across several PNG IDAT
+  // chunks without concatenating them.
+  using Source = std::function<bool(const uint8_t *&data, size_t &size)>;
+
   BitReader(const uint8_t *data, size_t size)
-      : data_(data), size_(size), byte_offset_(0), bit_offset_(0) {}
+      : data_(data), size_(size), pos_(0), buffer_(0), bit_count_(0) {}
+
+  void setSource(Source source) { source_ = std::move(source); }
+
+  // Return the next n bits (n <= 32) without consuming them. Bits past the
+  // end of the stream read as zero so table lookups near the end are safe;
+  // consume() still rejects consuming them.
+  uint32_t peek(int n) {
+    if (bit_count_ < n)
+      refill();
+    return static_cast<uint32_t>(buffer_ & ((uint64_t(1) << n) - 1));
+  }
+
+  // Drop n bits previously made available by peek()
+  void consume(int n) {
+    if (n > bit_count_)
+      throw std::out_of_range("End of stream");
+    buffer_ >>= n;
+    bit_count_ -= n;
+  }
 
-  // Read n bits (LSB first for DEFLATE)
+  // Read n bits (LSB first for DEFLATE), n <= 32
   uint32_t readBits(int n) {
-    if (n > 32)
-      throw std::invalid_argument("Cannot read more than 32 bits");
-    uint32_t result = 0;
-    for (int i = 0; i < n; ++i) {
-      if (byte_offset_ >= size_) {
-        throw std::out_of_range("End of stream");
-      }
-      uint8_t byte = data_[byte_offset_];
-      if ((byte >> bit_offset_) & 1) {
-        result |= (1 << i);
-      }
-      bit_offset_++;
-      if (bit_offset_ == 8) {
-        bit_offset_ = 0;
-        byte_offset_++;
-      }
-    }
+    uint32_t result = peek(n);
+    consume(n);
     return result;
   }
 
-  void advanceBits(int n) {
-    for (int i = 0; i < n; ++i) {
-      if (byte_offset_ >= size_) {
-        // Depending on spec, might allow advancing past end if not reading?
-        // For safety, let's throw or clamp. Throwing is safer for now.
+  // Align to the next byte boundary
+  void alignToByte() { consume(bit_count_ & 7); }
+
+  // Copy n whole bytes out of a byte-aligned stream. Bytes still held in
+  // the accumulator are drained first, the rest is a straight memcpy.
+  void readBytes(uint8_t *dst, size_t n) {
+    while (n > 0 && bit_count_ >= 8) {
+      *dst++ = static_cast<uint8_t>(buffer_);
+      buffer_ >>= 8;
+      bit_count_ -= 8;
+      --n;
+    }
+    while (n > 0) {
+      if (pos_ == size_ && !nextBuffer())
         throw std::out_of_range("End of stream");
-      }
-      bit_offset_++;
-      if (bit_offset_ == 8) {
-        bit_offset_ = 0;
-        byte_offset_++;
-      }
+      size_t take = std::min(n, size_ - pos_);
+      std::memcpy(dst, data_ + pos_, take);
+      pos_ += take;
+      dst += take;
+      n -= take;
     }
+    // The accumulator may hold look-ahead bits of bytes we just skipped
+    buffer_ = 0;
+    bit_count_ = 0;
   }
 
-  // Align to the next byte boundary
-  void alignToByte() {
-    if (bit_offset_ != 0) {
-      bit_offset_ = 0;
-      byte_offset_++;
+  bool hasMore() const { return bit_count_ > 0 || pos_ < size_; }
+
+  // Offset of the byte holding the next unread bit
+  size_t getByteOffset() const { return (pos_ * 8 - bit_count_) / 8; }
+
+private:
+  void refill() {
+    if (size_ - pos_ >= 8) {
+      uint64_t word;
+      std::memcpy(&word, data_ + pos_, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      word = __builtin_bswap64(word);
+#endif
+      // Bits of a partially loaded byte land above bit_count_ too; they are
+      // the true stream bits, so OR-ing them again on the next refill is
+      // harmless.
+      buffer_ |= word << bit_count_;
+      int bytes = (63 - bit_count_) >> 3;
+      pos_ += bytes;
+      bit_count_ += bytes * 8;
+    } else {
+      // Safe tail path: one byte at a time up to the end of the buffer
+      while (bit_count_ <= 56) {
+        if (pos_ == size_ && !nextBuffer())
+          break;
+        buffer_ |= static_cast<uint64_t>(data_[pos_++]) << bit_count_;
+        bit_count_ += 8;
+      }
     }
   }
 
-  bool hasMore() const { return byte_offset_ < size_; }
+  bool nextBuffer() {
+    if (!source_)
+      return false;
+    const uint8_t *data;
+    size_t size;
+    do {
+      if (!source_(data, size))
+        return false;
+    } while (size == 0);
+    data_ = data;
+    size_ = size;
+    pos_ = 0;
+    return true;
+  }
+
+  const uint8_t *data_;
+  size_t size_;
+  size_t pos_; // Next byte to load into the accumulator
+  uint64_t buffer_;
+  int bit_count_; // Valid bits in buffer_
+  Source source_;
+};
+
+// MSB-first bit reader for JPEG entropy-coded data. Works like BitReader:
+// a 64-bit accumulator, here filled from the top, with 0xFF00 stuffing
+// removed while refilling so peek/consume never see it. At a marker (or
+// the end of the data) refilling stops and zero bits are supplied instead;
+// consuming any of them means the scan was truncated.
+class JpegBitReader {
+public:
+  JpegBitReader(const uint8_t *data, size_t size)
+      : data_(data), size_(size), pos_(0), buffer_(0), bit_count_(0),
+        pad_bits_(0), at_marker_(false) {}
+
+  // Return the next n bits (1 <= n <= 32) without consuming them
+  uint32_t peek(int n) {
+    if (bit_count_ < n)
+      refill();
+    return static_cast<uint32_t>(buffer_ >> (64 - n));
+  }
+
+  // Drop n bits (n <= 32) previously made available by peek()
+  void consume(int n) {
+    buffer_ <<= n;
+    bit_count_ -= n;
+    if (bit_count_ < pad_bits_)
+      throw std::runtime_error("Stream ended unexpectedly");
+  }
 
-  size_t getByteOffset() const { return byte_offset_; }
+  // Read n bits, 0 <= n <= 16
+  int readBits(int n) {
+    if (n == 0)
+      return 0;
+    int result = static_cast<int>(peek(n));
+    consume(n);
+    return result;
+  }
 
 private:
+  void refill() {
+    if (!at_marker_ && size_ - pos_ >= 8) {
+      uint64_t word;
+      std::memcpy(&word, data_ + pos_, 8);
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ != __ORDER_BIG_ENDIAN__
+      word = __builtin_bswap64(word);
+#endif
+      // Without a 0xFF in the next eight bytes there is nothing to unstuff,
+      // so load as many whole bytes as fit. As in BitReader, the partial
+      // byte below bit_count_ is true stream data and gets OR-ed again.
+      const uint64_t ones = 0x0101010101010101ULL;
+      if ((((~word) - ones) & word & (ones << 7)) == 0) {
+        buffer_ |= word >> bit_count_;
+        int bytes = (63 - bit_count_) >> 3;
+        pos_ += bytes;
+        bit_count_ += bytes * 8;
+        return;
+      }
+    }
+
+    while (bit_count_ <= 56) {
+      uint64_t byte = 0;
+      if (at_marker_) {
+        pad_bits_ += 8;
+      } else if (pos_ < size_ && data_[pos_] != 0xFF) {
+        byte = data_[pos_++];
+      } else if (pos_ + 1 < size_ && data_[pos_ + 1] == 0x00) {
+        byte = 0xFF; // Stuffed 0xFF00
+        pos_ += 2;
+      } else if (pos_ + 1 < size_ && data_[pos_ + 1] == 0xFF) {
+        ++pos_; // Fill byte ahead of a marker
+        continue;
+      } else {
+        at_marker_ = true; // A marker or the end of the data
+        continue;
+      }
+      buffer_ |= byte << (56 - bit_count_);
+      bit_count_ += 8;
+    }
+  }
+
   const uint8_t *data_;
   size_t size_;
-  size_t byte_offset_;
-  int bit_offset_;
+  size_t pos_; // Next byte to load into the accumulator
+  uint64_t buffer_;
+  int bit_count_; // Valid bits at the top of buffer_, padding included
+  int pad_bits_;  // Zero bits supplied past a marker or the end of data
+  bool at_marker_;
 };
 
 #endif // BIT_READER_HPP
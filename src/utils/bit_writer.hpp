@@ -32,6 +32,13 @@ public:
     buffer_.push_back(marker);
   }
 
+  // Append already encoded bytes as they are, without stuffing; used to
+  // join separately encoded restart segments. Aligns first.
+  void writeBytes(const uint8_t *data, size_t size) {
+    alignToByte();
+    buffer_.insert(buffer_.end(), data, data + size);
+  }
+
   void alignToByte() {
     if (bit_count_ > 0) {
       // Pad with 1s for JPEG
@@ -42,6 +49,13 @@ public:
     }
   }
 
+  // Move the completed bytes to the end of `out`. Bits of a partial byte
+  // stay in the writer.
+  void takeBytes(std::vector<uint8_t> &out) {
+    out.insert(out.end(), buffer_.begin(), buffer_.end());
+    buffer_.clear();
+  }
+
   std::vector<uint8_t> getData() {
     // Make sure we are aligned (though usually caller should have called
     // writeMarker(EOI) which aligns) If not aligned, align now.
@@ -72,4 +86,56 @@ private:
   bool byte_stuffing_;
 };
 
+// LSB-first bit writer for DEFLATE. Bits collect in a 64-bit accumulator
+// and leave it four bytes at a time.
+class DeflateBitWriter {
+public:
+  DeflateBitWriter() : bits_(0), bit_count_(0) {}
+
+  // Write the low n bits of value (n <= 32), LSB first
+  void writeBits(uint32_t value, int n) {
+    bits_ |= static_cast<uint64_t>(value) << bit_count_;
+    bit_count_ += n;
+    if (bit_count_ >= 32) {
+      for (int i = 0; i < 4; ++i) {
+        buffer_.push_back(static_cast<uint8_t>(bits_));
+        bits_ >>= 8;
+      }
+      bit_count_ -= 32;
+    }
+  }
+
+  // Pad with zero bits to the next byte boundary
+  void alignToByte() {
+    bit_count_ = (bit_count_ + 7) & ~7;
+    while (bit_count_ > 0) {
+      buffer_.push_back(static_cast<uint8_t>(bits_));
+      bits_ >>= 8;
+      bit_count_ -= 8;
+    }
+    bits_ = 0;
+  }
+
+  // Append raw bytes; the writer must be byte aligned
+  void writeBytes(const uint8_t *data, size_t n) {
+    buffer_.insert(buffer_.end(), data, data + n);
+  }
+
+  // Move the completed bytes to the end of `out`. Bits of a partial byte
+  // stay in the writer.
+  void takeBytes(std::vector<uint8_t> &out) {
+    if (out.empty()) {
+      out.swap(buffer_);
+    } else {
+      out.insert(out.end(), buffer_.begin(), buffer_.end());
+    }
+    buffer_.clear();
+  }
+
+private:
+  std::vector<uint8_t> buffer_;
+  uint64_t bits_;
+  int bit_count_;
+};
+
 #endif // BIT_WRITER_HPP
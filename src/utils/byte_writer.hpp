@@ -0,0 +1,90 @@
+#ifndef BYTE_WRITER_HPP
+#define BYTE_WRITER_HPP
+
+#include "stats.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Destination for encoded output. The encoders hand it runs of finished
+// bytes in order; files, growable vectors and fixed caller-owned buffers
+// are covered below, and services can implement write() to send the bytes
+// anywhere else.
+class ByteWriter {
+public:
+  virtual ~ByteWriter() = default;
+  virtual void write(const uint8_t *data, size_t size) = 0;
+};
+
+class FileByteWriter : public ByteWriter {
+public:
+  explicit FileByteWriter(const std::string &path)
+      : file_(path, std::ios::binary), path_(path) {
+    if (!file_)
+      throw std::runtime_error("Could not open file for writing: " + path);
+  }
+
+  void write(const uint8_t *data, size_t size) override {
+    Stats::ScopedTimer timer(Stats::FILE_WRITE);
+    Stats::add(Stats::BYTES_OUT, size);
+    file_.write(reinterpret_cast<const char *>(data), size);
+    if (!file_)
+      throw std::runtime_error("Failed to write file: " + path_);
+  }
+
+  // Flushes the file, reporting anything that failed
+  void close() {
+    Stats::ScopedTimer timer(Stats::FILE_WRITE);
+    file_.close();
+    if (!file_)
+      throw std::runtime_error("Failed to write file: " + path_);
+  }
+
+private:
+  std::ofstream file_;
+  std::string path_;
+};
+
+// Appends to a vector, which grows as needed
+class VectorByteWriter : public ByteWriter {
+public:
+  explicit VectorByteWriter(std::vector<uint8_t> &out) : out_(out) {}
+
+  void write(const uint8_t *data, size_t size) override {
+    Stats::add(Stats::BYTES_OUT, size);
+    out_.insert(out_.end(), data, data + size);
+  }
+
+private:
+  std::vector<uint8_t> &out_;
+};
+
+// Fills a fixed buffer; running out of room throws
+class BufferByteWriter : public ByteWriter {
+public:
+  BufferByteWriter(uint8_t *buffer, size_t capacity)
+      : buffer_(buffer), capacity_(capacity), size_(0) {}
+
+  void write(const uint8_t *data, size_t size) override {
+    if (size > capacity_ - size_)
+      throw std::runtime_error("Output buffer is too small");
+    Stats::add(Stats::BYTES_OUT, size);
+    if (size > 0)
+      std::memcpy(buffer_ + size_, data, size);
+    size_ += size;
+  }
+
+  // Bytes written so far
+  size_t size() const { return size_; }
+
+private:
+  uint8_t *buffer_;
+  size_t capacity_;
+  size_t size_;
+};
+
+#endif // BYTE_WRITER_HPP
@@ -18,17 +18,49 @@ public:
     return crc ^ 0xFFFFFFFF;
   }
 
-  // Adler32 implementation
-  static uint32_t adler32(const uint8_t *data, size_t length) {
+  // Adler32 implementation. `adler` continues a previous checksum.
+  static uint32_t adler32(const uint8_t *data, size_t length,
+                          uint32_t adler = 1) {
     const uint32_t MOD_ADLER = 65521;
-    uint32_t a = 1, b = 0;
-    for (size_t i = 0; i < length; ++i) {
-      a = (a + data[i]) % MOD_ADLER;
-      b = (b + a) % MOD_ADLER;
+    // Largest n such that 255n(n+1)/2 + (n+1)(MOD_ADLER-1) fits in 32 bits,
+    // so the modulo only has to run once per block
+    const size_t NMAX = 5552;
+    uint32_t a = adler & 0xFFFF, b = adler >> 16;
+    while (length > 0) {
+      size_t n = length < NMAX ? length : NMAX;
+      length -= n;
+      for (size_t i = 0; i < n; ++i) {
+        a += data[i];
+        b += a;
+      }
+      data += n;
+      a %= MOD_ADLER;
+      b %= MOD_ADLER;
     }
     return (b << 16) | a;
   }
 
+  // Adler32 of the concatenation of two blocks, given the checksum of each
+  // and the length of the second (as zlib's adler32_combine)
+  static uint32_t adler32Combine(uint32_t adler1, uint32_t adler2,
+                                 uint64_t length2) {
+    const uint32_t MOD_ADLER = 65521;
+    uint32_t rem = static_cast<uint32_t>(length2 % MOD_ADLER);
+    uint32_t sum1 = adler1 & 0xFFFF;
+    uint32_t sum2 = static_cast<uint32_t>((uint64_t(rem) * sum1) % MOD_ADLER);
+    sum1 += (adler2 & 0xFFFF) + MOD_ADLER - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + MOD_ADLER - rem;
+    if (sum1 >= MOD_ADLER)
+      sum1 -= MOD_ADLER;
+    if (sum1 >= MOD_ADLER)
+      sum1 -= MOD_ADLER;
+    if (sum2 >= (MOD_ADLER << 1))
+      sum2 -= (MOD_ADLER << 1);
+    if (sum2 >= MOD_ADLER)
+      sum2 -= MOD_ADLER;
+    return (sum2 << 16) | sum1;
+  }
+
 private:
   static std::array<uint32_t, 256> generateCrc32Table() {
     std::array<uint32_t, 256> table;
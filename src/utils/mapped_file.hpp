@@ -0,0 +1,81 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MAPPED_FILE_POSIX 1
+#endif
+
+// Read-only view of a whole input file. Uses mmap where available so the
+// decoders can parse chunk payloads and entropy-coded data in place; if the
+// file cannot be mapped it is read into an owned buffer instead.
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &path)
+      : data_(nullptr), size_(0), map_(nullptr) {
+#ifdef MAPPED_FILE_POSIX
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+      struct stat st;
+      if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *p = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ,
+                         MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+          map_ = p;
+          data_ = static_cast<const uint8_t *>(p);
+          size_ = static_cast<size_t>(st.st_size);
+          ::madvise(p, size_, MADV_SEQUENTIAL);
+        }
+      }
+      ::close(fd);
+      if (map_)
+        return;
+    }
+#endif
+
+    // Fallback: read the whole file
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+      throw std::runtime_error("Could not open file: " + path);
+    }
+    std::streamsize size = file.tellg();
+    file.seekg(0, std::ios::beg);
+    buffer_.resize(static_cast<size_t>(size));
+    if (size > 0 && !file.read(reinterpret_cast<char *>(buffer_.data()), size)) {
+      throw std::runtime_error("Failed to read file: " + path);
+    }
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+  }
+
+  ~MappedFile() {
+#ifdef MAPPED_FILE_POSIX
+    if (map_)
+      ::munmap(map_, size_);
+#endif
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  const uint8_t *data_;
+  size_t size_;
+  void *map_;                   // Non-null when the file is memory-mapped
+  std::vector<uint8_t> buffer_; // Owned copy when mapping is unavailable
+};
+
+#endif // MAPPED_FILE_HPP
@@ -0,0 +1,147 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+
+// Process-wide stage timers and counters. Collection is off until enable()
+// is called; until then a ScopedTimer or add() costs one relaxed atomic
+// load. Totals are atomics shared by all threads, so a stage that runs on
+// several threads reports the sum of their time, which can exceed the wall
+// clock. Timers are placed per MCU, row or call rather than per pixel to
+// keep the cost of measuring small next to the work measured.
+class Stats {
+public:
+  enum Stage {
+    PARSE,          // PNG chunks and JPEG marker segments
+    INFLATE,        // Including zlib framing
+    UNFILTER,
+    FILTER,         // Filter choice and filtering
+    DEFLATE,        // Including zlib framing and Adler-32
+    COLOR_CONVERT,  // RGB <-> YCbCr, chroma down- and upsampling
+    DCT,            // Forward or inverse, with (de)quantization folded in
+    ENTROPY_ENCODE, // JPEG Huffman coding
+    ENTROPY_DECODE, // JPEG Huffman decoding
+    FILE_WRITE,
+    STAGE_COUNT
+  };
+
+  enum Counter {
+    BYTES_IN,        // Encoded input handed to the decoders
+    BYTES_OUT,       // Encoded output passed to a ByteWriter
+    BLOCKS,          // JPEG 8x8 blocks coded or decoded
+    SYMBOLS_DECODED, // Huffman symbols in sequential JPEG scans
+    COUNTER_COUNT
+  };
+
+  static void enable() { enabled_.store(true, std::memory_order_relaxed); }
+  static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+
+  static void add(Counter counter, uint64_t n) {
+    if (enabled())
+      counters_[counter].fetch_add(n, std::memory_order_relaxed);
+  }
+
+  // Counts a decoded block whose last nonzero coefficient is at zigzag
+  // position `lastIndex`
+  static void addEob(int lastIndex) {
+    if (enabled())
+      eobs_[lastIndex].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  static void addTime(Stage stage, uint64_t nanoseconds) {
+    if (enabled())
+      nanoseconds_[stage].fetch_add(nanoseconds, std::memory_order_relaxed);
+  }
+
+  // Monotonic clock in nanoseconds, never 0
+  static uint64_t now() {
+    return static_cast<uint64_t>(
+               std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+                   .count()) |
+           1;
+  }
+
+  // Adds the time from construction to destruction to a stage
+  class ScopedTimer {
+  public:
+    explicit ScopedTimer(Stage stage)
+        : stage_(stage), start_(enabled() ? now() : 0) {}
+    ~ScopedTimer() {
+      if (start_)
+        addTime(stage_, now() - start_);
+    }
+
+    ScopedTimer(const ScopedTimer &) = delete;
+    ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+  private:
+    Stage stage_;
+    uint64_t start_;
+  };
+
+  static void writeText(std::ostream &out) {
+    out << "Stage times (ms, summed over threads):" << std::endl;
+    for (int s = 0; s < STAGE_COUNT; ++s) {
+      out << "  " << std::left << std::setw(16) << STAGE_NAMES[s] << std::right
+          << std::fixed << std::setprecision(3)
+          << nanoseconds_[s].load() / 1e6 << std::endl;
+    }
+    out.unsetf(std::ios::floatfield);
+    out << "Counters:" << std::endl;
+    for (int c = 0; c < COUNTER_COUNT; ++c) {
+      out << "  " << std::left << std::setw(16) << COUNTER_NAMES[c]
+          << std::right << counters_[c].load() << std::endl;
+    }
+    bool anyEob = false;
+    for (int k = 0; k < 64; ++k) {
+      if (eobs_[k].load() == 0)
+        continue;
+      if (!anyEob) {
+        out << "Last nonzero coefficient of decoded blocks (zigzag index: "
+               "blocks):"
+            << std::endl;
+        anyEob = true;
+      }
+      out << "  " << std::setw(2) << k << ": " << eobs_[k].load() << std::endl;
+    }
+  }
+
+  static void writeJson(std::ostream &out) {
+    out << "{\"stages_ms\": {";
+    for (int s = 0; s < STAGE_COUNT; ++s) {
+      out << (s ? ", " : "") << '"' << STAGE_NAMES[s]
+          << "\": " << nanoseconds_[s].load() / 1e6;
+    }
+    out << "}, \"counters\": {";
+    for (int c = 0; c < COUNTER_COUNT; ++c) {
+      out << (c ? ", " : "") << '"' << COUNTER_NAMES[c]
+          << "\": " << counters_[c].load();
+    }
+    out << "}, \"eob_histogram\": [";
+    for (int k = 0; k < 64; ++k)
+      out << (k ? ", " : "") << eobs_[k].load();
+    out << "]}" << std::endl;
+  }
+
+private:
+  static constexpr const char *STAGE_NAMES[STAGE_COUNT] = {
+      "parse",         "inflate",        "unfilter",
+      "filter",        "deflate",        "color_convert",
+      "dct",           "entropy_encode", "entropy_decode",
+      "file_write"};
+  static constexpr const char *COUNTER_NAMES[COUNTER_COUNT] = {
+      "bytes_in", "bytes_out", "blocks", "symbols_decoded"};
+
+  static inline std::atomic<bool> enabled_{false};
+  static inline std::atomic<uint64_t> nanoseconds_[STAGE_COUNT] = {};
+  static inline std::atomic<uint64_t> counters_[COUNTER_COUNT] = {};
+  static inline std::atomic<uint64_t> eobs_[64] = {};
+};
+
+#endif // STATS_HPP
@@ -0,0 +1,130 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size pool of worker threads. A pool of size n runs n - 1 workers;
+// the thread calling parallelFor() takes part as the n-th.
+class ThreadPool {
+public:
+  explicit ThreadPool(int threads) : stop_(false) {
+    for (int i = 1; i < threads; ++i)
+      workers_.emplace_back([this] { workerLoop(); });
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread &t : workers_)
+      t.join();
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  int size() const { return static_cast<int>(workers_.size()) + 1; }
+
+  // Number of threads to use for a requested count; 0 means one per core
+  static int resolveThreads(int requested) {
+    if (requested > 0)
+      return requested;
+    unsigned cores = std::thread::hardware_concurrency();
+    return cores > 0 ? static_cast<int>(cores) : 1;
+  }
+
+  // Calls fn(i) for every i in [0, count), spread over the pool, and
+  // returns once all calls have finished. Indices are handed out in
+  // increasing order. The first exception thrown by fn is rethrown here.
+  void parallelFor(size_t count, const std::function<void(size_t)> &fn) {
+    if (count == 0)
+      return;
+    if (workers_.empty() || count == 1) {
+      for (size_t i = 0; i < count; ++i)
+        fn(i);
+      return;
+    }
+
+    auto job = std::make_shared<Job>(count, fn);
+    size_t helpers = std::min(workers_.size(), count - 1);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (size_t i = 0; i < helpers; ++i)
+        tasks_.push_back([job] { job->run(); });
+    }
+    wake_.notify_all();
+
+    job->run();
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->finished.wait(lock, [&] { return job->done == job->count; });
+    if (job->error)
+      std::rethrow_exception(job->error);
+  }
+
+private:
+  struct Job {
+    Job(size_t n, const std::function<void(size_t)> &f)
+        : count(n), fn(f), next(0), done(0) {}
+
+    void run() {
+      for (;;) {
+        size_t i = next.fetch_add(1);
+        if (i >= count)
+          return;
+        try {
+          fn(i);
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(mutex);
+          if (!error)
+            error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (++done == count)
+          finished.notify_all();
+      }
+    }
+
+    const size_t count;
+    const std::function<void(size_t)> &fn; // Outlives the job's last call
+    std::atomic<size_t> next;
+    size_t done;
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable finished;
+  };
+
+  void workerLoop() {
+    for (;;) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+        if (stop_ && tasks_.empty())
+          return;
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+      }
+      task();
+    }
+  }
+
+  std::vector<std::thread> workers_;
+  std::deque<std::function<void()>> tasks_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool stop_;
+};
+
+#endif // THREAD_POOL_HPP
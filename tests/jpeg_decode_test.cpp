@@ -0,0 +1,462 @@
+// Decodes JPEGs with JpegDecoder under each option and checks the output
+// against a plain single-threaded decode of the same file, and that damaged
+// files are rejected. Progressive files in tests/data are checked against
+// baseline twins that hold the same quantized coefficients.
+#include "jpeg_decoder.hpp"
+#include "jpeg_encoder.hpp"
+#include "utils/byte_writer.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+// Fixtures, relative to the repository root that make test runs from
+const std::string DATA_DIR = "tests/data/";
+
+void check(bool ok, const std::string &what) {
+  if (!ok) {
+    std::cerr << "FAIL: " << what << std::endl;
+    ++failures;
+  }
+}
+
+bool samePixels(const Image &a, const Image &b) {
+  return a.width == b.width && a.height == b.height &&
+         a.channels == b.channels && a.data == b.data;
+}
+
+// Smooth color fields with a little noise, like a photo
+Image photoImage(int width, int height) {
+  Image img(width, height, 3);
+  uint32_t seed = 7;
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      uint8_t *p = &img.data[(static_cast<size_t>(y) * width + x) * 3];
+      seed = seed * 1103515245 + 12345;
+      int noise = static_cast<int>((seed >> 16) & 7) - 4;
+      double r = 128 + 90 * std::sin(x / 13.0) * std::cos(y / 17.0);
+      double g = 128 + 90 * std::cos((x + y) / 23.0);
+      double b = 128 + 90 * std::sin((x - y) / 19.0);
+      p[0] = static_cast<uint8_t>(r + noise);
+      p[1] = static_cast<uint8_t>(g + noise);
+      p[2] = static_cast<uint8_t>(b + noise);
+    }
+  }
+  return img;
+}
+
+std::string tempPath() {
+  return (std::filesystem::temp_directory_path() / "jpeg_decode_test.jpg")
+      .string();
+}
+
+std::vector<uint8_t> encodeBytes(const Image &img,
+                                 const JpegEncoder::Options &options) {
+  std::vector<uint8_t> bytes;
+  VectorByteWriter out(bytes);
+  JpegEncoder::encode(img, out, options);
+  return bytes;
+}
+
+Image decodeBytes(const std::vector<uint8_t> &jpeg,
+                  const JpegDecoder::Options &options) {
+  return JpegDecoder::decode(jpeg.data(), jpeg.size(), options);
+}
+
+std::vector<uint8_t> readFixture(const std::string &name) {
+  std::ifstream file(DATA_DIR + name, std::ios::binary);
+  return std::vector<uint8_t>((std::istreambuf_iterator<char>(file)),
+                              std::istreambuf_iterator<char>());
+}
+
+JpegDecoder::Options withThreads(int threads) {
+  JpegDecoder::Options options;
+  options.threads = threads;
+  return options;
+}
+
+// Restart intervals decoded in parallel must match a sequential decode
+void testRestartThreads(const std::string &name, const Image &img) {
+  const JpegEncoder::Subsampling modes[] = {JpegEncoder::SUBSAMPLING_444,
+                                            JpegEncoder::SUBSAMPLING_420};
+  const int intervals[] = {1, 3, 7};
+  for (JpegEncoder::Subsampling mode : modes) {
+    for (int interval : intervals) {
+      std::string what = name + " subsampling " + std::to_string(mode) +
+                         " restart " + std::to_string(interval);
+      try {
+        JpegEncoder::Options options;
+        options.subsampling = mode;
+        options.restartInterval = interval;
+        std::vector<uint8_t> jpeg = encodeBytes(img, options);
+        Image single = decodeBytes(jpeg, withThreads(1));
+        Image parallel = decodeBytes(jpeg, withThreads(4));
+        check(single.width == img.width && single.height == img.height,
+              what + " size");
+        check(samePixels(single, parallel), what + " threads 4");
+      } catch (const std::exception &e) {
+        check(false, what + ": " + e.what());
+      }
+    }
+  }
+}
+
+// With fewer restart intervals than threads, one thread entropy decodes
+// while the others reconstruct; the rows must come out as in one thread
+void testPipelined(const std::string &name, const Image &img) {
+  const JpegEncoder::Subsampling modes[] = {JpegEncoder::SUBSAMPLING_444,
+                                            JpegEncoder::SUBSAMPLING_420};
+  // No restarts, and a few long intervals the entropy decoder crosses
+  const int intervals[] = {0, 20};
+  for (JpegEncoder::Subsampling mode : modes) {
+    for (int interval : intervals) {
+      std::string what = name + " subsampling " + std::to_string(mode) +
+                         " restart " + std::to_string(interval) + " pipelined";
+      try {
+        JpegEncoder::Options options;
+        options.subsampling = mode;
+        options.restartInterval = interval;
+        std::vector<uint8_t> jpeg = encodeBytes(img, options);
+        Image single = decodeBytes(jpeg, withThreads(1));
+        for (int threads : {2, 4}) {
+          check(samePixels(single, decodeBytes(jpeg, withThreads(threads))),
+                what + " threads " + std::to_string(threads));
+        }
+      } catch (const std::exception &e) {
+        check(false, what + ": " + e.what());
+      }
+    }
+  }
+}
+
+// Dropping an RSTn marker must be reported, not decoded as garbage
+void testMissingRestart(const std::string &name, const Image &img) {
+  JpegEncoder::Options options;
+  options.restartInterval = 2;
+  std::vector<uint8_t> jpeg = encodeBytes(img, options);
+  for (size_t pos = jpeg.size() - 2; pos > 2; --pos) {
+    if (jpeg[pos] == 0xFF && jpeg[pos + 1] >= 0xD0 && jpeg[pos + 1] <= 0xD7) {
+      jpeg.erase(jpeg.begin() + pos, jpeg.begin() + pos + 2);
+      break;
+    }
+  }
+  for (int threads : {1, 4}) {
+    bool rejected = false;
+    try {
+      decodeBytes(jpeg, withThreads(threads));
+    } catch (const std::exception &) {
+      rejected = true;
+    }
+    check(rejected,
+          name + " missing RSTn threads " + std::to_string(threads));
+  }
+}
+
+// Offset of the first header segment with this marker, 0 if there is none
+size_t findSegment(const std::vector<uint8_t> &jpeg, uint8_t marker) {
+  size_t pos = 2; // Skip SOI
+  while (pos + 4 <= jpeg.size() && jpeg[pos] == 0xFF) {
+    if (jpeg[pos + 1] == marker)
+      return pos;
+    pos += 2 + ((jpeg[pos + 2] << 8) | jpeg[pos + 3]);
+  }
+  return 0;
+}
+
+bool rejects(const std::vector<uint8_t> &jpeg) {
+  try {
+    decodeBytes(jpeg, JpegDecoder::Options());
+  } catch (const std::exception &) {
+    return true;
+  }
+  return false;
+}
+
+// Scans that select a table no DHT defined, and AC symbols with a run but
+// no size other than ZRL, must be rejected instead of decoded
+void testMalformed(const std::string &name, const Image &img) {
+  const std::vector<uint8_t> jpeg = encodeBytes(img, JpegEncoder::Options());
+
+  // The first component's selectors follow the length, count and its id
+  size_t sos = findSegment(jpeg, 0xDA);
+  check(sos > 0, name + " has an SOS segment");
+  std::vector<uint8_t> undefinedDc = jpeg;
+  undefinedDc[sos + 6] = 0x20;
+  check(rejects(undefinedDc), name + " undefined DC table");
+  std::vector<uint8_t> undefinedAc = jpeg;
+  undefinedAc[sos + 6] = 0x03;
+  check(rejects(undefinedAc), name + " undefined AC table");
+
+  // Give the shortest luma AC code (symbol 0x01) the symbol 0x10 instead
+  std::vector<uint8_t> runWithoutSize = jpeg;
+  size_t dht = findSegment(jpeg, 0xC4);
+  check(dht > 0, name + " has a DHT segment");
+  size_t end = dht + 2 + ((jpeg[dht + 2] << 8) | jpeg[dht + 3]);
+  for (size_t pos = dht + 4; dht > 0 && pos < end;) {
+    uint8_t info = jpeg[pos];
+    size_t symbols = 0;
+    for (int i = 1; i <= 16; ++i)
+      symbols += jpeg[pos + i];
+    if (info == 0x10) {
+      runWithoutSize[pos + 17] = 0x10;
+      break;
+    }
+    pos += 17 + symbols;
+  }
+  check(runWithoutSize != jpeg, name + " has a luma AC table");
+  check(rejects(runWithoutSize), name + " AC run without size");
+}
+
+// Mean absolute difference between `scaled` and `full` shrunk by averaging
+// scale x scale boxes, or -1 if the sizes do not match
+double scaledDifference(const Image &scaled, const Image &full, int scale) {
+  if (scaled.width != (full.width + scale - 1) / scale ||
+      scaled.height != (full.height + scale - 1) / scale ||
+      scaled.channels != full.channels)
+    return -1;
+  double sum = 0;
+  for (int y = 0; y < scaled.height; ++y) {
+    for (int x = 0; x < scaled.width; ++x) {
+      for (int c = 0; c < full.channels; ++c) {
+        int total = 0, count = 0;
+        for (int fy = y * scale; fy < std::min(full.height, (y + 1) * scale);
+             ++fy) {
+          for (int fx = x * scale; fx < std::min(full.width, (x + 1) * scale);
+               ++fx) {
+            total += full.data[((size_t)fy * full.width + fx) * 3 + c];
+            ++count;
+          }
+        }
+        int sample = scaled.data[((size_t)y * scaled.width + x) * 3 + c];
+        sum += std::abs(sample - static_cast<double>(total) / count);
+      }
+    }
+  }
+  return sum / scaled.data.size();
+}
+
+// Scaled decodes are 1/scale of the full size, rounded up. Without
+// subsampling they also look like a box-filtered full decode; subsampled
+// chroma is reduced by the same factor, so it keeps less detail than that.
+void testScale(const std::string &name, const std::vector<uint8_t> &jpeg,
+               bool compareBoxes) {
+  Image full;
+  try {
+    full = decodeBytes(jpeg, withThreads(1));
+  } catch (const std::exception &e) {
+    check(false, name + ": " + e.what());
+    return;
+  }
+  for (int scale : {2, 4, 8}) {
+    std::string what = name + " scale " + std::to_string(scale);
+    try {
+      JpegDecoder::Options options;
+      options.scale = scale;
+      Image scaled = decodeBytes(jpeg, options);
+      double diff = scaledDifference(scaled, full, scale);
+      check(diff >= 0, what + " size");
+      if (compareBoxes)
+        check(diff <= 2, what + " pixels");
+      options.threads = 4;
+      check(samePixels(decodeBytes(jpeg, options), scaled),
+            what + " threads 4");
+    } catch (const std::exception &e) {
+      check(false, what + ": " + e.what());
+    }
+  }
+
+  bool rejected = false;
+  try {
+    JpegDecoder::Options options;
+    options.scale = 3;
+    decodeBytes(jpeg, options);
+  } catch (const std::exception &) {
+    rejected = true;
+  }
+  check(rejected, name + " scale 3");
+}
+
+// The w x h pixels of `img` from (x, y)
+Image subImage(const Image &img, int x, int y, int w, int h) {
+  Image sub(w, h, img.channels);
+  size_t rowBytes = static_cast<size_t>(w) * img.channels;
+  for (int row = 0; row < h; ++row) {
+    const uint8_t *src =
+        &img.data[((static_cast<size_t>(y) + row) * img.width + x) *
+                  img.channels];
+    std::copy(src, src + rowBytes, &sub.data[row * rowBytes]);
+  }
+  return sub;
+}
+
+// A cropped decode must be exactly the matching window of a full decode at
+// the same scale, whatever MCUs and restart intervals it skips
+void testCrop(const std::string &name, const std::vector<uint8_t> &jpeg) {
+  struct Region {
+    int x, y, width, height;
+  };
+  const Region regions[] = {
+      {16, 16, 32, 16}, // MCU-aligned
+      {13, 7, 21, 17},  // Unaligned
+      {30, 20, 0, 0},   // To the right and bottom edges
+      {40, 5, 500, 9},  // Clipped to the image
+      {0, 0, 1, 1},     // One pixel
+  };
+  for (int scale : {1, 2}) {
+    Image full;
+    try {
+      JpegDecoder::Options options;
+      options.scale = scale;
+      full = decodeBytes(jpeg, options);
+    } catch (const std::exception &e) {
+      check(false, name + ": " + e.what());
+      return;
+    }
+    int width = full.width * scale, height = full.height * scale;
+    for (const Region &region : regions) {
+      std::string what = name + " scale " + std::to_string(scale) + " crop " +
+                         std::to_string(region.x) + "," +
+                         std::to_string(region.y) + "," +
+                         std::to_string(region.width) + "," +
+                         std::to_string(region.height);
+      int x1 = region.width > 0 ? std::min(region.x + region.width, width)
+                                : width;
+      int y1 = region.height > 0 ? std::min(region.y + region.height, height)
+                                 : height;
+      int x = region.x / scale, y = region.y / scale;
+      Image expected = subImage(full, x, y, (x1 + scale - 1) / scale - x,
+                                (y1 + scale - 1) / scale - y);
+      for (int threads : {1, 4}) {
+        try {
+          JpegDecoder::Options options;
+          options.scale = scale;
+          options.threads = threads;
+          options.cropX = region.x;
+          options.cropY = region.y;
+          options.cropWidth = region.width;
+          options.cropHeight = region.height;
+          check(samePixels(decodeBytes(jpeg, options), expected),
+                what + " threads " + std::to_string(threads));
+        } catch (const std::exception &e) {
+          check(false, what + ": " + e.what());
+        }
+      }
+    }
+  }
+}
+
+// JpegDecoder::Stream hands out the same rows decode() returns
+void testStream(const std::string &name, const std::vector<uint8_t> &jpeg,
+                const JpegDecoder::Options &options) {
+  std::string what = name + " Stream";
+  std::string path = tempPath();
+  try {
+    Image expected = decodeBytes(jpeg, options);
+    {
+      std::ofstream file(path, std::ios::binary);
+      file.write(reinterpret_cast<const char *>(jpeg.data()), jpeg.size());
+    }
+    JpegDecoder::Stream stream(path, options);
+    Image streamed(stream.width(), stream.height(), stream.channels());
+    size_t stride = static_cast<size_t>(streamed.width) * streamed.channels;
+    int nextRow = 0;
+    stream.decodeRows([&](int y, const uint8_t *row) {
+      check(y == nextRow++, what + " row order");
+      std::copy(row, row + stride, &streamed.data[y * stride]);
+    });
+    check(nextRow == streamed.height, what + " row count");
+    check(samePixels(streamed, expected), what);
+  } catch (const std::exception &e) {
+    check(false, what + ": " + e.what());
+  }
+  std::error_code ec;
+  std::filesystem::remove(path, ec);
+}
+
+// The progressive fixtures were written by libjpeg from the same pixels and
+// quantization tables as their baseline twins, using its default scan
+// script: spectral selection, EOB runs and successive approximation
+// refinement. The coefficients end up identical, so the pixels must be too.
+void testProgressive() {
+  const char *const twins[][2] = {
+      {"progressive_444.jpg", "baseline_444.jpg"},
+      {"progressive_420.jpg", "baseline_420.jpg"},
+      {"progressive_420_restart.jpg", "baseline_420.jpg"},
+      {"progressive_gray.jpg", "baseline_gray.jpg"},
+  };
+  for (const auto &twin : twins) {
+    std::string what = twin[0];
+    try {
+      Image baseline = JpegDecoder::decode(DATA_DIR + twin[1]);
+      check(baseline.width == 45 && baseline.height == 29, what + " size");
+      for (int threads : {1, 4}) {
+        Image progressive =
+            JpegDecoder::decode(DATA_DIR + twin[0], withThreads(threads));
+        check(samePixels(progressive, baseline),
+              what + " threads " + std::to_string(threads));
+      }
+    } catch (const std::exception &e) {
+      check(false, what + ": " + e.what());
+    }
+  }
+}
+
+} // namespace
+
+int main() {
+  Image small = photoImage(64, 48);
+  Image odd = photoImage(100, 75);
+  testRestartThreads("64x48", small);
+  testRestartThreads("100x75", odd);
+  testPipelined("64x48", small);
+  testPipelined("100x75", odd);
+  testMissingRestart("100x75", odd);
+  testMalformed("64x48", small);
+  testProgressive();
+
+  JpegEncoder::Options subsampled;
+  subsampled.subsampling = JpegEncoder::SUBSAMPLING_420;
+  testScale("100x75", encodeBytes(odd, JpegEncoder::Options()), true);
+  testScale("100x75 subsampling 420", encodeBytes(odd, subsampled), false);
+  testScale("progressive_420.jpg", readFixture("progressive_420.jpg"), false);
+
+  JpegEncoder::Options restarts = subsampled;
+  restarts.restartInterval = 2;
+  testCrop("100x75", encodeBytes(odd, JpegEncoder::Options()));
+  testCrop("100x75 subsampling 420 restart 2", encodeBytes(odd, restarts));
+  testCrop("progressive_444.jpg", readFixture("progressive_444.jpg"));
+  testCrop("progressive_gray.jpg", readFixture("progressive_gray.jpg"));
+
+  JpegDecoder::Options scaledCrop;
+  scaledCrop.scale = 2;
+  scaledCrop.cropX = 13;
+  scaledCrop.cropY = 7;
+  scaledCrop.cropWidth = 41;
+  scaledCrop.cropHeight = 30;
+  testStream("100x75", encodeBytes(odd, JpegEncoder::Options()),
+             JpegDecoder::Options());
+  testStream("100x75 subsampling 420 restart 2", encodeBytes(odd, restarts),
+             JpegDecoder::Options());
+  testStream("100x75 scale 2 crop", encodeBytes(odd, restarts), scaledCrop);
+  testStream("progressive_420.jpg", readFixture("progressive_420.jpg"),
+             JpegDecoder::Options());
+  testStream("progressive_gray.jpg", readFixture("progressive_gray.jpg"),
+             JpegDecoder::Options());
+
+  if (failures > 0) {
+    std::cerr << failures << " JPEG decode check(s) failed." << std::endl;
+    return 1;
+  }
+  std::cout << "All JPEG decode checks passed." << std::endl;
+  return 0;
+}
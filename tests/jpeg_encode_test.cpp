@@ -0,0 +1,323 @@
+// Encodes images with JpegEncoder under each option and decodes them with
+// JpegDecoder, comparing against the output of the default options. Options
+// that only change how the coefficients are coded must decode to the same
+// pixels; the others must stay within the quantization error.
+#include "jpeg_decoder.hpp"
+#include "jpeg_encoder.hpp"
+#include "utils/byte_writer.hpp"
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+// Quantization error allowed at the default quality, per sample: on average
+// and at worst
+const double MEAN_TOLERANCE = 4.0;
+const int MAX_TOLERANCE = 40;
+
+void check(bool ok, const std::string &what) {
+  if (!ok) {
+    std::cerr << "FAIL: " << what << std::endl;
+    ++failures;
+  }
+}
+
+// Smooth color fields with a little noise, like a photo
+Image photoImage(int width, int height) {
+  Image img(width, height, 3);
+  uint32_t seed = 7;
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      uint8_t *p = &img.data[(static_cast<size_t>(y) * width + x) * 3];
+      seed = seed * 1103515245 + 12345;
+      int noise = static_cast<int>((seed >> 16) & 7) - 4;
+      double r = 128 + 90 * std::sin(x / 13.0) * std::cos(y / 17.0);
+      double g = 128 + 90 * std::cos((x + y) / 23.0);
+      double b = 128 + 90 * std::sin((x - y) / 19.0);
+      p[0] = static_cast<uint8_t>(r + noise);
+      p[1] = static_cast<uint8_t>(g + noise);
+      p[2] = static_cast<uint8_t>(b + noise);
+    }
+  }
+  return img;
+}
+
+struct Encoded {
+  std::vector<uint8_t> bytes;
+  Image decoded;
+};
+
+std::vector<uint8_t> encodeBytes(const Image &img,
+                                 const JpegEncoder::Options &options) {
+  std::vector<uint8_t> bytes;
+  VectorByteWriter out(bytes);
+  JpegEncoder::encode(img, out, options);
+  return bytes;
+}
+
+Image decodeBytes(const std::vector<uint8_t> &jpeg) {
+  return JpegDecoder::decode(jpeg.data(), jpeg.size());
+}
+
+Encoded encodeDecode(const Image &img, const JpegEncoder::Options &options) {
+  Encoded result;
+  result.bytes = encodeBytes(img, options);
+  result.decoded = decodeBytes(result.bytes);
+  return result;
+}
+
+bool withinTolerance(const Image &a, const Image &b) {
+  if (a.width != b.width || a.height != b.height || a.channels != b.channels)
+    return false;
+  double sum = 0;
+  int largest = 0;
+  for (size_t i = 0; i < a.data.size(); ++i) {
+    int diff = std::abs(a.data[i] - b.data[i]);
+    sum += diff;
+    if (diff > largest)
+      largest = diff;
+  }
+  double mean = a.data.empty() ? 0 : sum / a.data.size();
+  return mean <= MEAN_TOLERANCE && largest <= MAX_TOLERANCE;
+}
+
+bool samePixels(const Image &a, const Image &b) {
+  return a.width == b.width && a.height == b.height &&
+         a.channels == b.channels && a.data == b.data;
+}
+
+// Checks every DHT segment before the scan: the 16 code length counts must
+// describe a prefix code that leaves the all-ones code of 16 bits unused,
+// with a symbol for each code. Lengths past 16 cannot be expressed at all.
+bool validHuffmanTables(const std::vector<uint8_t> &jpeg) {
+  size_t pos = 2;
+  int tables = 0;
+  while (pos + 4 <= jpeg.size() && jpeg[pos] == 0xFF) {
+    int marker = jpeg[pos + 1];
+    size_t end = pos + 2 + ((jpeg[pos + 2] << 8) | jpeg[pos + 3]);
+    if (end > jpeg.size())
+      return false;
+    if (marker == 0xDA)
+      break;
+    if (marker == 0xC4) {
+      size_t p = pos + 4;
+      while (p < end) {
+        if (p + 17 > end)
+          return false;
+        uint32_t kraft = 0; // Sum of 2^(16 - length) over all codes
+        size_t symbols = 0;
+        for (int len = 1; len <= 16; ++len) {
+          kraft += jpeg[p + len] << (16 - len);
+          symbols += jpeg[p + len];
+        }
+        if (kraft >= (1u << 16) || symbols == 0 || symbols > 256)
+          return false;
+        p += 17 + symbols;
+        ++tables;
+      }
+      if (p != end)
+        return false;
+    }
+    pos = end;
+  }
+  return tables > 0;
+}
+
+void testSubsampling(const std::string &name, const Image &img,
+                     const Encoded &reference) {
+  const JpegEncoder::Subsampling modes[] = {JpegEncoder::SUBSAMPLING_422,
+                                            JpegEncoder::SUBSAMPLING_420};
+  for (JpegEncoder::Subsampling mode : modes) {
+    std::string what = name + " subsampling " + std::to_string(mode);
+    try {
+      JpegEncoder::Options options;
+      options.subsampling = mode;
+      Encoded encoded = encodeDecode(img, options);
+      check(withinTolerance(encoded.decoded, reference.decoded), what);
+    } catch (const std::exception &e) {
+      check(false, what + ": " + e.what());
+    }
+  }
+}
+
+// Optimized tables code the same coefficients in fewer bytes
+void testOptimize(const std::string &name, const Image &img,
+                  const Encoded &reference) {
+  std::string what = name + " optimized Huffman";
+  try {
+    JpegEncoder::Options options;
+    options.optimizeHuffman = true;
+    Encoded optimized = encodeDecode(img, options);
+    check(samePixels(optimized.decoded, reference.decoded), what);
+    check(optimized.bytes.size() < reference.bytes.size(), what + " size");
+    check(validHuffmanTables(optimized.bytes), what + " tables");
+  } catch (const std::exception &e) {
+    check(false, what + ": " + e.what());
+  }
+}
+
+// The restart interval from DRI (0 without one) and the RSTn numbers in
+// the order they occur in the entropy-coded data
+void findRestarts(const std::vector<uint8_t> &jpeg, int &interval,
+                  std::vector<int> &markers) {
+  interval = 0;
+  markers.clear();
+  size_t pos = 2;
+  while (pos + 4 <= jpeg.size() && jpeg[pos] == 0xFF) {
+    int marker = jpeg[pos + 1];
+    size_t length = (jpeg[pos + 2] << 8) | jpeg[pos + 3];
+    if (marker == 0xDD && pos + 6 <= jpeg.size())
+      interval = (jpeg[pos + 4] << 8) | jpeg[pos + 5];
+    pos += 2 + length;
+    if (marker == 0xDA)
+      break;
+  }
+  for (; pos + 1 < jpeg.size(); ++pos) {
+    if (jpeg[pos] == 0xFF && jpeg[pos + 1] >= 0xD0 && jpeg[pos + 1] <= 0xD7)
+      markers.push_back(jpeg[pos + 1] - 0xD0);
+  }
+}
+
+// Restart segments are coded independently, so encoding them on several
+// threads must give the same bytes as one thread, with a RSTn marker
+// between each pair. They only reset the DC predictors, so the pixels are
+// those of the default output.
+void testRestarts(const std::string &name, const Image &img,
+                  const Encoded &reference) {
+  int mcusX = (img.width + 7) / 8;
+  int mcuCount = mcusX * ((img.height + 7) / 8);
+  const int intervals[] = {0, 1, 5};
+  for (int interval : intervals) {
+    for (bool optimize : {false, true}) {
+      std::string what = name + " restart " + std::to_string(interval) +
+                         (optimize ? " optimized" : "");
+      try {
+        JpegEncoder::Options options;
+        options.restartInterval = interval;
+        options.optimizeHuffman = optimize;
+        std::vector<uint8_t> single = encodeBytes(img, options);
+        options.threads = 4;
+        std::vector<uint8_t> parallel = encodeBytes(img, options);
+        if (interval > 0)
+          check(parallel == single, what + " threads 4");
+
+        // Without an interval, several threads use one per MCU row
+        int expected = interval > 0 ? interval : mcuCount > mcusX ? mcusX : 0;
+        int written;
+        std::vector<int> markers;
+        findRestarts(parallel, written, markers);
+        check(written == expected, what + " DRI");
+        size_t segments =
+            expected > 0 ? (mcuCount + expected - 1) / expected : 1;
+        bool inOrder = markers.size() == segments - 1;
+        for (size_t i = 0; inOrder && i < markers.size(); ++i)
+          inOrder = markers[i] == static_cast<int>(i % 8);
+        check(inOrder, what + " RSTn markers");
+        check(samePixels(decodeBytes(parallel), reference.decoded), what);
+      } catch (const std::exception &e) {
+        check(false, what + ": " + e.what());
+      }
+    }
+  }
+}
+
+// The streaming encoder codes the same MCUs one row at a time, so it must
+// write the same file as encode() on one thread
+void testStream(const std::string &name, const Image &img) {
+  const JpegEncoder::Subsampling modes[] = {JpegEncoder::SUBSAMPLING_444,
+                                            JpegEncoder::SUBSAMPLING_422,
+                                            JpegEncoder::SUBSAMPLING_420};
+  for (JpegEncoder::Subsampling mode : modes) {
+    for (int interval : {0, 3}) {
+      std::string what = name + " Stream subsampling " + std::to_string(mode) +
+                         " restart " + std::to_string(interval);
+      try {
+        JpegEncoder::Options options;
+        options.subsampling = mode;
+        options.restartInterval = interval;
+        std::vector<uint8_t> streamed;
+        VectorByteWriter out(streamed);
+        JpegEncoder::Stream stream(out, img.width, img.height, img.channels,
+                                   options);
+        size_t stride = static_cast<size_t>(img.width) * img.channels;
+        for (int y = 0; y < img.height; ++y)
+          stream.writeRow(&img.data[y * stride]);
+        stream.finish();
+        check(streamed == encodeBytes(img, options), what);
+      } catch (const std::exception &e) {
+        check(false, what + ": " + e.what());
+      }
+    }
+  }
+}
+
+// A fixed buffer takes the same bytes as a vector when they fit, and
+// refuses to overflow when they do not
+void testBuffer(const std::string &name, const Image &img,
+                const Encoded &reference) {
+  std::string what = name + " BufferByteWriter";
+  try {
+    size_t size = reference.bytes.size();
+    std::vector<uint8_t> buffer(size);
+    BufferByteWriter exact(buffer.data(), size);
+    JpegEncoder::encode(img, exact, JpegEncoder::Options());
+    check(exact.size() == size && buffer == reference.bytes, what);
+
+    bool rejected = false;
+    try {
+      BufferByteWriter small(buffer.data(), size - 1);
+      JpegEncoder::encode(img, small, JpegEncoder::Options());
+    } catch (const std::exception &) {
+      rejected = true;
+    }
+    check(rejected, what + " too small");
+  } catch (const std::exception &e) {
+    check(false, what + ": " + e.what());
+  }
+}
+
+} // namespace
+
+int main() {
+  struct Case {
+    std::string name;
+    Image image;
+  };
+  std::vector<Case> cases = {
+      {"1x1", photoImage(1, 1)},
+      {"17x9", photoImage(17, 9)},
+      {"100x75", photoImage(100, 75)},
+      {"256x160", photoImage(256, 160)},
+  };
+
+  for (const Case &c : cases) {
+    Encoded reference;
+    try {
+      reference = encodeDecode(c.image, JpegEncoder::Options());
+      check(withinTolerance(reference.decoded, c.image), c.name + " default");
+      check(validHuffmanTables(reference.bytes), c.name + " default tables");
+    } catch (const std::exception &e) {
+      check(false, c.name + " default: " + e.what());
+      continue;
+    }
+    testSubsampling(c.name, c.image, reference);
+    testOptimize(c.name, c.image, reference);
+    testRestarts(c.name, c.image, reference);
+    testStream(c.name, c.image);
+    testBuffer(c.name, c.image, reference);
+  }
+
+  if (failures > 0) {
+    std::cerr << failures << " JPEG encode check(s) failed." << std::endl;
+    return 1;
+  }
+  std::cout << "All JPEG encode checks passed." << std::endl;
+  return 0;
+}
@@ -0,0 +1,170 @@
+// Encodes images with PngEncoder and decodes them again with PngDecoder,
+// which checks that every level, filter heuristic and thread count produces
+// a valid zlib stream that inflates back to the original pixels.
+#include "png_decoder.hpp"
+#include "png_encoder.hpp"
+#include "utils/byte_writer.hpp"
+#include <cstdint>
+#include <exception>
+#include <new>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const std::string &what) {
+  if (!ok) {
+    std::cerr << "FAIL: " << what << std::endl;
+    ++failures;
+  }
+}
+
+bool samePixels(const Image &a, const Image &b) {
+  return a.width == b.width && a.height == b.height &&
+         a.channels == b.channels && a.data == b.data;
+}
+
+// Smooth gradients with some noise, which the filters can predict
+Image gradientImage(int width, int height, int channels) {
+  Image img(width, height, channels);
+  uint32_t seed = 1;
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      uint8_t *p = &img.data[(static_cast<size_t>(y) * width + x) * channels];
+      seed = seed * 1103515245 + 12345;
+      int noise = (seed >> 16) & 7;
+      for (int c = 0; c < channels; ++c)
+        p[c] = static_cast<uint8_t>(x * (c + 1) + y * 2 + noise);
+    }
+  }
+  return img;
+}
+
+// Random bytes, which DEFLATE cannot shrink
+Image noiseImage(int width, int height, int channels) {
+  Image img(width, height, channels);
+  uint32_t seed = 12345;
+  for (uint8_t &v : img.data) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    v = static_cast<uint8_t>(seed);
+  }
+  return img;
+}
+
+// One color throughout, so matches run to the maximum length
+Image flatImage(int width, int height, int channels) {
+  Image img(width, height, channels);
+  for (size_t i = 0; i < img.data.size(); ++i)
+    img.data[i] = static_cast<uint8_t>(0x40 + i % channels);
+  return img;
+}
+
+std::string describe(const std::string &name, const PngEncoder::Options &o,
+                     const char *path) {
+  return name + " level " + std::to_string(o.level) + " filter " +
+         std::to_string(o.filter) + " threads " + std::to_string(o.threads) +
+         " (" + path + ")";
+}
+
+void roundTrip(const std::string &name, const Image &img,
+               const PngEncoder::Options &options) {
+  try {
+    std::vector<uint8_t> png;
+    VectorByteWriter out(png);
+    PngEncoder::encode(img, out, options);
+    Image decoded = PngDecoder::decode(png.data(), png.size());
+    check(samePixels(img, decoded), describe(name, options, "encode"));
+  } catch (const std::exception &e) {
+    check(false, describe(name, options, "encode") + ": " + e.what());
+  }
+
+  try {
+    std::vector<uint8_t> png;
+    VectorByteWriter out(png);
+    PngEncoder::Stream stream(out, img.width, img.height, img.channels,
+                              options);
+    size_t stride = static_cast<size_t>(img.width) * img.channels;
+    for (int y = 0; y < img.height; ++y)
+      stream.writeRow(&img.data[y * stride]);
+    stream.finish();
+    Image decoded = PngDecoder::decode(png.data(), png.size());
+    check(samePixels(img, decoded), describe(name, options, "Stream"));
+  } catch (const std::exception &e) {
+    check(false, describe(name, options, "Stream") + ": " + e.what());
+  }
+}
+
+// A header claiming 65535x65535 over a tiny IDAT must be rejected as
+// truncated, not pre-size ~17 GB of output from the unvalidated dimensions
+void oversizedHeader() {
+  std::vector<uint8_t> png;
+  VectorByteWriter out(png);
+  PngEncoder::encode(gradientImage(1, 1, 3), out);
+  // Width and height follow the signature, chunk length and "IHDR"
+  for (size_t i = 16; i < 24; i += 4) {
+    png[i] = 0;
+    png[i + 1] = 0;
+    png[i + 2] = 0xFF;
+    png[i + 3] = 0xFF;
+  }
+  try {
+    PngDecoder::decode(png.data(), png.size());
+    check(false, "oversized header: decoded");
+  } catch (const std::bad_alloc &) {
+    check(false, "oversized header: allocated for the claimed size");
+  } catch (const std::exception &) {
+  }
+}
+
+} // namespace
+
+int main() {
+  struct Case {
+    std::string name;
+    Image image;
+  };
+  // The 384-pixel-wide images are 288 KiB each, enough for several parallel
+  // deflate segments
+  std::vector<Case> cases = {
+      {"1x1 RGB", gradientImage(1, 1, 3)},
+      {"1x1 RGBA", noiseImage(1, 1, 4)},
+      {"gradient 37x23 RGB", gradientImage(37, 23, 3)},
+      {"gradient 384x192 RGBA", gradientImage(384, 192, 4)},
+      {"noise 384x192 RGBA", noiseImage(384, 192, 4)},
+      {"flat 384x256 RGB", flatImage(384, 256, 3)},
+  };
+  const PngEncoder::FilterHeuristic filters[] = {PngEncoder::FILTER_NONE,
+                                                 PngEncoder::FILTER_MIN_SUM,
+                                                 PngEncoder::FILTER_ENTROPY};
+  const int threads[] = {1, 4};
+
+  int runs = 0;
+  for (const Case &c : cases) {
+    for (int level = 0; level <= 9; ++level) {
+      for (PngEncoder::FilterHeuristic filter : filters) {
+        for (int t : threads) {
+          PngEncoder::Options options;
+          options.level = level;
+          options.filter = filter;
+          options.threads = t;
+          roundTrip(c.name, c.image, options);
+          ++runs;
+        }
+      }
+    }
+  }
+
+  oversizedHeader();
+
+  if (failures > 0) {
+    std::cerr << failures << " PNG round trip(s) failed." << std::endl;
+    return 1;
+  }
+  std::cout << "All " << runs << " PNG round trips passed." << std::endl;
+  return 0;
+}